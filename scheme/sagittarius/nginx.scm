@@ -29,22 +29,64 @@
 	    nginx-request-keep-alive
 	    nginx-request-accept
 	    nginx-request-accept-language
+	    nginx-request-x-forwarded-for
+	    nginx-request-x-real-ip
+	    nginx-request-cookie
+	    nginx-request-depth
+	    nginx-request-destination
+	    nginx-request-overwrite
+	    nginx-request-date
 	    nginx-request-headers ;; alist
-	    nginx-request-cookies ;; alist
+	    nginx-request-header-ref
+	    nginx-request-header-values
+	    nginx-request-cookies ;; list of cookies
+	    nginx-request-cookie-ref
 	    nginx-request-query-string
 	    nginx-request-original-uri
 	    nginx-request-request-line
 	    ;; nginx-request-schema ;; this seems useless...
 	    nginx-request-input-port
+	    nginx-request-body-bytevector
 	    nginx-request-context
 	    nginx-request-peer-certificate
 
 	    nginx-response?
 	    nginx-response-output-port
+	    nginx-response-content-type
+	    nginx-response-content-type-set!
 	    nginx-response-headers
 	    nginx-response-header-add!
 	    nginx-response-header-set!
 	    nginx-response-header-remove!
+	    nginx-response-headers-set!
+	    nginx-response-cookie-add!
+	    nginx-response-send-file
+
+	    make-nginx-file-reference
+	    nginx-file-reference?
+
+	    nginx-socket?
+	    nginx-socket-connect
+	    nginx-socket-send
+	    nginx-socket-receive
+	    nginx-socket-close
+	    nginx-socket-release
+
+	    nginx-subrequest?
+	    nginx-subrequest
+	    nginx-subrequest-uri
+	    nginx-subrequest-status
+	    nginx-subrequest-body
+	    nginx-subrequests-wait
+
+	    nginx-shared-dict
+	    nginx-shared-dict?
+	    nginx-shared-dict-ref
+	    nginx-shared-dict-set!
+	    nginx-shared-dict-add!
+	    nginx-shared-dict-incr!
+	    nginx-shared-dict-delete!
+	    nginx-shared-dict-ttl
 
 	    nginx-context?
 	    nginx-context-path
@@ -57,23 +99,125 @@
 	    )
     (import (rnrs)
 	    (rfc cookie)
-	    (srfi :1 lists)
 	    (sagittarius)
 	    (sagittarius nginx internal))
 
 
+(define nginx-request-body-bytevector
+  (case-lambda
+   ((request) (%nginx-request-body-bytevector request #f))
+   ((request slices?) (%nginx-request-body-bytevector request slices?))))
+
+(define nginx-response-send-file
+  (case-lambda
+   ((response file) (%nginx-response-send-file response file 0 #f))
+   ((response file offset)
+    (%nginx-response-send-file response file offset #f))
+   ((response file offset length)
+    (%nginx-response-send-file response file offset length))))
+
+;; keyword arguments, e.g. :pool "redis"
+(define (option-ref options key default)
+  (cond ((memq key options) => (lambda (l) (if (pair? (cdr l)) (cadr l) default)))
+	(else default)))
+
+;; timeouts are in milliseconds
+(define (nginx-socket-connect request address callback . options)
+  (%nginx-socket-connect request address
+			 (option-ref options :timeout 60000)
+			 (option-ref options :pool #f)
+			 (option-ref options :max-idle 16)
+			 (option-ref options :idle-timeout 60000)
+			 (option-ref options :max-requests 0)
+			 callback))
+
+(define nginx-subrequest
+  (case-lambda
+   ((request uri) (%nginx-subrequest request uri #f))
+   ((request uri args) (%nginx-subrequest request uri args))))
+
+;; ttl is in milliseconds, 0 means never expires
+(define nginx-shared-dict-ref
+  (case-lambda
+   ((dict key) (%nginx-shared-dict-ref dict key #f))
+   ((dict key default) (%nginx-shared-dict-ref dict key default))))
+
+(define nginx-shared-dict-set!
+  (case-lambda
+   ((dict key value) (%nginx-shared-dict-store! dict key value 0 #f))
+   ((dict key value ttl) (%nginx-shared-dict-store! dict key value ttl #f))))
+
+(define nginx-shared-dict-add!
+  (case-lambda
+   ((dict key value) (%nginx-shared-dict-store! dict key value 0 #t))
+   ((dict key value ttl) (%nginx-shared-dict-store! dict key value ttl #t))))
+
+(define nginx-shared-dict-incr!
+  (case-lambda
+   ((dict key delta) (%nginx-shared-dict-incr! dict key delta #f 0))
+   ((dict key delta init) (%nginx-shared-dict-incr! dict key delta init 0))
+   ((dict key delta init ttl)
+    (%nginx-shared-dict-incr! dict key delta init ttl))))
+
+;; body element which is sent by nginx-response-send-file
+(define-record-type (<nginx-file-reference> %make-nginx-file-reference
+					    nginx-file-reference?)
+  (fields file offset length))
+
+(define make-nginx-file-reference
+  (case-lambda
+   ((file) (%make-nginx-file-reference file 0 #f))
+   ((file offset) (%make-nginx-file-reference file offset #f))
+   ((file offset length) (%make-nginx-file-reference file offset length))))
+
+;; bytevectors and strings are passed in bulk, files split the list
+(define (nginx-response-body-add! response status body)
+  (let loop ((body body) (fragments '()))
+    (cond ((null? body)
+	   (%nginx-response-body-add! response status (reverse! fragments)))
+	  ((nginx-file-reference? (car body))
+	   (let ((ref (car body)))
+	     (%nginx-response-body-add! response status (reverse! fragments))
+	     (%nginx-response-send-file response
+					(nginx-file-reference-file ref)
+					(nginx-file-reference-offset ref)
+					(nginx-file-reference-length ref))
+	     (loop (cdr body) '())))
+	  (else (loop (cdr body) (cons (car body) fragments))))))
+
+(define nginx-response-cookie-add!
+  (case-lambda
+   ((response cookie)
+    (nginx-response-header-add! response "Set-Cookie" (cookie->string cookie)))
+   ((response name value . options)
+    (define (option key) (option-ref options key #f))
+    (%nginx-response-cookie-add! response name value
+				 (option :domain) (option :path)
+				 (option :expires) (option :max-age)
+				 (option :secure) (option :http-only)
+				 (option :same-site)))))
+
 (define (nginx-dispatch-request procedure request response)
   (define (->contnet-type-string content-type)
     (cond  ((string? content-type) content-type)
 	   ((symbol? content-type) (symbol->string content-type))
 	   (else #f)))
-  (define (safe-parse-cookies-string str)
-    (guard (e (else '())) (parse-cookies-string str)))
   (guard (e (else (report-error e) #f))
-    (nginx-request-cookies-set! request
-     (append-map safe-parse-cookies-string (nginx-request-cookies request)))
-    (let-values (((status content-type) (procedure request response)))
+    ;; a handler which only starts socket operations may return
+    ;; a single value, or nothing
+    (receive (status content-type . body)
+	(receive r (procedure request response)
+	  (cond ((null? r) (values #t #f))
+		((null? (cdr r)) (values (car r) #f))
+		(else (apply values r))))
       (cond  ((->contnet-type-string content-type) =>
 	      (lambda (ctype) (nginx-response-content-type-set! response ctype))))
+      (when (and (pair? body) (car body))
+	(nginx-response-body-add! response status (car body)))
       status)))
+
+;; called when a socket operation is done
+(define (nginx-dispatch-callback callback result request response)
+  (nginx-dispatch-request (lambda (request response) (callback result))
+			  request response))
 )
@@ -8,6 +8,7 @@
 #include <ngx_http.h>
 
 #include <sagittarius.h>
+#include <gc.h>
 /* 
    References:
    - https://www.evanmiller.org/nginx-modules-guide.html
@@ -24,13 +25,37 @@ sagittarius $entry-point [$init] [$cleanup] {
   filter_parameter name1 key1 value1; # filter parameter for filter 'name1'
   # if the library is the same as the web app library
   filter name2 "do-filter" 1;
-  thread_pool_name pool_name; # refering the name of thread pool
+  thread_pool_name pool_name; # refering the name of thread pool or executor
+  vm_pool_size 32; # number of VMs kept for the thread pool
+  max_concurrency 16; # requests on the thread pool at once
+  max_queue 64; # requests waiting for the thread pool
+  queue_timeout 500ms; # waiting requests are rejected after this
+  reject_status 503; # status of the rejected requests
+  retry_after 1s; # Retry-After of the rejected requests
+  priority $lane; # lane of the thread pool, high, normal or low
+  preload on; # create the context on worker process start
+  warmup warmup-proc; # called after the context is created
+  streaming on; # send the response as soon as the port is flushed
+  large_write_threshold 32k; # writes bigger than this use own buffer
+  cache 30s uri args header:Accept max_entries=256; # response cache
 }
 
 We do not use SgObject here. I'm not sure when the configuration parsing 
 happens and the initialisation of Sagittarius happens on the creation of
 worker process.
  */
+typedef struct nginx_context_node_s nginx_context_node_t;
+typedef struct response_cache_s response_cache_t;
+typedef struct executor_s executor_t;
+
+/* priority lanes of the thread pool mode */
+enum {
+  LANE_HIGH,
+  LANE_NORMAL,
+  LANE_LOW,
+  LANES
+};
+
 typedef struct
 {
   ngx_array_t *load_paths;	/* array of ngx_str_t */
@@ -42,6 +67,21 @@ typedef struct
   ngx_array_t *parameters;	/* array of ngx_table_elt_t */
   ngx_array_t *filters;		/* array of sagittarius_filter_t */
   ngx_str_t pool_name;		/* thread pool name */
+  ngx_flag_t streaming;		/* streaming response */
+  size_t large_write;		/* threshold of large write */
+  ngx_int_t vm_pool_size;	/* max number of pooled worker VMs */
+  ngx_uint_t max_concurrency;	/* 0 = unlimited */
+  ngx_uint_t max_queue;		/* NGX_CONF_UNSET_UINT = unlimited */
+  ngx_msec_t queue_timeout;	/* 0 = no timeout */
+  ngx_uint_t reject_status;
+  time_t retry_after;		/* 0 = no Retry-After */
+  ngx_uint_t priority;		/* lane */
+  ngx_http_complex_value_t *priority_value; /* NULL if it's constant */
+  ngx_flag_t preload;		/* create context on process start */
+  ngx_str_t warmup_proc;	/* warm up */
+  nginx_context_node_t *node;	/* context node, resolved on configuration */
+  response_cache_t *cache;	/* response cache, NULL if disabled */
+  ngx_uint_t status_format;	/* output of sagittarius_status */
 } ngx_http_sagittarius_conf_t;
 
 typedef struct
@@ -60,6 +100,15 @@ static char* ngx_http_sagittarius_block(ngx_conf_t *cf,
 static char* ngx_http_sagittarius(ngx_conf_t *cf,
 				  ngx_command_t *dummy,
 				  void *conf);
+static char* ngx_http_sagittarius_shared_dict(ngx_conf_t *cf,
+					      ngx_command_t *cmd,
+					      void *conf);
+static char* ngx_http_sagittarius_status(ngx_conf_t *cf,
+					 ngx_command_t *cmd,
+					 void *conf);
+static char* ngx_http_sagittarius_executor(ngx_conf_t *cf,
+					   ngx_command_t *cmd,
+					   void *conf);
 static ngx_int_t ngx_http_sagittarius_preconfiguration(ngx_conf_t *cf);
 static ngx_int_t ngx_http_sagittarius_postconfiguration(ngx_conf_t *cf);
 static void* ngx_http_sagittarius_create_loc_conf(ngx_conf_t *cf);
@@ -79,7 +128,32 @@ static ngx_command_t ngx_http_sagittarius_commands[] = {
     NGX_HTTP_LOC_CONF_OFFSET,
     0,
     NULL
-  }
+  },
+  {
+    ngx_string("sagittarius_shared_dict"),
+    NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE2,
+    ngx_http_sagittarius_shared_dict,
+    0,
+    0,
+    NULL
+  },
+  {
+    ngx_string("sagittarius_executor"),
+    NGX_HTTP_MAIN_CONF | NGX_CONF_1MORE,
+    ngx_http_sagittarius_executor,
+    0,
+    0,
+    NULL
+  },
+  {
+    ngx_string("sagittarius_status"),
+    NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS | NGX_CONF_TAKE1,
+    ngx_http_sagittarius_status,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL
+  },
+  ngx_null_command
 };
 
 static ngx_http_module_t ngx_http_sagittarius_module_ctx = {
@@ -110,6 +184,117 @@ ngx_module_t ngx_http_sagittarius_module = {
 
 #define ngx_str_to_string(s) Sg_Utf8sToUtf32s((const char *)(s)->data, (s)->len)
 #define BUFFER_SIZE SG_PORT_DEFAULT_BUFFER_SIZE
+#define LARGE_WRITE_THRESHOLD (BUFFER_SIZE * 4)
+#define VM_POOL_SIZE 32
+
+/*
+  Per request timing, exposed as the variables. The times are in
+  microseconds. This is the module context in the event loop mode, and
+  the first member of thread_request_ctx_t in the thread pool mode.
+ */
+typedef struct
+{
+  uint64_t queued;		/* when the task is posted */
+  uint64_t queue_time;
+  uint64_t context_time;
+  uint64_t handler_time;
+  uint64_t gc_time;
+  off_t    response_bytes;
+} request_timing_t;
+
+typedef struct
+{
+  uint64_t start;
+  ngx_atomic_uint_t gc;
+} timing_mark_t;
+
+/* total GC pause of the process, updated by the collection event */
+static ngx_atomic_t gc_pause_total;
+
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static const char *lane_names[LANES] = { "high", "normal", "low" };
+/* the default weights of the lanes */
+static const ngx_int_t lane_weights[LANES] = { 8, 4, 1 };
+
+/* 
+   Smooth weighted round robin, the same as the weights of NGINX
+   upstream. ready is the bit mask of the non empty lanes, returns the
+   lane to take from or -1 if all of them are empty.
+ */
+static ngx_int_t select_lane(ngx_int_t *current, const ngx_int_t *weights,
+			     ngx_uint_t ready)
+{
+  ngx_int_t total = 0, best = -1, i;
+
+  for (i = 0; i < LANES; i++) {
+    if (!(ready & (1 << i))) continue;
+    current[i] += weights[i];
+    total += weights[i];
+    if (best == -1 || current[i] > current[best]) best = i;
+  }
+  if (best != -1) current[best] -= total;
+  return best;
+}
+
+static ngx_int_t lane_by_name(ngx_str_t *name)
+{
+  ngx_int_t i;
+  for (i = 0; i < LANES; i++) {
+    if (name->len == ngx_strlen(lane_names[i]) &&
+	ngx_strncasecmp(name->data, (u_char *)lane_names[i], name->len) == 0) {
+      return i;
+    }
+  }
+  return NGX_ERROR;
+}
+
+/* an unknown value of the variable falls back to normal */
+static ngx_uint_t request_lane(ngx_http_request_t *r,
+			       ngx_http_sagittarius_conf_t *sg_conf)
+{
+  ngx_str_t v;
+  ngx_int_t lane;
+
+  if (sg_conf->priority_value == NULL) return sg_conf->priority;
+  if (ngx_http_complex_value(r, sg_conf->priority_value, &v) != NGX_OK) {
+    return LANE_NORMAL;
+  }
+  lane = lane_by_name(&v);
+  return lane == NGX_ERROR ? LANE_NORMAL : (ngx_uint_t)lane;
+}
+
+static request_timing_t *request_timing(ngx_http_request_t *r)
+{
+  request_timing_t *t = ngx_http_get_module_ctx(r, ngx_http_sagittarius_module);
+  if (t == NULL) {
+    t = ngx_pcalloc(r->pool, sizeof(request_timing_t));
+    if (t != NULL) ngx_http_set_ctx(r, t, ngx_http_sagittarius_module);
+  }
+  return t;
+}
+
+static void timing_begin(timing_mark_t *m)
+{
+  m->start = now_us();
+  m->gc = gc_pause_total;
+}
+
+/* the GC stops all the threads, so the pause is of this request as well */
+static void timing_end(ngx_http_request_t *r, timing_mark_t *m)
+{
+  request_timing_t *t = request_timing(r);
+  if (t == NULL) return;
+  t->handler_time += now_us() - m->start;
+  t->gc_time += gc_pause_total - m->gc;
+}
+
+static off_t compute_content_length(ngx_chain_t *out);
 
 typedef struct
 {
@@ -121,6 +306,16 @@ typedef struct
   SgObject library;		/* context library */
   SgObject cleanup;		/* cleanup procedure if exists */
   SgObject procedure;		/* entry point */
+  SgObject loadPath;		/* load path of the context */
+  /* 
+     worker VMs of thread pool. These are only touched by the event loop
+     thread (task posting and completion), so no lock is needed.
+   */
+  SgVM   **vms;			/* pooled VMs */
+  SgVM   **idle_vms;		/* stack of idle VMs */
+  int      vm_count;		/* number of pooled VMs */
+  int      idle_count;		/* number of idle VMs */
+  int      vm_max;
 } SgNginxContext;
 SG_CLASS_DECL(Sg_NginxContextClass)
 #define SG_CLASS_NGINX_CONTEXT (&Sg_NginxContextClass)
@@ -296,14 +491,16 @@ SG_DEFINE_GETTER("nginx-filter-context-name", "nginx-filter-context",
 		 nginx_filter_context_name);
 
 
+/* must be greater than the largest number of builtin_request_fields.inc */
+#define BUILTIN_HEADER_SLOTS 32
+
 typedef struct
 {
   SG_HEADER;
   SgObject method;
   SgObject uri;
   SgObject headers;
-  SgObject cookies;
-  int      cookies_parsed_p;
+  SgObject cookies;		/* parsed lazily */
   SgObject query_string;	/* query string */
   /* NGINX doesn't provide fragment so users need to parse manually */
   SgObject original_uri;	/* original uri (incl. query and fragment) */
@@ -312,8 +509,15 @@ typedef struct
   SgObject body;		/* binary input port */
   SgObject context;
   SgObject peer_certificate;
+  SgObject response;		/* set when the handler is called */
+  int pending;			/* number of pending socket operations */
+  int finished;			/* the response is sent */
+  ngx_str_t cache_key;		/* empty if the response isn't cached */
+  uint32_t cache_hash;
   ngx_http_request_t *rawNginxRequest;
-  /* TODO maybe cache the builtin values? */
+  /* converted builtin header values, indexed by the number of the field */
+  uint32_t header_cached;	/* bitmap of the filled slots */
+  SgObject header_cache[BUILTIN_HEADER_SLOTS];
 } SgNginxRequest;
 SG_CLASS_DECL(Sg_NginxRequestClass);
 #define SG_CLASS_NGINX_REQUEST (&Sg_NginxRequestClass)
@@ -408,6 +612,48 @@ static SgObject nr_context(SgNginxRequest *nr)
   return nr->context;
 }
 
+/* make-cookie of (rfc cookie), initialised with the base library */
+static SgObject cookie_constructor = SG_UNDEF;
+
+#define is_cookie_space(c) ((c) == ' ' || (c) == '\t')
+
+/*
+  Retrieves the next name=value pair of the Cookie header value.
+  The pairs without '=' and the RFC 2965 attributes ($Version, $Path
+  and so) are skipped. Returns FALSE if there's no more pair.
+ */
+static int next_cookie(u_char **pos, u_char *end,
+		       ngx_str_t *name, ngx_str_t *value)
+{
+  u_char *p = *pos, *s, *e, *eq;
+
+  while (p < end) {
+    while (p < end && (*p == ';' || is_cookie_space(*p))) p++;
+    if (p == end) break;
+
+    s = p;
+    while (p < end && *p != ';') p++;
+    e = p;
+    while (e > s && is_cookie_space(e[-1])) e--;
+
+    eq = ngx_strlchr(s, e, '=');
+    if (eq == NULL || eq == s || *s == '$') continue;
+
+    name->data = s;
+    name->len = eq - s;
+    while (name->len > 0 && is_cookie_space(s[name->len - 1])) name->len--;
+    if (name->len == 0) continue;
+
+    for (eq++; eq < e && is_cookie_space(*eq); eq++);
+    value->data = eq;
+    value->len = e - eq;
+    *pos = p;
+    return TRUE;
+  }
+  *pos = p;
+  return FALSE;
+}
+
 static SgObject nr_cookies(SgNginxRequest *nr)
 {
   if (SG_FALSEP(nr->cookies)) {
@@ -417,38 +663,242 @@ static SgObject nr_cookies(SgNginxRequest *nr)
     SgObject h = SG_NIL, t = SG_NIL;
 
     for (i = 0; i < len; i++) {
-      ngx_table_elt_t *e = data[i];
-      SG_APPEND1(h, t, ngx_str_to_string(&e->value));
+      u_char *p = data[i]->value.data;
+      u_char *end = p + data[i]->value.len;
+      ngx_str_t name, value;
+
+      while (next_cookie(&p, end, &name, &value)) {
+	SgObject c = Sg_Apply2(cookie_constructor,
+			       ngx_str_to_string(&name),
+			       ngx_str_to_string(&value));
+	SG_APPEND1(h, t, c);
+      }
     }
     nr->cookies = h;
   }
   return nr->cookies;
 }
 
-static void nr_cookies_set(SgNginxRequest *nr, SgObject cookies)
+/* Looks up the value of the first cookie named NAME, without parsing all */
+static SgObject nr_cookie_ref(SgNginxRequest *nr, SgObject name)
+{
+  ngx_http_request_t *r = nr->rawNginxRequest;
+  ngx_uint_t i, len = r->headers_in.cookies.nelts;
+  ngx_table_elt_t **data = (ngx_table_elt_t **)r->headers_in.cookies.elts;
+  char *n;
+  size_t nlen;
+
+  if (len == 0) return SG_FALSE;
+
+  n = Sg_Utf32sToUtf8s(SG_STRING(name));
+  nlen = ngx_strlen(n);
+  for (i = 0; i < len; i++) {
+    u_char *p = data[i]->value.data;
+    u_char *end = p + data[i]->value.len;
+    ngx_str_t cname, value;
+
+    while (next_cookie(&p, end, &cname, &value)) {
+      if (cname.len == nlen && ngx_strncmp(cname.data, n, nlen) == 0) {
+	return ngx_str_to_string(&value);
+      }
+    }
+  }
+  return SG_FALSE;
+}
+
+static SgObject nginx_request_cookie_ref(SgObject *argv, int argc, void *data)
 {
-  /* one short update by (sagittarius nginx) */
-  if (SG_FALSEP(nr->cookies) || nr->cookies_parsed_p) {
-    Sg_Error(UC("Invalid usage of cookies slot"));
+  if (argc != 2) {
+    Sg_WrongNumberOfArgumentsViolation(SG_INTERN("nginx-request-cookie-ref"),
+				       2, argc, SG_NIL);
+  }
+  if (!SG_NGINX_REQUESTP(argv[0])) {
+    Sg_WrongTypeOfArgumentViolation(SG_INTERN("nginx-request-cookie-ref"),
+				    SG_INTERN("nginx-request"),
+				    argv[0], SG_NIL);
+  }
+  if (!SG_STRINGP(argv[1])) {
+    Sg_WrongTypeOfArgumentViolation(SG_INTERN("nginx-request-cookie-ref"),
+				    SG_INTERN("string"),
+				    argv[1], SG_NIL);
   }
-  if (!SG_LISTP(cookies)) {
-    Sg_WrongTypeOfArgumentViolation(SG_INTERN("nginx-request-cookies-set!"),
-				    SG_INTERN("list"), cookies, SG_NIL);
+  return nr_cookie_ref(SG_NGINX_REQUEST(argv[0]), argv[1]);
+}
+static SG_DEFINE_SUBR(nginx_request_cookie_ref_stub, 2, 0,
+		      nginx_request_cookie_ref, SG_FALSE, NULL);
+
+static SgObject join_header_values(ngx_http_request_t *r, ngx_array_t *a,
+				   const char *sep, size_t seplen)
+{
+  ngx_table_elt_t **h = a->elts;
+  ngx_uint_t i;
+  ngx_str_t s;
+  u_char *p;
+
+  if (a->nelts == 0) return SG_FALSE;
+  if (a->nelts == 1) return ngx_str_to_string(&h[0]->value);
+
+  s.len = seplen * (a->nelts - 1);
+  for (i = 0; i < a->nelts; i++) s.len += h[i]->value.len;
+  s.data = ngx_pnalloc(r->pool, s.len);
+  if (s.data == NULL) return SG_FALSE;
+  p = ngx_cpymem(s.data, h[0]->value.data, h[0]->value.len);
+  for (i = 1; i < a->nelts; i++) {
+    p = ngx_cpymem(p, sep, seplen);
+    p = ngx_cpymem(p, h[i]->value.data, h[i]->value.len);
   }
-  nr->cookies_parsed_p = TRUE;
-  nr->cookies = cookies;
+  return ngx_str_to_string(&s);
+}
+
+#define header_cached_p(nr, n) ((nr)->header_cached & ((uint32_t)1 << (n)))
+
+static SgObject nr_header_lookup(SgNginxRequest *nr, SgObject name, int all);
+
+static SgObject header_cache(SgNginxRequest *nr, int n, SgObject v)
+{
+  nr->header_cache[n] = v;
+  nr->header_cached |= (uint32_t)1 << n;
+  return v;
 }
 
 #define HEADER_FIELD(name, cname, n)					\
+  typedef char SG_CPP_CAT(header_slot_check_, cname)			\
+    [(n) < BUILTIN_HEADER_SLOTS ? 1 : -1];				\
+  static SgObject SG_CPP_CAT(nr_, cname)(SgNginxRequest *nr)		\
+  {									\
+    ngx_table_elt_t *e;							\
+    if (header_cached_p(nr, n)) return nr->header_cache[n];		\
+    e = nr->rawNginxRequest->headers_in. cname;				\
+    return header_cache(nr, n,						\
+			e ? ngx_str_to_string(&e->value) : SG_FALSE);	\
+  }
+#define HEADER_MULTI_FIELD(name, cname, n, sep)				\
+  typedef char SG_CPP_CAT(header_slot_check_, cname)			\
+    [(n) < BUILTIN_HEADER_SLOTS ? 1 : -1];				\
+  static SgObject SG_CPP_CAT(nr_, cname)(SgNginxRequest *nr)		\
+  {									\
+    ngx_http_request_t *r = nr->rawNginxRequest;			\
+    if (header_cached_p(nr, n)) return nr->header_cache[n];		\
+    return header_cache(nr, n,						\
+			join_header_values(r, &r->headers_in. cname,	\
+					   sep, sizeof(sep) - 1));	\
+  }
+#define HEADER_NAMED_FIELD(name, cname, n)				\
+  typedef char SG_CPP_CAT(header_slot_check_, cname)			\
+    [(n) < BUILTIN_HEADER_SLOTS ? 1 : -1];				\
   static SgObject SG_CPP_CAT(nr_, cname)(SgNginxRequest *nr)		\
   {									\
-    ngx_table_elt_t *e = nr->rawNginxRequest->headers_in. cname;	\
-    if (e == NULL) return SG_FALSE;					\
-    return ngx_str_to_string(&e->value);				\
+    if (header_cached_p(nr, n)) return nr->header_cache[n];		\
+    return header_cache(nr, n,						\
+			nr_header_lookup(nr, SG_MAKE_STRING(#name), FALSE)); \
   }
 #include "builtin_request_fields.inc"
+#undef HEADER_NAMED_FIELD
+#undef HEADER_MULTI_FIELD
 #undef HEADER_FIELD
 
+/*
+  Header lookup without building the alist of nr_headers.
+  NGINX keeps the lower case name and its hash on each header, so
+  compare them instead of converting the headers.
+ */
+static int header_name_hash(SgObject name, ngx_uint_t *hash)
+{
+  SgChar *s = SG_STRING_VALUE(name);
+  long i, len = SG_STRING_SIZE(name);
+  ngx_uint_t h = 0;
+
+  for (i = 0; i < len; i++) {
+    /* non ASCII header name can't be there */
+    if (s[i] >= 0x80) return FALSE;
+    h = ngx_hash(h, ngx_tolower((u_char)s[i]));
+  }
+  *hash = h;
+  return TRUE;
+}
+
+static int header_name_match(ngx_table_elt_t *e, SgObject name)
+{
+  SgChar *s = SG_STRING_VALUE(name);
+  size_t i, len = (size_t)SG_STRING_SIZE(name);
+
+  if (e->key.len != len) return FALSE;
+  for (i = 0; i < len; i++) {
+    if (e->lowcase_key[i] != ngx_tolower((u_char)s[i])) return FALSE;
+  }
+  return TRUE;
+}
+
+static SgObject nr_header_lookup(SgNginxRequest *nr, SgObject name, int all)
+{
+  SgObject h = SG_NIL, t = SG_NIL;
+  ngx_uint_t i, hash;
+  ngx_list_part_t *part = &nr->rawNginxRequest->headers_in.headers.part;
+  ngx_table_elt_t *data = part->elts;
+
+  if (!header_name_hash(name, &hash)) return all ? SG_NIL : SG_FALSE;
+
+  for (i = 0;; i++) {
+    ngx_table_elt_t *e;
+    if (i >= part->nelts) {
+      if (part->next == NULL) break;
+      part = part->next;
+      data = part->elts;
+      i = 0;
+    }
+    e = &data[i];
+    if (e->hash == hash && header_name_match(e, name)) {
+      SgObject v = ngx_str_to_string(&e->value);
+      if (!all) return v;
+      SG_APPEND1(h, t, v);
+    }
+  }
+  return all ? h : SG_FALSE;
+}
+
+static SgObject nginx_request_header_ref(SgObject *argv, int argc, void *data)
+{
+  if (argc != 2) {
+    Sg_WrongNumberOfArgumentsViolation(SG_INTERN("nginx-request-header-ref"),
+				       2, argc, SG_NIL);
+  }
+  if (!SG_NGINX_REQUESTP(argv[0])) {
+    Sg_WrongTypeOfArgumentViolation(SG_INTERN("nginx-request-header-ref"),
+				    SG_INTERN("nginx-request"),
+				    argv[0], SG_NIL);
+  }
+  if (!SG_STRINGP(argv[1])) {
+    Sg_WrongTypeOfArgumentViolation(SG_INTERN("nginx-request-header-ref"),
+				    SG_INTERN("string"),
+				    argv[1], SG_NIL);
+  }
+  return nr_header_lookup(SG_NGINX_REQUEST(argv[0]), argv[1], FALSE);
+}
+static SG_DEFINE_SUBR(nginx_request_header_ref_stub, 2, 0,
+		      nginx_request_header_ref, SG_FALSE, NULL);
+
+static SgObject nginx_request_header_values(SgObject *argv, int argc,
+					    void *data)
+{
+  if (argc != 2) {
+    Sg_WrongNumberOfArgumentsViolation(SG_INTERN("nginx-request-header-values"),
+				       2, argc, SG_NIL);
+  }
+  if (!SG_NGINX_REQUESTP(argv[0])) {
+    Sg_WrongTypeOfArgumentViolation(SG_INTERN("nginx-request-header-values"),
+				    SG_INTERN("nginx-request"),
+				    argv[0], SG_NIL);
+  }
+  if (!SG_STRINGP(argv[1])) {
+    Sg_WrongTypeOfArgumentViolation(SG_INTERN("nginx-request-header-values"),
+				    SG_INTERN("string"),
+				    argv[1], SG_NIL);
+  }
+  return nr_header_lookup(SG_NGINX_REQUEST(argv[0]), argv[1], TRUE);
+}
+static SG_DEFINE_SUBR(nginx_request_header_values_stub, 2, 0,
+		      nginx_request_header_values, SG_FALSE, NULL);
+
 static SgObject x509_to_bytevector(X509 *x509)
 {
   int len;
@@ -486,7 +936,7 @@ static SgSlotAccessor nr_slots[] = {
   SG_CLASS_SLOT_SPEC("method",     0, nr_method, NULL),
   SG_CLASS_SLOT_SPEC("uri",        1, nr_uri, NULL),
   SG_CLASS_SLOT_SPEC("headers",    2, nr_headers, NULL),
-  SG_CLASS_SLOT_SPEC("cookies",    3, nr_cookies, nr_cookies_set),
+  SG_CLASS_SLOT_SPEC("cookies",    3, nr_cookies, NULL),
   SG_CLASS_SLOT_SPEC("query-string", 4, nr_query_string, NULL),
   SG_CLASS_SLOT_SPEC("original-uri", 5, nr_original_uri, NULL),
   SG_CLASS_SLOT_SPEC("request-line", 6, nr_request_line, NULL),
@@ -524,9 +974,6 @@ SG_DEFINE_GETTER("nginx-request-headers", "nginx-request",
 SG_DEFINE_GETTER("nginx-request-cookies", "nginx-request",
 		 SG_NGINX_REQUESTP, nr_cookies, SG_NGINX_REQUEST,
 		 nginx_request_cookies);
-SG_DEFINE_SETTER("nginx-request-cookies-set!", "nginx-request",
-		 SG_NGINX_REQUESTP, nr_cookies_set, SG_NGINX_REQUEST,
-		 nginx_request_cookies_set);
 SG_DEFINE_GETTER("nginx-request-query-string", "nginx-request",
 		 SG_NGINX_REQUESTP, nr_query_string, SG_NGINX_REQUEST,
 		 nginx_request_query_string);
@@ -583,57 +1030,31 @@ static SgObject nres_content_type(SgNginxResponse *nr)
   return ngx_str_to_string(s);
 }
 
+static void make_header_value(SgObject who, ngx_pool_t *pool,
+			      SgObject value, ngx_str_t *v);
+
 static void nres_content_type_set(SgNginxResponse *nr, SgObject v)
 {
-  char *r;
+  SgObject who = SG_INTERN("nginx-response-content-type-set!");
   if (!SG_STRINGP(v)) {
-    Sg_WrongTypeOfArgumentViolation(SG_INTERN("nginx-response-content-type-set!"),
-				    SG_INTERN("string"),
-				    v, SG_NIL);
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("string"), v, SG_NIL);
   }
-  r = Sg_Utf32sToUtf8s(v);
-  nr->request->headers_out.content_type.len = ngx_strlen(r);
-  nr->request->headers_out.content_type.data = (unsigned char *)r;
+  make_header_value(who, nr->request->pool, v,
+		    &nr->request->headers_out.content_type);
+  nr->request->headers_out.content_type_len =
+    nr->request->headers_out.content_type.len;
+  nr->request->headers_out.content_type_lowcase = NULL;
 }
 
 static SgObject nres_headers(SgNginxResponse *nr)
 {
   if (SG_FALSEP(nr->headers)) {
     SgObject h = SG_NIL, t = SG_NIL;
-    ngx_http_request_t *r = nr->request;
     ngx_uint_t i;
-    ngx_list_part_t *part;
-    ngx_table_elt_t *data;
-
-#define ADD_HEADER(elt)							\
-    do {								\
-      SgObject n = ngx_str_to_string(&(elt)->key);			\
-      SgObject v = ngx_str_to_string(&(elt)->value);			\
-      SG_APPEND1(h, t, SG_LIST2(n, v));					\
-    } while (0)
-    
-#define ADD_BUILTIN_HEADER(field)					\
-    do {								\
-      if (r->headers_out. field) {					\
-	ADD_HEADER(r->headers_out. field);				\
-      }									\
-    } while (0)
-
-    ADD_BUILTIN_HEADER(server);
-    ADD_BUILTIN_HEADER(date);
-    ADD_BUILTIN_HEADER(content_encoding);
-    ADD_BUILTIN_HEADER(location);
-    ADD_BUILTIN_HEADER(refresh);
-    ADD_BUILTIN_HEADER(last_modified);
-    ADD_BUILTIN_HEADER(content_range);
-    ADD_BUILTIN_HEADER(accept_ranges);
-    ADD_BUILTIN_HEADER(www_authenticate);
-    ADD_BUILTIN_HEADER(expires);
-    ADD_BUILTIN_HEADER(etag);
-#undef ADD_BUILTIN_HEADER
-
-    part = &r->headers_out.headers.part;
-    data = part->elts;
+    ngx_list_part_t *part = &nr->request->headers_out.headers.part;
+    ngx_table_elt_t *data = part->elts;
+
+    /* the builtin headers are also in the list */
     for (i = 0; ; i++) {
       ngx_table_elt_t *e;
       if (i >= part->nelts) {
@@ -642,9 +1063,10 @@ static SgObject nres_headers(SgNginxResponse *nr)
 	data = part->elts;
 	i = 0;
       }
-      e = &data[i++];
-      ADD_HEADER(e);
-#undef ADD_HEADER
+      e = &data[i];
+      if (e->hash == 0) continue; /* removed */
+      SG_APPEND1(h, t, SG_LIST2(ngx_str_to_string(&e->key),
+				ngx_str_to_string(&e->value)));
     }
     nr->headers = h;
   }
@@ -686,93 +1108,235 @@ SG_DEFINE_GETTER("nginx-response-output-port", "nginx-response",
 		 SG_NGINX_RESPONSEP, nres_out, SG_NGINX_RESPONSE,
 		 nginx_response_output_port);
 
-static void ngx_add_header(SgObject res, SgObject name, SgObject value)
+static SgObject Sg_MakeNginxError(int status);
+static void raise_nginx_error(SgObject who, SgObject msg,
+			      SgObject c, SgObject irr);
+
+/*
+  Builtin response headers.
+  The table is a perfect hash of the lower case names, built on the
+  process initialisation from builtin_response_fields.inc, so a header
+  name is converted and hashed once then dispatched with one lookup.
+ */
+#define RESPONSE_FIELD_HASH_SIZE 64
+
+typedef enum {
+  RESPONSE_FIELD_IGNORE,
+  RESPONSE_FIELD_BUILTIN
+} response_field_kind_t;
+
+typedef struct
 {
-  ngx_http_request_t *r = SG_NGINX_RESPONSE(res)->request;
-  SgObject s = Sg_StringDownCase(SG_STRING(name));
-  unsigned char *uc;
+  ngx_str_t             name;	/* lower case */
+  ngx_str_t             key;
+  size_t                offset;	/* offset of ngx_http_headers_out_t */
+  response_field_kind_t kind;
+  ngx_uint_t            hash;
+} response_field_t;
+
+static response_field_t response_fields[] = {
+#define RESPONSE_FIELD(name, cname, key, kind)				\
+  { ngx_string(name), ngx_string(key),					\
+    offsetof(ngx_http_headers_out_t, cname),				\
+    SG_CPP_CAT(RESPONSE_FIELD_, kind), 0 },
+#include "builtin_response_fields.inc"
+#undef RESPONSE_FIELD
+};
+static response_field_t *response_field_table[RESPONSE_FIELD_HASH_SIZE];
 
-  SG_NGINX_RESPONSE(res)->headers = SG_FALSE; /* reset */
-#define set_builtin_header3(field, name, sname)				\
-  do {									\
-    if (!r->headers_out. field) {					\
-      r->headers_out. field = ngx_pcalloc(r->pool, sizeof(ngx_table_elt_t)); \
-      ngx_str_set(&r->headers_out. field ->key, name);			\
-      r->headers_out. field ->lowcase_key = (unsigned char *)sname;	\
-    }									\
-    r->headers_out. field ->value.data = uc;				\
-    r->headers_out. field ->value.len = ngx_strlen(uc);			\
-    r->headers_out. field ->hash = Sg_StringHash(value, 0);		\
-  } while (0)
+static ngx_int_t init_response_fields(ngx_log_t *log)
+{
+  ngx_uint_t i, slot;
+  for (i = 0; i < sizeof(response_fields)/sizeof(response_fields[0]); i++) {
+    response_field_t *f = &response_fields[i];
+    f->hash = ngx_hash_key(f->name.data, f->name.len);
+    slot = f->hash % RESPONSE_FIELD_HASH_SIZE;
+    if (response_field_table[slot] != NULL &&
+	response_field_table[slot] != f) {
+      ngx_log_error(NGX_LOG_EMERG, log, 0,
+		    "'sagittarius': Response header '%V' collides with '%V'",
+		    &f->name, &response_field_table[slot]->name);
+      return NGX_ERROR;
+    }
+    response_field_table[slot] = f;
+  }
+  return NGX_OK;
+}
 
-#define set_builtin_header(field, name) set_builtin_header3(field, name, #field)
+typedef struct
+{
+  ngx_str_t  key;
+  u_char    *lowcase_key;
+  ngx_uint_t hash;
+} header_name_t;
+
+/* converts the header name and computes its hash in one go */
+static void make_header_name(SgObject who, ngx_pool_t *pool,
+			     SgObject name, header_name_t *hn)
+{
+  SgChar *s = SG_STRING_VALUE(name);
+  long i, len = SG_STRING_SIZE(name);
+  ngx_uint_t hash = 0;
+
+  for (i = 0; i < len; i++) {
+    /* visible ASCII characters except ':' (RFC 7230 token is stricter) */
+    if (s[i] <= 0x20 || s[i] >= 0x7f || s[i] == ':') {
+      Sg_AssertionViolation(who, SG_MAKE_STRING("invalid header name"),
+			    SG_LIST1(name));
+    }
+  }
+  if (len == 0) {
+    Sg_AssertionViolation(who, SG_MAKE_STRING("empty header name"),
+			  SG_LIST1(name));
+  }
 
-  uc = (unsigned char *)Sg_Utf32sToUtf8s(value);
-  /* 
-     some of the headers we only allow to send once 
-     NOTE: we don't check the format of the header
-  */
-  if (ustrcmp(SG_STRING_VALUE(s), "server") == 0) {
-    /* The Server: header must be set by configuration so ignore */
-  } else if (ustrcmp(SG_STRING_VALUE(s), "date") == 0) {
-    if (!r->headers_out.date) {
-      r->headers_out.date =
-	(ngx_table_elt_t *)ngx_list_push(&r->headers_out.headers);
-      ngx_str_set(&r->headers_out.date->key, "Date");
-      r->headers_out.date->lowcase_key = (unsigned char *)"date";
-    }
-    set_builtin_header(date, "Date");
-    
-  } else if (ustrcmp(SG_STRING_VALUE(s), "content-length") == 0) {
-    /* The Server: header must be set by the content */
-  } else if (ustrcmp(SG_STRING_VALUE(s), "content-encoding") == 0) {
-    set_builtin_header3(content_encoding,
-			"Content-Encoding", "content-encoding");
-  } else if (ustrcmp(SG_STRING_VALUE(s), "location") == 0) {
-    set_builtin_header(location, "Location");
-  } else if (ustrcmp(SG_STRING_VALUE(s), "refresh") == 0) {
-    set_builtin_header(refresh, "Refresh");
-  } else if (ustrcmp(SG_STRING_VALUE(s), "last-modified") == 0) {
-    set_builtin_header3(last_modified, "Last-Modified", "last-modified");
-  } else if (ustrcmp(SG_STRING_VALUE(s), "content-range") == 0) {
-    set_builtin_header3(content_range, "Content-Range", "content-range");
-  } else if (ustrcmp(SG_STRING_VALUE(s), "accept-ranges") == 0) {
-    set_builtin_header3(accept_ranges, "Accept-Ranges", "accept-ranges");
-  } else if (ustrcmp(SG_STRING_VALUE(s), "www-authenticate") == 0) {
-    set_builtin_header3(www_authenticate,
-			"WWW-Authenticate", "www-authenticate");
-  } else if (ustrcmp(SG_STRING_VALUE(s), "expires") == 0) {
-    set_builtin_header(expires, "Expires");
-  } else if (ustrcmp(SG_STRING_VALUE(s), "etag") == 0) {
-    set_builtin_header(etag, "ETag");
-  } else {
-    unsigned char *n;
-    ngx_table_elt_t *e;
-    
-    e = ngx_list_push(&r->headers_out.headers);
-    n = (unsigned char *)Sg_Utf32sToUtf8s(name);
-    e->key.data = n;
-    e->key.len = ngx_strlen(n);
-    e->value.data = uc;
-    e->value.len = ngx_strlen(uc);
-    e->lowcase_key = (unsigned char *)Sg_Utf32sToUtf8s(s);
-    e->hash = Sg_StringHash(value, 0);
+  hn->key.len = len;
+  hn->key.data = ngx_pnalloc(pool, len * 2);
+  if (hn->key.data == NULL) {
+    raise_nginx_error(who, SG_MAKE_STRING("Failed to allocate header"),
+		      Sg_MakeNginxError(NGX_HTTP_INTERNAL_SERVER_ERROR),
+		      SG_NIL);
+  }
+  hn->lowcase_key = hn->key.data + len;
+  for (i = 0; i < len; i++) {
+    u_char c = (u_char)s[i];
+    hn->key.data[i] = c;
+    hn->lowcase_key[i] = ngx_tolower(c);
+    hash = ngx_hash(hash, hn->lowcase_key[i]);
+  }
+  /* 0 means removed header */
+  hn->hash = hash ? hash : 1;
+}
+
+#define utf8_size(c)						\
+  (((c) < 0x80) ? 1 : ((c) < 0x800) ? 2 : ((c) < 0x10000) ? 3 : 4)
+
+static u_char *utf8_encode(u_char *p, SgChar *s, long len)
+{
+  long i;
+  for (i = 0; i < len; i++) {
+    SgChar c = s[i];
+    if (c < 0x80) {
+      *p++ = (u_char)c;
+    } else if (c < 0x800) {
+      *p++ = (u_char)(0xc0 | (c >> 6));
+      *p++ = (u_char)(0x80 | (c & 0x3f));
+    } else if (c < 0x10000) {
+      *p++ = (u_char)(0xe0 | (c >> 12));
+      *p++ = (u_char)(0x80 | ((c >> 6) & 0x3f));
+      *p++ = (u_char)(0x80 | (c & 0x3f));
+    } else {
+      *p++ = (u_char)(0xf0 | (c >> 18));
+      *p++ = (u_char)(0x80 | ((c >> 12) & 0x3f));
+      *p++ = (u_char)(0x80 | ((c >> 6) & 0x3f));
+      *p++ = (u_char)(0x80 | (c & 0x3f));
+    }
   }
+  return p;
+}
 
-#undef set_builtin_header
-#undef set_builtin_header3
+/* copies the value to the pool, the GC doesn't know the NGINX memory */
+static void make_header_value(SgObject who, ngx_pool_t *pool,
+			      SgObject value, ngx_str_t *v)
+{
+  SgChar *s = SG_STRING_VALUE(value);
+  long i, len = SG_STRING_SIZE(value);
+  size_t size = 0;
+  u_char *p;
+
+  for (i = 0; i < len; i++) {
+    SgChar c = s[i];
+    if (c == '\r' || c == '\n' || c == 0) {
+      Sg_AssertionViolation(who, SG_MAKE_STRING("invalid header value"),
+			    SG_LIST1(value));
+    }
+    size += utf8_size(c);
+  }
+  v->len = size;
+  v->data = p = ngx_pnalloc(pool, size);
+  if (p == NULL) {
+    raise_nginx_error(who, SG_MAKE_STRING("Failed to allocate header"),
+		      Sg_MakeNginxError(NGX_HTTP_INTERNAL_SERVER_ERROR),
+		      SG_NIL);
+  }
+  utf8_encode(p, s, len);
 }
 
-/* This takes O(n)... */
-static void ngx_remove_header_from_list(ngx_http_request_t *r,
-					unsigned char *name)
+static response_field_t *lookup_response_field(header_name_t *hn)
 {
-  ngx_list_part_t *part = &r->headers_out.headers.part;
-  ngx_table_elt_t *data = part->elts;
+  response_field_t *f =
+    response_field_table[hn->hash % RESPONSE_FIELD_HASH_SIZE];
+  if (f && f->hash == hn->hash && f->name.len == hn->key.len &&
+      ngx_memcmp(f->name.data, hn->lowcase_key, hn->key.len) == 0) {
+    return f;
+  }
+  return NULL;
+}
+
+#define response_field_slot(r, f)					\
+  ((ngx_table_elt_t **)((char *)&(r)->headers_out + (f)->offset))
+
+static void add_header(SgObject who, SgObject res,
+		       header_name_t *hn, ngx_str_t *value)
+{
+  ngx_http_request_t *r = SG_NGINX_RESPONSE(res)->request;
+  response_field_t *f = lookup_response_field(hn);
+  ngx_table_elt_t *e, **slot = NULL;
+
+  if (f) {
+    if (f->kind == RESPONSE_FIELD_IGNORE) return;
+    slot = response_field_slot(r, f);
+    if (*slot) {
+      /* the builtin headers can only be sent once */
+      (*slot)->value = *value;
+      SG_NGINX_RESPONSE(res)->headers = SG_FALSE; /* reset */
+      return;
+    }
+  }
+  e = ngx_list_push(&r->headers_out.headers);
+  if (e == NULL) {
+    raise_nginx_error(who, SG_MAKE_STRING("Failed to allocate header"),
+		      Sg_MakeNginxError(NGX_HTTP_INTERNAL_SERVER_ERROR),
+		      SG_NIL);
+  }
+  if (f) {
+    e->key = f->key;
+    e->lowcase_key = f->name.data;
+    e->hash = f->hash;
+    *slot = e;
+  } else {
+    e->key = hn->key;
+    e->lowcase_key = hn->lowcase_key;
+    e->hash = hn->hash;
+  }
+  e->value = *value;
+  SG_NGINX_RESPONSE(res)->headers = SG_FALSE; /* reset */
+}
+
+static void remove_header(SgObject res, header_name_t *hn)
+{
+  ngx_http_request_t *r = SG_NGINX_RESPONSE(res)->request;
+  response_field_t *f = lookup_response_field(hn);
+  ngx_list_part_t *part;
+  ngx_table_elt_t *data;
   ngx_uint_t i;
 
-  i = 0;
-  while (1) {
+  if (f) {
+    ngx_table_elt_t **slot;
+    if (f->kind == RESPONSE_FIELD_IGNORE) return;
+    slot = response_field_slot(r, f);
+    if (*slot) {
+      (*slot)->hash = 0;
+      *slot = NULL;
+      SG_NGINX_RESPONSE(res)->headers = SG_FALSE; /* reset */
+    }
+    return;
+  }
+
+  /* custom headers may appear multiple times, so we need to scan */
+  part = &r->headers_out.headers.part;
+  data = part->elts;
+  for (i = 0; ; i++) {
     ngx_table_elt_t *e;
     if (i >= part->nelts) {
       if (part->next == NULL) break;
@@ -780,58 +1344,70 @@ static void ngx_remove_header_from_list(ngx_http_request_t *r,
       data = part->elts;
       i = 0;
     }
-    e = &data[i++];
-    
-    if (ngx_strcmp(e->lowcase_key, name) == 0) {
-      e->hash = 0;		/* easy pisy */
+    e = &data[i];
+    if (e->hash == hn->hash && e->key.len == hn->key.len &&
+	ngx_memcmp(e->lowcase_key, hn->lowcase_key, hn->key.len) == 0) {
+      e->hash = 0;
+      SG_NGINX_RESPONSE(res)->headers = SG_FALSE; /* reset */
     }
   }
 }
 
-static void ngx_remove_header(SgObject res, SgObject name)
+static void ngx_add_header(SgObject who, SgObject res,
+			   SgObject name, SgObject value)
 {
-  ngx_http_request_t *r = SG_NGINX_RESPONSE(res)->request;
-  SgObject s = Sg_StringDownCase(SG_STRING(name));
+  ngx_pool_t *pool = SG_NGINX_RESPONSE(res)->request->pool;
+  header_name_t hn;
+  ngx_str_t v;
 
-  SG_NGINX_RESPONSE(res)->headers = SG_FALSE; /* reset */
-#define remove_builtin(field)				\
-  do {							\
-    if (r->headers_out. field) {			\
-      ngx_pfree(r->pool, r->headers_out. field);	\
-      r->headers_out. field = NULL;			\
-    }							\
-  } while (0)
-  
-  if (ustrcmp(SG_STRING_VALUE(s), "server") == 0) {
-    /* The Server: header must be set by configuration so ignore */
-  } else if (ustrcmp(SG_STRING_VALUE(s), "date") == 0) {
-    if (r->headers_out.date) {
-      ngx_remove_header_from_list(r, (unsigned char *)"date");
-    }
-    remove_builtin(date);
-  } else if (ustrcmp(SG_STRING_VALUE(s), "content-length") == 0) {
-    /* The Server: header must be set by the content */
-  } else if (ustrcmp(SG_STRING_VALUE(s), "content-encoding") == 0) {
-    remove_builtin(content_encoding);
-  } else if (ustrcmp(SG_STRING_VALUE(s), "location") == 0) {
-    remove_builtin(location);
-  } else if (ustrcmp(SG_STRING_VALUE(s), "refresh") == 0) {
-    remove_builtin(refresh);
-  } else if (ustrcmp(SG_STRING_VALUE(s), "last-modified") == 0) {
-    remove_builtin(last_modified);
-  } else if (ustrcmp(SG_STRING_VALUE(s), "content-range") == 0) {
-    remove_builtin(content_range);
-  } else if (ustrcmp(SG_STRING_VALUE(s), "accept-ranges") == 0) {
-    remove_builtin(accept_ranges);
-  } else if (ustrcmp(SG_STRING_VALUE(s), "www-authenticate") == 0) {
-    remove_builtin(www_authenticate);
-  } else if (ustrcmp(SG_STRING_VALUE(s), "expires") == 0) {
-    remove_builtin(expires);
-  } else if (ustrcmp(SG_STRING_VALUE(s), "etag") == 0) {
-    remove_builtin(etag);
-  } else {
-    ngx_remove_header_from_list(r, (unsigned char *)Sg_Utf32sToUtf8s(s));
+  make_header_name(who, pool, name, &hn);
+  make_header_value(who, pool, value, &v);
+  add_header(who, res, &hn, &v);
+}
+
+static void ngx_set_header(SgObject who, SgObject res,
+			   SgObject name, SgObject value)
+{
+  ngx_pool_t *pool = SG_NGINX_RESPONSE(res)->request->pool;
+  header_name_t hn;
+  ngx_str_t v;
+
+  make_header_name(who, pool, name, &hn);
+  make_header_value(who, pool, value, &v);
+  remove_header(res, &hn);
+  add_header(who, res, &hn, &v);
+}
+
+static void ngx_remove_header(SgObject who, SgObject res, SgObject name)
+{
+  header_name_t hn;
+  make_header_name(who, SG_NGINX_RESPONSE(res)->request->pool, name, &hn);
+  remove_header(res, &hn);
+}
+
+/* makes sure the list has n free elements in its last part */
+static void reserve_headers(SgObject who, ngx_http_request_t *r, ngx_uint_t n)
+{
+  ngx_list_t *l = &r->headers_out.headers;
+  ngx_list_part_t *part;
+  ngx_uint_t size;
+
+  if (l->last->nelts + n <= l->nalloc) return;
+
+  size = ngx_max(n, l->nalloc);
+  part = ngx_palloc(r->pool, sizeof(ngx_list_part_t));
+  if (part != NULL) part->elts = ngx_palloc(r->pool, size * l->size);
+  if (part == NULL || part->elts == NULL) {
+    raise_nginx_error(who, SG_MAKE_STRING("Failed to allocate headers"),
+		      Sg_MakeNginxError(NGX_HTTP_INTERNAL_SERVER_ERROR),
+		      SG_NIL);
   }
+  part->nelts = 0;
+  part->next = NULL;
+  l->last->next = part;
+  l->last = part;
+  /* only the last part is filled, so the capacity can be changed here */
+  l->nalloc = size;
 }
 
 /* response operation */
@@ -856,7 +1432,8 @@ static SgObject nginx_response_add_header(SgObject *argv, int argc, void *data)
 				    SG_INTERN("string"),
 				    argv[2], SG_NIL);
   }
-  ngx_add_header(argv[0], argv[1], argv[2]);
+  ngx_add_header(SG_INTERN("nginx-response-header-add!"),
+		 argv[0], argv[1], argv[2]);
   return argv[0];
 }
 static SG_DEFINE_SUBR(nginx_response_add_header_stub, 3, 0,
@@ -883,8 +1460,8 @@ static SgObject nginx_response_set_header(SgObject *argv, int argc, void *data)
 				    SG_INTERN("string"),
 				    argv[2], SG_NIL);
   }
-  ngx_remove_header(argv[0], argv[1]);
-  ngx_add_header(argv[0], argv[1], argv[2]);
+  ngx_set_header(SG_INTERN("nginx-response-header-set!"),
+		 argv[0], argv[1], argv[2]);
   return argv[0];
 }
 static SG_DEFINE_SUBR(nginx_response_set_header_stub, 3, 0,
@@ -906,19 +1483,64 @@ static SgObject nginx_response_del_header(SgObject *argv, int argc, void *data)
 				    SG_INTERN("string"),
 				    argv[1], SG_NIL);
   }
-  ngx_remove_header(argv[0], argv[1]);
+  ngx_remove_header(SG_INTERN("nginx-response-header-remove!"),
+		    argv[0], argv[1]);
   return argv[0];
 }
 static SG_DEFINE_SUBR(nginx_response_del_header_stub, 2, 0,
 		      nginx_response_del_header, SG_FALSE, NULL);
 
+/* 
+   (nginx-response-headers-set! response alist)
+   the alist is the same format as nginx-response-headers returns, i.e.
+   ((name value) ...), or ((name . value) ...)
+ */
+static SgObject nginx_response_set_headers(SgObject *argv, int argc,
+					   void *data)
+{
+  SgObject who = SG_INTERN("nginx-response-headers-set!");
+  SgObject cp;
+  long n;
 
-/* conditions */
-static SgClass *error_cpl[] = {
-  SG_CLASS_IO_ERROR,
-  SG_ERROR_CONDITION_CPL,
-  NULL
-};
+  if (argc != 2) {
+    Sg_WrongNumberOfArgumentsViolation(who, 2, argc, SG_NIL);
+  }
+  if (!SG_NGINX_RESPONSEP(argv[0])) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("nginx-response"),
+				    argv[0], SG_NIL);
+  }
+  n = Sg_Length(argv[1]);
+  if (n < 0) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("list"), argv[1], SG_NIL);
+  }
+  /* check all first, not to set the headers partially */
+  SG_FOR_EACH(cp, argv[1]) {
+    SgObject h = SG_CAR(cp);
+    if (!SG_PAIRP(h) || !SG_STRINGP(SG_CAR(h)) ||
+	!(SG_STRINGP(SG_CDR(h)) ||
+	  (SG_PAIRP(SG_CDR(h)) && SG_STRINGP(SG_CADR(h))))) {
+      Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("alist of strings"),
+				      argv[1], SG_LIST1(h));
+    }
+  }
+  reserve_headers(who, SG_NGINX_RESPONSE(argv[0])->request, (ngx_uint_t)n);
+  SG_FOR_EACH(cp, argv[1]) {
+    SgObject h = SG_CAR(cp);
+    SgObject v = SG_PAIRP(SG_CDR(h)) ? SG_CADR(h) : SG_CDR(h);
+    ngx_set_header(who, argv[0], SG_CAR(h), v);
+  }
+  return argv[0];
+}
+static SG_DEFINE_SUBR(nginx_response_set_headers_stub, 2, 0,
+		      nginx_response_set_headers, SG_FALSE, NULL);
+
+
+/* conditions */
+static SgClass *error_cpl[] = {
+  SG_CLASS_IO_ERROR,
+  SG_ERROR_CONDITION_CPL,
+  NULL
+};
 
 SG_CLASS_DECL(Sg_NginxErrorClass);
 #define SG_CLASS_NGINX_ERROR (&Sg_NginxErrorClass)
@@ -955,22 +1577,157 @@ static SgObject Sg_MakeNginxError(int status)
   return c;
 }
 
-static void raise_nginx_error(SgObject who, SgObject msg,
-			      SgObject c, SgObject irr)
+static SgObject make_nginx_condition(SgObject who, SgObject msg,
+				     SgObject c, SgObject irr)
 {
-  SgObject sc;
   if (SG_NULLP(irr)) {
-    sc = Sg_Condition(SG_LIST3(c,
-			       Sg_MakeWhoCondition(who),
-			       Sg_MakeMessageCondition(msg)));
+    return Sg_Condition(SG_LIST3(c,
+				 Sg_MakeWhoCondition(who),
+				 Sg_MakeMessageCondition(msg)));
   } else {
-    sc = Sg_Condition(SG_LIST4(c,
-			       Sg_MakeWhoCondition(who),
-			       Sg_MakeMessageCondition(msg),
-			       Sg_MakeIrritantsCondition(irr)));
+    return Sg_Condition(SG_LIST4(c,
+				 Sg_MakeWhoCondition(who),
+				 Sg_MakeMessageCondition(msg),
+				 Sg_MakeIrritantsCondition(irr)));
+  }
+}
+
+static void raise_nginx_error(SgObject who, SgObject msg,
+			      SgObject c, SgObject irr)
+{
+  Sg_Raise(make_nginx_condition(who, msg, c, irr), FALSE);
+}
+
+/* Set-Cookie */
+#define COOKIE_NAME_SEPARATORS  "()<>@,;:\\\"/[]?={} \t"
+#define COOKIE_VALUE_SEPARATORS " \",;\\"
+#define MAX_COOKIE_TIME         INT64_C(253402300799) /* 9999-12-31 */
+
+static char *cookie_octets(SgObject who, SgObject s, const char *separators)
+{
+  char *r, *p;
+  if (!SG_STRINGP(s)) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("string"), s, SG_NIL);
+  }
+  r = Sg_Utf32sToUtf8s(SG_STRING(s));
+  for (p = r; *p; p++) {
+    u_char c = (u_char)*p;
+    if (c < 0x20 || c == 0x7f || c == ';' || ngx_strchr(separators, c)) {
+      Sg_AssertionViolation(who, SG_MAKE_STRING("invalid cookie octet"),
+			    SG_LIST1(s));
+    }
+  }
+  return r;
+}
+
+static int64_t cookie_integer(SgObject who, SgObject i)
+{
+  if (!SG_EXACT_INTP(i)) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("exact integer"),
+				    i, SG_NIL);
+  }
+  return Sg_GetIntegerS64Clamp(i, SG_CLAMP_BOTH, NULL);
+}
+
+/*
+  (%nginx-response-cookie-add! response name value domain path expires
+                               max-age secure http-only same-site)
+  #f means the attribute is not specified. expires can be either
+  a string or an exact integer of the POSIX time.
+ */
+static SgObject nginx_response_add_cookie(SgObject *argv, int argc, void *data)
+{
+  SgObject who = SG_INTERN("nginx-response-cookie-add!");
+  ngx_http_request_t *r;
+  header_name_t hn;
+  ngx_str_t v;
+  char *name, *value, *domain = NULL, *path = NULL, *expires = NULL;
+  char *same_site = NULL;
+  int64_t expires_time = 0, max_age = 0;
+  size_t len;
+  u_char *buf, *p;
+
+  if (argc != 10) {
+    Sg_WrongNumberOfArgumentsViolation(who, 10, argc, SG_NIL);
+  }
+  if (!SG_NGINX_RESPONSEP(argv[0])) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("nginx-response"),
+				    argv[0], SG_NIL);
   }
-  Sg_Raise(sc, FALSE);
+  r = SG_NGINX_RESPONSE(argv[0])->request;
+  name = cookie_octets(who, argv[1], COOKIE_NAME_SEPARATORS);
+  value = cookie_octets(who, argv[2], COOKIE_VALUE_SEPARATORS);
+  if (*name == '\0') {
+    Sg_AssertionViolation(who, SG_MAKE_STRING("empty cookie name"),
+			  SG_LIST1(argv[1]));
+  }
+  len = ngx_strlen(name) + 1 + ngx_strlen(value);
+
+  if (!SG_FALSEP(argv[3])) {
+    domain = cookie_octets(who, argv[3], "");
+    len += sizeof("; Domain=") - 1 + ngx_strlen(domain);
+  }
+  if (!SG_FALSEP(argv[4])) {
+    path = cookie_octets(who, argv[4], "");
+    len += sizeof("; Path=") - 1 + ngx_strlen(path);
+  }
+  if (SG_STRINGP(argv[5])) {
+    expires = cookie_octets(who, argv[5], "");
+    len += sizeof("; Expires=") - 1 + ngx_strlen(expires);
+  } else if (!SG_FALSEP(argv[5])) {
+    expires_time = cookie_integer(who, argv[5]);
+    /* keep the year 4 digits */
+    if (expires_time < 0) expires_time = 0;
+    if (expires_time > MAX_COOKIE_TIME) expires_time = MAX_COOKIE_TIME;
+    len += sizeof("; Expires=Thu, 01-Jan-1970 00:00:00 GMT") - 1;
+  }
+  if (!SG_FALSEP(argv[6])) {
+    max_age = cookie_integer(who, argv[6]);
+    len += sizeof("; Max-Age=") - 1 + NGX_INT64_LEN;
+  }
+  if (!SG_FALSEP(argv[7])) len += sizeof("; Secure") - 1;
+  if (!SG_FALSEP(argv[8])) len += sizeof("; HttpOnly") - 1;
+  if (!SG_FALSEP(argv[9])) {
+    same_site = cookie_octets(who, argv[9], COOKIE_VALUE_SEPARATORS);
+    len += sizeof("; SameSite=") - 1 + ngx_strlen(same_site);
+  }
+
+  buf = ngx_pnalloc(r->pool, len);
+  if (buf == NULL) {
+    raise_nginx_error(who, SG_MAKE_STRING("Failed to allocate Set-Cookie"),
+		      Sg_MakeNginxError(NGX_HTTP_INTERNAL_SERVER_ERROR),
+		      SG_NIL);
+  }
+
+  p = ngx_sprintf(buf, "%s=%s", name, value);
+  if (domain) p = ngx_sprintf(p, "; Domain=%s", domain);
+  if (path) p = ngx_sprintf(p, "; Path=%s", path);
+  if (expires) {
+    p = ngx_sprintf(p, "; Expires=%s", expires);
+  } else if (!SG_FALSEP(argv[5])) {
+    p = ngx_cpymem(p, "; Expires=", sizeof("; Expires=") - 1);
+    p = ngx_http_cookie_time(p, (time_t)expires_time);
+  }
+  if (!SG_FALSEP(argv[6])) p = ngx_sprintf(p, "; Max-Age=%L", max_age);
+  if (!SG_FALSEP(argv[7])) {
+    p = ngx_cpymem(p, "; Secure", sizeof("; Secure") - 1);
+  }
+  if (!SG_FALSEP(argv[8])) {
+    p = ngx_cpymem(p, "; HttpOnly", sizeof("; HttpOnly") - 1);
+  }
+  if (same_site) p = ngx_sprintf(p, "; SameSite=%s", same_site);
+
+  /* the same hash as nginx-response-header-add!, so it can be removed */
+  ngx_str_set(&hn.key, "Set-Cookie");
+  hn.lowcase_key = (u_char *)"set-cookie";
+  hn.hash = ngx_hash_key(hn.lowcase_key, hn.key.len);
+  v.data = buf;
+  v.len = p - buf;
+  add_header(who, argv[0], &hn, &v);
+  return argv[0];
 }
+static SG_DEFINE_SUBR(nginx_response_add_cookie_stub, 10, 0,
+		      nginx_response_add_cookie, SG_FALSE, NULL);
 
 /* Ports */
 static SgClass *port_cpl[] = {
@@ -994,6 +1751,7 @@ typedef struct
   ngx_chain_t        *current_chain;
   unsigned char      *current_buffer;
   SgObject            temp_inp;
+  int64_t             consumed;	/* bytes read so far */
 } SgRequestInputPort;
 SG_CLASS_DECL(Sg_RequestInputPortClass);
 SG_DEFINE_BUILTIN_CLASS(Sg_RequestInputPortClass, Sg_DefaultPortPrinter,
@@ -1034,17 +1792,17 @@ static int64_t request_in_read_u8(SgObject self, uint8_t *buf, int64_t size)
 		    "'sagittarius': reading from buffer %p",
 		    port->current_buffer);
     
-      if (port->current_buffer) {
-	for (; read < size; read++) {
-	  if (port->current_buffer == port->current_chain->buf->last) {
-	    if (!port->current_chain->buf->last_buf) {
-	      port->current_chain = port->current_chain->next;
-	      port->current_buffer = port->current_chain->buf->pos;
-	    } else {
-	      break;
-	    }
-	  }
-	  buf[read] = *port->current_buffer++;
+      while (port->current_buffer && read < size) {
+	ngx_buf_t *b = port->current_chain->buf;
+	size_t n = ngx_min((size_t)(size - read),
+			   (size_t)(b->last - port->current_buffer));
+	ngx_memcpy(buf + read, port->current_buffer, n);
+	read += n;
+	port->current_buffer += n;
+	if (port->current_buffer == b->last) {
+	  if (b->last_buf || port->current_chain->next == NULL) break;
+	  port->current_chain = port->current_chain->next;
+	  port->current_buffer = port->current_chain->buf->pos;
 	}
       }
     }
@@ -1072,16 +1830,28 @@ static int64_t request_in_read_u8(SgObject self, uint8_t *buf, int64_t size)
       }
     }
   }
+  port->consumed += read;
   return read;
 }
 
 static int64_t request_in_read_u8_all(SgObject self, uint8_t **buf)
 {
+  ngx_http_request_t *req = SG_REQUEST_INPUT_PORT(self)->request;
   uint8_t b[BUFFER_SIZE];
   SgPort *buffer = NULL;
   SgBytePort byp;
   int64_t r = 0, c;
 
+  /* we know the size, so read it at once */
+  if (req->request_body && !req->headers_in.chunked &&
+      req->headers_in.content_length_n >= 0) {
+    int64_t rest = req->headers_in.content_length_n -
+      SG_REQUEST_INPUT_PORT(self)->consumed;
+    if (rest <= 0) return 0;
+    *buf = SG_NEW_ATOMIC2(uint8_t *, rest);
+    return request_in_read_u8(self, *buf, rest);
+  }
+  
   while (1) {
     c = request_in_read_u8(self, b, BUFFER_SIZE);
     if (buffer == NULL && c > 0) {
@@ -1124,9 +1894,100 @@ static SgObject make_request_input_port(ngx_http_request_t *request)
   port->current_chain = NULL;
   port->current_buffer = NULL;
   port->temp_inp = SG_UNDEF;
+  port->consumed = 0;
   return SG_OBJ(port);
 }
 
+/* 
+   The request body as bytevector(s).
+   In memory buffers are shared with NGINX, so the returned bytevectors
+   are immutable and must not be used after the request is finished.
+ */
+static SgObject make_bytevector_view(unsigned char *p, size_t len)
+{
+  SgByteVector *bv = SG_NEW(SgByteVector);
+  SG_SET_CLASS(bv, SG_CLASS_BVECTOR);
+  SG_BVECTOR_SIZE(bv) = len;
+  SG_BVECTOR_ELEMENTS(bv) = p;
+  bv->literalp = TRUE;
+  return SG_OBJ(bv);
+}
+
+static ssize_t read_buffer(ngx_buf_t *b, unsigned char *dst)
+{
+  if (ngx_buf_in_memory(b)) {
+    ngx_memcpy(dst, b->pos, b->last - b->pos);
+    return b->last - b->pos;
+  }
+  if (b->in_file) {
+    return ngx_read_file(b->file, dst, b->file_last - b->file_pos,
+			 b->file_pos);
+  }
+  return 0;			/* special buffer */
+}
+
+static SgObject nr_body_bytevector(SgNginxRequest *nr, int slicesp)
+{
+  ngx_http_request_t *r = nr->rawNginxRequest;
+  ngx_chain_t *cl;
+  off_t size = 0;
+  SgObject h = SG_NIL, t = SG_NIL, bv;
+  unsigned char *p;
+
+  if (!r->request_body || !r->request_body->bufs) {
+    return slicesp? SG_NIL: SG_FALSE;
+  }
+  for (cl = r->request_body->bufs; cl; cl = cl->next) {
+    ngx_buf_t *b = cl->buf;
+    if (ngx_buf_in_memory(b)) {
+      if (slicesp || (size == 0 && cl->next == NULL)) {
+	bv = make_bytevector_view(b->pos, b->last - b->pos);
+	if (!slicesp) return bv;
+	SG_APPEND1(h, t, bv);
+      }
+    } else if (b->in_file && slicesp) {
+      bv = Sg_MakeByteVector(ngx_buf_size(b), 0);
+      if (read_buffer(b, SG_BVECTOR_ELEMENTS(bv)) == NGX_ERROR) goto err;
+      SG_APPEND1(h, t, bv);
+    }
+    size += ngx_buf_size(b);
+  }
+  if (slicesp) return h;
+
+  bv = Sg_MakeByteVector(size, 0);
+  p = SG_BVECTOR_ELEMENTS(bv);
+  for (cl = r->request_body->bufs; cl; cl = cl->next) {
+    ssize_t n = read_buffer(cl->buf, p);
+    if (n == NGX_ERROR) goto err;
+    p += n;
+  }
+  return bv;
+
+ err:
+  raise_nginx_error(SG_INTERN("nginx-request-body-bytevector"),
+		    SG_MAKE_STRING("Failed to read request body"),
+		    Sg_MakeNginxError(NGX_HTTP_INTERNAL_SERVER_ERROR),
+		    SG_NIL);
+  return SG_UNDEF;		/* dummy */
+}
+
+static SgObject nginx_request_body_bytevector(SgObject *argv, int argc,
+					      void *data)
+{
+  if (argc != 2) {
+    Sg_WrongNumberOfArgumentsViolation(SG_INTERN("nginx-request-body-bytevector"),
+				       2, argc, SG_NIL);
+  }
+  if (!SG_NGINX_REQUESTP(argv[0])) {
+    Sg_WrongTypeOfArgumentViolation(SG_INTERN("nginx-request-body-bytevector"),
+				    SG_INTERN("nginx-request"),
+				    argv[0], SG_NIL);
+  }
+  return nr_body_bytevector(SG_NGINX_REQUEST(argv[0]), !SG_FALSEP(argv[1]));
+}
+static SG_DEFINE_SUBR(nginx_request_body_bytevector_stub, 2, 0,
+		      nginx_request_body_bytevector, SG_FALSE, NULL);
+
 /* response output port */
 typedef struct
 {
@@ -1134,6 +1995,14 @@ typedef struct
   ngx_chain_t        *root;
   ngx_chain_t        *buffer;
   ngx_http_request_t *request;
+  /* streaming mode, the chain is sent whenever the port is flushed */
+  int                 streaming;
+  int                 header_sent;
+  int                 discard;	/* header only or special response */
+  ngx_int_t           header_rc; /* returned by ngx_http_send_header */
+  ngx_chain_t        *free;	/* sent buffers which can be reused */
+  ngx_chain_t        *busy;	/* buffers still owned by NGINX */
+  size_t              large_write; /* 0 = disabled */
 } SgResponseOutputPort;
 
 SG_CLASS_DECL(Sg_ResponseOutputPortClass);
@@ -1151,15 +2020,25 @@ SG_DEFINE_BUILTIN_CLASS(Sg_ResponseOutputPortClass, Sg_DefaultPortPrinter,
 #define SG_RESPONSE_OUTPUT_PORT_REQUEST(obj)	\
   (SG_RESPONSE_OUTPUT_PORT(obj)->request)
 
-static void allocate_buffer(SgObject self)
+#define RESPONSE_BUFFER_TAG ((ngx_buf_tag_t)&ngx_http_sagittarius_module)
+
+static void allocate_buffer(SgObject self, size_t size)
 {
+  SgResponseOutputPort *port = SG_RESPONSE_OUTPUT_PORT(self);
   ngx_http_request_t *r = SG_RESPONSE_OUTPUT_PORT_REQUEST(self);
-  ngx_chain_t *c = (ngx_chain_t *)ngx_pcalloc(r->pool, sizeof(ngx_chain_t));
-  ngx_buf_t *b = (ngx_buf_t *)ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+  ngx_chain_t *c;
+  ngx_buf_t *b;
 
   ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0,
 		"'sagittarius': Allocating response buffer");
-  if (c == NULL || b == NULL) {
+  /* reuse the buffer NGINX has already sent, if there is */
+  c = ngx_chain_get_free_buf(r->pool, &port->free);
+  if (c != NULL && (size_t)(c->buf->end - c->buf->start) < size) {
+    c->buf->start = ngx_palloc(r->pool, size);
+    c->buf->end = c->buf->start + size;
+    c->buf->pos = c->buf->last = c->buf->start;
+  }
+  if (c == NULL || c->buf->start == NULL) {
     ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
 		  "'sagittarius': Failed to allocate response buffer.");
     raise_nginx_error(SG_INTERN("put-u8"),
@@ -1168,40 +2047,159 @@ static void allocate_buffer(SgObject self)
 		      Sg_MakeNginxError(NGX_HTTP_INTERNAL_SERVER_ERROR),
 		      SG_NIL);
   }
-  /* TODO maybe we can use nginx allocator? */
-  b->pos = b->last = SG_NEW_ATOMIC2(unsigned char *, BUFFER_SIZE);
+  b = c->buf;
   b->last_buf = 1;		/* may be reset later */
-  b->memory = 1;
-  c->buf = b;
-  c->next = NULL;
+  b->flush = 0;
+  b->temporary = 1;
+  b->tag = RESPONSE_BUFFER_TAG;
   if (SG_RESPONSE_OUTPUT_PORT_BUFFER(self)) {
+    SG_RESPONSE_OUTPUT_PORT_BUFFER(self)->buf->last_buf = 0;
     SG_RESPONSE_OUTPUT_PORT_BUFFER(self)->next = c;
+  } else {
+    SG_RESPONSE_OUTPUT_PORT_ROOT(self) = c;
   }
   SG_RESPONSE_OUTPUT_PORT_BUFFER(self) = c;
   /* ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0, */
-  /* 		"'sagittarius': %d bytes allocated", BUFFER_SIZE); */
+  /* 		"'sagittarius': %d bytes allocated", size); */
+}
+
+/* 
+   Streaming mode.
+   The headers are sent on the very first call and the content length is
+   removed so that the chunked filter takes care of the body. The sent
+   buffers are moved to the busy chain and reused once NGINX has written
+   them out. If the response turns out to have no body (e.g. HEAD or a
+   special response), the written buffers are discarded on every send.
+ */
+typedef enum {
+  SEND_FILLED,			/* the buffer is full */
+  SEND_FLUSH,			/* flush is requested */
+  SEND_LAST			/* the handler returned */
+} send_mode_t;
+
+static ngx_int_t response_out_send(SgObject self, send_mode_t mode)
+{
+  SgResponseOutputPort *port = SG_RESPONSE_OUTPUT_PORT(self);
+  ngx_http_request_t *r = port->request;
+  ngx_chain_t *out = port->root;
+  request_timing_t *timing;
+  ngx_chain_t *c;
+  ngx_int_t rc;
+
+  if (!port->header_sent) {
+    if (r->headers_out.status == 0) {
+      r->headers_out.status = NGX_HTTP_OK;
+    }
+    ngx_http_clear_content_length(r);
+    port->header_sent = TRUE;
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+      ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0,
+		    "'sagittarius': Streaming header returned %d", rc);
+      port->discard = TRUE;
+      port->header_rc = rc;
+    }
+  }
+
+  if (port->discard) {
+    /* the body won't be sent, recycle whatever has been written */
+    while (out) {
+      c = out;
+      out = out->next;
+      if (c->buf->tag == RESPONSE_BUFFER_TAG && c->buf->temporary) {
+	c->buf->pos = c->buf->last = c->buf->start;
+	c->next = port->free;
+	port->free = c;
+      }
+    }
+    port->root = port->buffer = NULL;
+    return port->header_rc;
+  }
+
+  if (out) {
+    port->buffer->buf->last_buf = (mode == SEND_LAST);
+    port->buffer->buf->flush = (mode == SEND_FLUSH);
+  } else if (mode != SEND_FILLED) {
+    /* nothing is written, but filters may still hold the data */
+    ngx_buf_t *b = ngx_calloc_buf(r->pool);
+    if (b == NULL) return NGX_ERROR;
+    out = ngx_alloc_chain_link(r->pool);
+    if (out == NULL) return NGX_ERROR;
+    b->last_buf = (mode == SEND_LAST);
+    b->flush = (mode == SEND_FLUSH);
+    out->buf = b;
+    out->next = NULL;
+  } else {
+    return NGX_OK;
+  }
+  port->root = port->buffer = NULL;
+
+  timing = request_timing(r);
+  if (timing) timing->response_bytes += compute_content_length(out);
+  rc = ngx_http_output_filter(r, out);
+  ngx_chain_update_chains(r->pool, &port->free, &port->busy, &out,
+			  RESPONSE_BUFFER_TAG);
+  return rc;
 }
 
+static void response_out_stream(SgObject self, send_mode_t mode)
+{
+  SgResponseOutputPort *port = SG_RESPONSE_OUTPUT_PORT(self);
+
+  if (response_out_send(self, mode) == NGX_ERROR) {
+    ngx_log_error(NGX_LOG_ERR, port->request->connection->log, 0,
+		  "'sagittarius': Failed to send streaming response");
+    raise_nginx_error(SG_INTERN("flush-output-port"),
+		      SG_MAKE_STRING("'sagittarius': [Internal]"
+				     " Failed to send streaming response"),
+		      Sg_MakeNginxError(NGX_HTTP_INTERNAL_SERVER_ERROR),
+		      SG_NIL);
+  }
+}
+
+static void response_out_flush(SgObject self)
+{
+  if (SG_RESPONSE_OUTPUT_PORT(self)->streaming) {
+    response_out_stream(self, SEND_FLUSH);
+  }
+}
+
+/* 
+   Writes are copied block by block; the current buffer is filled first
+   then the rest goes to the next one. A write bigger than the threshold
+   gets a buffer of its own so that it's copied only once.
+ */
 static int64_t response_out_put_u8_array(SgObject self, uint8_t *ba,
 					 int64_t size)
 {
-  int64_t written;
+  SgResponseOutputPort *port = SG_RESPONSE_OUTPUT_PORT(self);
+  int64_t written = 0;
   ngx_buf_t *buf;		/*  current buffer */
-  unsigned char *be;
-
-  if (!SG_RESPONSE_OUTPUT_PORT_BUFFER(self)) {
-    allocate_buffer(self);
-    SG_RESPONSE_OUTPUT_PORT_ROOT(self) = SG_RESPONSE_OUTPUT_PORT_BUFFER(self);
+  size_t n;
+
+  if (port->large_write > 0 && size >= (int64_t)port->large_write) {
+    allocate_buffer(self, (size_t)size);
+    buf = port->buffer->buf;
+    buf->last = ngx_cpymem(buf->last, ba, (size_t)size);
+    if (port->streaming) {
+      response_out_stream(self, SEND_FILLED);
+    }
+    return size;
   }
-  buf = SG_RESPONSE_OUTPUT_PORT_BUFFER(self)->buf;
-  be = buf->pos + BUFFER_SIZE;
-  for (written = 0; written < size; written++) {
-    if (buf->last == be) {
-      buf->last_buf = 0;
-      allocate_buffer(self);
-      buf = SG_RESPONSE_OUTPUT_PORT_BUFFER(self)->buf;
+
+  while (written < size) {
+    /* file buffers are not writable, so treat them as full */
+    if (!port->buffer || !port->buffer->buf->temporary ||
+	port->buffer->buf->last == port->buffer->buf->end) {
+      if (port->buffer && port->streaming) {
+	response_out_stream(self, SEND_FILLED);
+      }
+      allocate_buffer(self, BUFFER_SIZE);
     }
-    *buf->last++ = *ba++;
+    buf = port->buffer->buf;
+    n = ngx_min((size_t)(size - written), (size_t)(buf->end - buf->last));
+    buf->last = ngx_cpymem(buf->last, ba + written, n);
+    written += n;
   }
   return written;
 }
@@ -1209,7 +2207,7 @@ static int64_t response_out_put_u8_array(SgObject self, uint8_t *ba,
 #define response_out_close port_close
 
 static SgPortTable response_out_table = {
-  NULL,				/* no flush */
+  response_out_flush,
   response_out_close,
   NULL,				/* no ready */
   NULL,				/* lock */
@@ -1224,96 +2222,2403 @@ static SgPortTable response_out_table = {
   NULL,				/* write str */
 };
 
-static SgObject make_response_output_port(ngx_http_request_t *request)
+static SgObject make_response_output_port(ngx_http_request_t *request,
+					  ngx_http_sagittarius_conf_t *sg_conf)
 {
   SgResponseOutputPort *port = SG_NEW(SgResponseOutputPort);
   SG_INIT_PORT(port, SG_CLASS_RESPONSE_OUTPUT_PORT, SG_OUTPUT_PORT,
 	       &response_out_table, SG_FALSE);
+  port->root = NULL;
   port->buffer = NULL;
   port->request = request;
+  port->streaming = sg_conf->streaming;
+  port->header_sent = FALSE;
+  port->discard = FALSE;
+  port->header_rc = NGX_OK;
+  port->free = NULL;
+  port->busy = NULL;
+  port->large_write = sg_conf->large_write;
   return SG_OBJ(port);
 }
 
-static SgObject nginx_dispatch = SG_UNDEF;
-static ngx_thread_mutex_t global_lock;
+/* 
+   File response.
+   The file is appended to the chain as an in_file buffer, so NGINX
+   sends it with sendfile, directio or aio as configured.
+ */
+/* buffers which are not owned by the port, they must not be reused */
+#define EXTERNAL_BUFFER_TAG ((ngx_buf_tag_t)&response_out_table)
 
-static ngx_int_t ngx_http_sagittarius_init_process(ngx_cycle_t *cycle)
+/* links the chain [head, tail] after the current buffer */
+static void append_external_chain(SgObject self, ngx_chain_t *head,
+				  ngx_chain_t *tail)
 {
-  SgObject sym, lib;
-  ngx_log_error(NGX_LOG_DEBUG, cycle->log, 0,
-		"'sagittarius': Initialising Sagittarius process");
+  SgResponseOutputPort *port = SG_RESPONSE_OUTPUT_PORT(self);
 
-  if (ngx_thread_mutex_create(&global_lock, cycle->log) != NGX_OK) {
-    ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
-		"'sagittarius': Failed to initialise the mutex");
-    return NGX_ERROR;
+  tail->buf->last_buf = 1;	/* may be reset later */
+  if (port->buffer) {
+    port->buffer->buf->last_buf = 0;
+    port->buffer->next = head;
+  } else {
+    port->root = head;
   }
-  /* Initialise the sagittarius VM */
-  Sg_Init();
+  port->buffer = tail;
+  if (port->streaming) {
+    response_out_stream(self, SEND_FILLED);
+  }
+}
 
-  sym = SG_INTERN("(sagittarius nginx internal)");
-  ngx_log_error(NGX_LOG_DEBUG, cycle->log, 0,
-		"'sagittarius': "
-		"Initialising '(sagittarius nginx internal)' library");
-  lib = Sg_FindLibrary(sym, TRUE);
+static void raise_file_error(SgObject who, SgObject file, ngx_err_t err)
+{
+  ngx_int_t status;
+  switch (err) {
+  case NGX_ENOENT: case NGX_ENOTDIR: case NGX_ENAMETOOLONG:
+    status = NGX_HTTP_NOT_FOUND; break;
+  case NGX_EACCES:
+    status = NGX_HTTP_FORBIDDEN; break;
+  default:
+    status = NGX_HTTP_INTERNAL_SERVER_ERROR; break;
+  }
+  raise_nginx_error(who, SG_MAKE_STRING("Failed to open file"),
+		    Sg_MakeNginxError(status), SG_LIST1(file));
+}
 
-  Sg_InitStaticClassWithMeta(SG_CLASS_NGINX_CONTEXT, UC("<nginx-context>"),
-			     SG_LIBRARY(lib), NULL,
-			     SG_FALSE, nc_slots, 0);
-  Sg_InitStaticClassWithMeta(SG_CLASS_NGINX_FILTER_CONTEXT,
-			     UC("<nginx-filter-context>"),
-			     SG_LIBRARY(lib), NULL,
-			     SG_FALSE, nf_slots, 0);
-  Sg_InitStaticClassWithMeta(SG_CLASS_NGINX_REQUEST, UC("<nginx-request>"),
-			     SG_LIBRARY(lib), NULL,
-			     SG_FALSE, nr_slots, 0);
-  Sg_InitStaticClassWithMeta(SG_CLASS_NGINX_RESPONSE, UC("<nginx-response>"),
-			     SG_LIBRARY(lib), NULL,
-			     SG_FALSE, nres_slots, 0);
-  Sg_InitStaticClass(SG_CLASS_RESPONSE_OUTPUT_PORT, UC("<nginx-response-port>"),
-		     SG_LIBRARY(lib), NULL, 0);
+static ngx_file_t *open_response_file(SgObject who, ngx_http_request_t *r,
+				      SgObject file, off_t *size,
+				      time_t *mtime)
+{
+  ngx_http_core_loc_conf_t *clcf;
+  ngx_http_sagittarius_conf_t *sg_conf;
+  ngx_open_file_info_t of;
+  ngx_file_t *f;
+  ngx_str_t path;
 
-  Sg_InsertBinding(SG_LIBRARY(lib),
-		   SG_INTERN("nginx-context?"), &nginx_context_p_stub);
-  SG_PROCEDURE_NAME(&nginx_context_p_stub) = SG_MAKE_STRING("nginx-context?");
-  SG_PROCEDURE_TRANSPARENT(&nginx_context_p_stub) = SG_PROC_TRANSPARENT;
+  clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+  sg_conf = ngx_http_get_module_loc_conf(r, ngx_http_sagittarius_module);
+  f = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+  if (f == NULL) goto err;
+
+  ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+  of.read_ahead = clcf->read_ahead;
+  of.directio = clcf->directio;
+  of.valid = clcf->open_file_cache_valid;
+  of.min_uses = clcf->open_file_cache_min_uses;
+  of.errors = clcf->open_file_cache_errors;
+  of.events = clcf->open_file_cache_events;
+
+  if (SG_STRINGP(file)) {
+    char *p = Sg_Utf32sToUtf8s(SG_STRING(file));
+    /* the path must be NUL terminated */
+    path.len = ngx_strlen(p);
+    path.data = ngx_pnalloc(r->pool, path.len + 1);
+    if (path.data == NULL) goto err;
+    ngx_cpystrn(path.data, (u_char *)p, path.len + 1);
+    /* the cache is not thread safe, requests on thread pool can't use it */
+    if (ngx_open_cached_file(sg_conf->pool_name.len == 0
+			     ? clcf->open_file_cache : NULL,
+			     &path, &of, r->pool)
+	!= NGX_OK) {
+      raise_file_error(who, file, of.err);
+    }
+    if (!of.is_file) raise_file_error(who, file, NGX_ENOENT);
+    f->fd = of.fd;
+    f->name = path;
+    f->directio = of.is_directio;
+    *size = of.size;
+    *mtime = of.mtime;
+  } else {
+    /* the fd is owned by the request from now on */
+    ngx_pool_cleanup_t *cln;
+    ngx_pool_cleanup_file_t *clnf;
+    ngx_file_info_t fi;
+    ngx_fd_t fd = (ngx_fd_t)SG_INT_VALUE(file);
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+      raise_file_error(who, file, ngx_errno);
+    }
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) goto err;
+    clnf = cln->data;
+    clnf->fd = fd;
+    clnf->name = (u_char *)"";
+    clnf->log = r->connection->log;
+    cln->handler = ngx_pool_cleanup_file;
+
+    f->fd = fd;
+    ngx_str_set(&f->name, "");
+    *size = ngx_file_size(&fi);
+    *mtime = ngx_file_mtime(&fi);
+  }
+  f->log = r->connection->log;
+  return f;
+
+ err:
+  raise_nginx_error(who, SG_MAKE_STRING("Failed to allocate file buffer"),
+		    Sg_MakeNginxError(NGX_HTTP_INTERNAL_SERVER_ERROR),
+		    SG_LIST1(file));
+  return NULL;			/* dummy */
+}
 
-  Sg_InsertBinding(SG_LIBRARY(lib), SG_INTERN("nginx-context-parameter-ref"),
-		   &nginx_context_parameter_ref_stub);
-  SG_PROCEDURE_NAME(&nginx_context_parameter_ref_stub) =
-    SG_MAKE_STRING("nginx-context-parameter-ref");
-  SG_PROCEDURE_TRANSPARENT(&nginx_context_parameter_ref_stub) =
-    SG_PROC_NO_SIDE_EFFECT;
+/* (%nginx-response-send-file response file offset length) */
+static SgObject nginx_response_send_file(SgObject *argv, int argc, void *data)
+{
+  SgObject who = SG_INTERN("nginx-response-send-file");
+  SgObject self;
+  SgResponseOutputPort *port;
+  ngx_http_request_t *r;
+  ngx_file_t *file;
+  ngx_chain_t *c;
+  ngx_buf_t *b;
+  off_t size, offset, length;
+  time_t mtime;
 
-  Sg_InsertBinding(SG_LIBRARY(lib),
-		   SG_INTERN("nginx-filter-context?"),
-		   &nginx_filter_context_p_stub);
-  SG_PROCEDURE_NAME(&nginx_filter_context_p_stub) =
-    SG_MAKE_STRING("nginx-filter-context?");
-  SG_PROCEDURE_TRANSPARENT(&nginx_filter_context_p_stub) = SG_PROC_TRANSPARENT;
+  if (argc != 4) {
+    Sg_WrongNumberOfArgumentsViolation(who, 4, argc, SG_NIL);
+  }
+  if (!SG_NGINX_RESPONSEP(argv[0])) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("nginx-response"),
+				    argv[0], SG_NIL);
+  }
+  if (!SG_STRINGP(argv[1]) && !SG_INTP(argv[1])) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("string or fd"),
+				    argv[1], SG_NIL);
+  }
+  if (!SG_EXACT_INTP(argv[2]) || Sg_NegativeP(argv[2])) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("non negative integer"),
+				    argv[2], SG_NIL);
+  }
+  if (!SG_FALSEP(argv[3]) &&
+      (!SG_EXACT_INTP(argv[3]) || Sg_NegativeP(argv[3]))) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("non negative integer"),
+				    argv[3], SG_NIL);
+  }
+  self = SG_NGINX_RESPONSE(argv[0])->out;
+  port = SG_RESPONSE_OUTPUT_PORT(self);
+  r = port->request;
+
+  file = open_response_file(who, r, argv[1], &size, &mtime);
+  offset = (off_t)Sg_GetIntegerS64Clamp(argv[2], SG_CLAMP_NONE, NULL);
+  length = SG_FALSEP(argv[3])
+    ? size - offset
+    : (off_t)Sg_GetIntegerS64Clamp(argv[3], SG_CLAMP_NONE, NULL);
+  if (offset > size || length > size - offset) {
+    Sg_AssertionViolation(who, SG_MAKE_STRING("range out of file"),
+			  SG_LIST3(argv[1], argv[2], argv[3]));
+  }
+  if (r->headers_out.last_modified == NULL) {
+    r->headers_out.last_modified_time = mtime;
+  }
+  /* NGINX doesn't like empty file buffers */
+  if (length == 0) return SG_UNDEF;
 
-  Sg_InsertBinding(SG_LIBRARY(lib),
-		   SG_INTERN("nginx-filter-context-parameter-ref"),
-		   &nginx_filter_context_parameter_ref_stub);
-  SG_PROCEDURE_NAME(&nginx_filter_context_parameter_ref_stub) =
-    SG_MAKE_STRING("nginx-filter-context-parameter-ref");
-  SG_PROCEDURE_TRANSPARENT(&nginx_filter_context_parameter_ref_stub) =
-    SG_PROC_NO_SIDE_EFFECT;
-  Sg_InsertBinding(SG_LIBRARY(lib),
-		   SG_INTERN("nginx-filter-context-name"),
-		   &nginx_filter_context_name_stub);
-  SG_PROCEDURE_NAME(&nginx_filter_context_name_stub) =
-    SG_MAKE_STRING("nginx-filter-context-name");
-  SG_PROCEDURE_TRANSPARENT(&nginx_filter_context_name_stub) =
-    SG_PROC_NO_SIDE_EFFECT;
+  b = ngx_calloc_buf(r->pool);
+  c = ngx_alloc_chain_link(r->pool);
+  if (b == NULL || c == NULL) {
+    raise_nginx_error(who, SG_MAKE_STRING("Failed to allocate file buffer"),
+		      Sg_MakeNginxError(NGX_HTTP_INTERNAL_SERVER_ERROR),
+		      SG_NIL);
+  }
+  b->file = file;
+  b->in_file = 1;
+  b->file_pos = offset;
+  b->file_last = offset + length;
+  b->tag = EXTERNAL_BUFFER_TAG;
+  c->buf = b;
+  c->next = NULL;
+  append_external_chain(self, c, c);
+  return SG_UNDEF;
+}
+static SG_DEFINE_SUBR(nginx_response_send_file_stub, 4, 0,
+		      nginx_response_send_file, SG_FALSE, NULL);
 
-  
-  Sg_InsertBinding(SG_LIBRARY(lib),
-		   SG_INTERN("nginx-request?"), &nginx_request_p_stub);
-  SG_PROCEDURE_NAME(&nginx_request_p_stub) = SG_MAKE_STRING("nginx-request?");
-  SG_PROCEDURE_TRANSPARENT(&nginx_request_p_stub) = SG_PROC_TRANSPARENT;
+/* 
+   Gather write.
+   The body fragments are linked to the chain as they are, bytevectors
+   are referred directly and strings are encoded into the pool once.
+   NGINX may keep the buffers after the handler returned, so the
+   bytevectors are pinned in the table below until the request pool is
+   destroyed. The table is shared by the threads, thus the lock. The
+   sockets are also pinned in the same table.
+ */
+static ngx_thread_mutex_t global_lock;
+static SgObject pinned_objects = SG_UNDEF;
 
-  Sg_InsertBinding(SG_LIBRARY(lib),
+static void unpin_object(void *data)
+{
+  SgObject key = SG_OBJ(data);
+  ngx_thread_mutex_lock(&global_lock, ngx_cycle->log);
+  Sg_HashTableDelete(SG_HASHTABLE(pinned_objects), key);
+  ngx_thread_mutex_unlock(&global_lock, ngx_cycle->log);
+}
+
+/* the value is kept until the request pool is destroyed */
+static void pin_value(SgObject who, ngx_http_request_t *r, SgObject key,
+		      SgObject value)
+{
+  ngx_pool_cleanup_t *cln;
+  SgObject pinned;
+  ngx_thread_mutex_lock(&global_lock, r->connection->log);
+  pinned = Sg_HashTableRef(SG_HASHTABLE(pinned_objects), key, SG_FALSE);
+  Sg_HashTableSet(SG_HASHTABLE(pinned_objects), key,
+		  SG_FALSEP(pinned) ? SG_LIST1(value) : Sg_Cons(value, pinned),
+		  0);
+  ngx_thread_mutex_unlock(&global_lock, r->connection->log);
+  if (!SG_FALSEP(pinned)) return;
+
+  cln = ngx_pool_cleanup_add(r->pool, 0);
+  if (cln == NULL) {
+    unpin_object(key);
+    raise_nginx_error(who, SG_MAKE_STRING("Failed to allocate cleanup"),
+		      Sg_MakeNginxError(NGX_HTTP_INTERNAL_SERVER_ERROR),
+		      SG_NIL);
+  }
+  cln->handler = unpin_object;
+  cln->data = key;
+}
+
+static void pin_object(ngx_http_request_t *r, SgObject key)
+{
+  ngx_thread_mutex_lock(&global_lock, r->connection->log);
+  Sg_HashTableSet(SG_HASHTABLE(pinned_objects), key, key, 0);
+  ngx_thread_mutex_unlock(&global_lock, r->connection->log);
+}
+
+/* (%nginx-response-body-add! response status body)
+   the status is needed here as the streaming mode may send the header */
+static SgObject nginx_response_body_add(SgObject *argv, int argc, void *data)
+{
+  SgObject who = SG_INTERN("nginx-response-body-add!");
+  SgObject self, cp;
+  ngx_http_request_t *r;
+  ngx_chain_t *head = NULL, *tail = NULL;
+  int pin = FALSE;
+
+  if (argc != 3) {
+    Sg_WrongNumberOfArgumentsViolation(who, 3, argc, SG_NIL);
+  }
+  if (!SG_NGINX_RESPONSEP(argv[0])) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("nginx-response"),
+				    argv[0], SG_NIL);
+  }
+  if (!SG_LISTP(argv[2])) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("list"), argv[2], SG_NIL);
+  }
+  self = SG_NGINX_RESPONSE(argv[0])->out;
+  r = SG_RESPONSE_OUTPUT_PORT_REQUEST(self);
+  if (SG_INTP(argv[1]) && !SG_RESPONSE_OUTPUT_PORT(self)->header_sent) {
+    r->headers_out.status = SG_INT_VALUE(argv[1]);
+  }
+
+  SG_FOR_EACH(cp, argv[2]) {
+    SgObject o = SG_CAR(cp);
+    ngx_chain_t *c;
+    ngx_buf_t *b;
+    u_char *p;
+    size_t size;
+
+    if (SG_BVECTORP(o)) {
+      size = SG_BVECTOR_SIZE(o);
+      p = SG_BVECTOR_ELEMENTS(o);
+      pin = TRUE;
+    } else if (SG_STRINGP(o)) {
+      SgChar *s = SG_STRING_VALUE(o);
+      long i, len = SG_STRING_SIZE(o);
+      for (size = 0, i = 0; i < len; i++) size += utf8_size(s[i]);
+      p = size ? ngx_pnalloc(r->pool, size) : NULL;
+      if (size && p == NULL) goto err;
+      if (p) utf8_encode(p, s, len);
+    } else {
+      Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("bytevector or string"),
+				      o, SG_LIST1(argv[2]));
+      return SG_UNDEF;		/* dummy */
+    }
+    /* NGINX doesn't like empty buffers either */
+    if (size == 0) continue;
+
+    b = ngx_calloc_buf(r->pool);
+    c = ngx_alloc_chain_link(r->pool);
+    if (b == NULL || c == NULL) goto err;
+    b->start = b->pos = p;
+    b->end = b->last = p + size;
+    b->memory = 1;
+    b->tag = EXTERNAL_BUFFER_TAG;
+    c->buf = b;
+    c->next = NULL;
+    if (tail) {
+      tail->next = c;
+    } else {
+      head = c;
+    }
+    tail = c;
+  }
+  if (head == NULL) return SG_UNDEF;
+  if (pin) pin_value(who, r, argv[0], argv[2]);
+  append_external_chain(self, head, tail);
+  return SG_UNDEF;
+
+ err:
+  raise_nginx_error(who, SG_MAKE_STRING("Failed to allocate body buffer"),
+		    Sg_MakeNginxError(NGX_HTTP_INTERNAL_SERVER_ERROR),
+		    SG_NIL);
+  return SG_UNDEF;		/* dummy */
+}
+static SG_DEFINE_SUBR(nginx_response_body_add_stub, 3, 0,
+		      nginx_response_body_add, SG_FALSE, NULL);
+
+static SgObject nginx_dispatch = SG_UNDEF;
+static SgObject nginx_dispatch_callback = SG_UNDEF;
+
+/* 
+   Non blocking sockets.
+   The operations register a callback and return immediately, the
+   callback is called from the event loop when the operation is done.
+   The VM can't suspend the handler in the middle of C frames, so the
+   continuation of the handler is the callback itself. The response is
+   sent when the handler or a callback returns without pending operations.
+ */
+typedef enum {
+  SOCKET_IDLE,
+  SOCKET_CONNECT,
+  SOCKET_SEND,
+  SOCKET_RECEIVE
+} socket_op_t;
+
+/* 
+   Keepalive pools.
+   The released connections are kept per worker, keyed by the pool name
+   and the address. There would be only a few pools so they are in a
+   list. The idle connections are reused in LIFO order and the oldest one
+   is closed when the pool is full.
+ */
+typedef struct
+{
+  ngx_queue_t queue;		/* in socket_pools */
+  ngx_str_t key;		/* name NUL address */
+  ngx_queue_t idle;
+  ngx_queue_t free;
+  ngx_uint_t nidle;
+  ngx_uint_t max_idle;
+  ngx_msec_t idle_timeout;
+  ngx_uint_t max_requests;	/* 0 = unlimited */
+} socket_pool_t;
+
+typedef struct
+{
+  ngx_queue_t queue;		/* in idle or free of the pool */
+  socket_pool_t *pool;
+  ngx_connection_t *connection;
+  ngx_uint_t requests;
+} socket_keepalive_t;
+
+static ngx_queue_t socket_pools;
+
+typedef struct
+{
+  SG_HEADER;
+  SgObject request;		/* nginx-request */
+  SgObject address;
+  SgObject callback;		/* callback of the pending operation */
+  SgObject buffer;		/* bytevector of the pending operation */
+  SgObject result;		/* result to be passed to the callback */
+  size_t done;			/* sent bytes */
+  socket_op_t op;
+  ngx_msec_t timeout;
+  ngx_peer_connection_t peer;
+  ngx_event_t done_event;	/* calls the callback */
+  socket_pool_t *pool;		/* NULL = not pooled */
+  ngx_uint_t requests;		/* times the connection is released */
+} SgNginxSocket;
+SG_CLASS_DECL(Sg_NginxSocketClass);
+#define SG_CLASS_NGINX_SOCKET (&Sg_NginxSocketClass)
+#define SG_NGINX_SOCKET(obj)  ((SgNginxSocket *)obj)
+#define SG_NGINX_SOCKETP(obj) SG_XTYPEP(obj, SG_CLASS_NGINX_SOCKET)
+
+static void nginx_socket_printer(SgObject self, SgPort *port,
+				 SgWriteContext *ctx)
+{
+  Sg_Printf(port, UC("#<nginx-socket %A>"), SG_NGINX_SOCKET(self)->address);
+}
+SG_DEFINE_BUILTIN_CLASS_SIMPLE(Sg_NginxSocketClass, nginx_socket_printer);
+
+static ngx_int_t finish_response(ngx_http_request_t *r, SgObject req,
+				 SgObject status);
+
+/* the callback is always called from the event loop, never in place */
+static void socket_done(SgNginxSocket *s, SgObject result)
+{
+  ngx_connection_t *c = s->peer.connection;
+  if (c) {
+    if (c->read->timer_set) ngx_del_timer(c->read);
+    if (c->write->timer_set) ngx_del_timer(c->write);
+  }
+  s->result = result;
+  ngx_post_event(&s->done_event, &ngx_posted_events);
+}
+
+static void socket_error(SgNginxSocket *s, const char *msg, ngx_err_t err)
+{
+  SgObject who;
+  ngx_int_t status = NGX_HTTP_BAD_GATEWAY;
+  switch (s->op) {
+  case SOCKET_CONNECT: who = SG_INTERN("nginx-socket-connect"); break;
+  case SOCKET_SEND:    who = SG_INTERN("nginx-socket-send"); break;
+  default:             who = SG_INTERN("nginx-socket-receive"); break;
+  }
+  if (err == NGX_ETIMEDOUT) status = NGX_HTTP_GATEWAY_TIME_OUT;
+  socket_done(s, make_nginx_condition(who, Sg_MakeStringC(msg),
+				      Sg_MakeNginxError(status),
+				      SG_LIST2(s->address, SG_MAKE_INT(err))));
+}
+
+static void socket_send(SgNginxSocket *s)
+{
+  ngx_connection_t *c = s->peer.connection;
+  size_t size = SG_BVECTOR_SIZE(s->buffer);
+  ssize_t n;
+
+  while (s->done < size) {
+    n = c->send(c, SG_BVECTOR_ELEMENTS(s->buffer) + s->done, size - s->done);
+    if (n == NGX_AGAIN) {
+      if (!c->write->timer_set) ngx_add_timer(c->write, s->timeout);
+      if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+	socket_error(s, "Failed to send", ngx_socket_errno);
+      }
+      return;
+    }
+    if (n == NGX_ERROR) {
+      socket_error(s, "Failed to send", ngx_socket_errno);
+      return;
+    }
+    s->done += n;
+  }
+  socket_done(s, SG_OBJ(s));
+}
+
+static void socket_receive(SgNginxSocket *s)
+{
+  ngx_connection_t *c = s->peer.connection;
+  uint8_t *buf = SG_BVECTOR_ELEMENTS(s->buffer);
+  size_t size = SG_BVECTOR_SIZE(s->buffer);
+  ssize_t n;
+
+  n = c->recv(c, buf, size);
+  if (n == NGX_AGAIN) {
+    if (!c->read->timer_set) ngx_add_timer(c->read, s->timeout);
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+      socket_error(s, "Failed to receive", ngx_socket_errno);
+    }
+  } else if (n == NGX_ERROR) {
+    socket_error(s, "Failed to receive", ngx_socket_errno);
+  } else if (n == 0) {
+    socket_done(s, SG_EOF);
+  } else if ((size_t)n == size) {
+    socket_done(s, s->buffer);
+  } else {
+    socket_done(s, Sg_MakeByteVectorFromU8Array(buf, n));
+  }
+}
+
+static void socket_connected(SgNginxSocket *s)
+{
+  ngx_connection_t *c = s->peer.connection;
+  int err = 0;
+  socklen_t len = sizeof(int);
+
+  if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *)&err, &len) == -1) {
+    err = ngx_socket_errno;
+  }
+  if (err) {
+    socket_error(s, "Failed to connect", err);
+  } else {
+    socket_done(s, SG_OBJ(s));
+  }
+}
+
+static void socket_event_handler(ngx_event_t *ev)
+{
+  ngx_connection_t *c = ev->data;
+  SgNginxSocket *s = c->data;
+
+  if (s->op == SOCKET_IDLE || s->done_event.posted) return;
+  if (ev->timedout) {
+    ev->timedout = 0;
+    socket_error(s, "Timed out", NGX_ETIMEDOUT);
+    return;
+  }
+  switch (s->op) {
+  case SOCKET_CONNECT: if (ev->write) socket_connected(s); break;
+  case SOCKET_SEND:    if (ev->write) socket_send(s); break;
+  case SOCKET_RECEIVE: if (!ev->write) socket_receive(s); break;
+  default: break;
+  }
+}
+
+/* runs the callback of a pending operation, called from the event loop */
+static void run_request_callback(SgObject req, SgObject callback,
+				 SgObject result)
+{
+  SgObject saved_loadpath;
+  ngx_http_request_t *r = SG_NGINX_REQUEST(req)->rawNginxRequest;
+  ngx_connection_t *c = r->connection;
+  volatile SgVM *vm = Sg_VM();
+  volatile SgObject status;
+  timing_mark_t mark;
+  ngx_int_t rc;
+
+  SG_NGINX_REQUEST(req)->pending--;
+  if (SG_NGINX_REQUEST(req)->finished) return;
+
+  ngx_http_set_log_request(c->log, r);
+  saved_loadpath = vm->loadPath;
+  vm->loadPath =
+    SG_NGINX_CONTEXT(SG_NGINX_REQUEST(req)->context)->loadPath;
+  timing_begin(&mark);
+  SG_UNWIND_PROTECT {
+    status = Sg_Apply4(nginx_dispatch_callback, callback, result, req,
+		       SG_NGINX_REQUEST(req)->response);
+  } SG_WHEN_ERROR {
+    ngx_log_error(NGX_LOG_ERR, c->log, 0,
+		  "'sagittarius': Failed to execute callback");
+    status = SG_FALSE;
+  } SG_END_PROTECT;
+  timing_end(r, &mark);
+  vm->loadPath = saved_loadpath;
+
+  rc = finish_response(r, req, status);
+  if (rc != NGX_DONE) {
+    ngx_http_finalize_request(r, rc);
+  }
+  ngx_http_run_posted_requests(c);
+}
+
+static void socket_done_handler(ngx_event_t *ev)
+{
+  SgNginxSocket *s = ev->data;
+  SgObject callback = s->callback, result = s->result;
+
+  s->op = SOCKET_IDLE;
+  s->callback = s->buffer = s->result = SG_FALSE;
+  run_request_callback(s->request, callback, result);
+}
+
+static void socket_close(SgNginxSocket *s)
+{
+  if (s->done_event.posted) ngx_delete_posted_event(&s->done_event);
+  if (s->op != SOCKET_IDLE) {
+    /* the callback won't be called */
+    SG_NGINX_REQUEST(s->request)->pending--;
+    s->op = SOCKET_IDLE;
+    s->callback = s->buffer = s->result = SG_FALSE;
+  }
+  if (s->peer.connection) {
+    ngx_close_connection(s->peer.connection);
+    s->peer.connection = NULL;
+  }
+}
+
+/* the socket lives as long as the request */
+static void socket_cleanup(void *data)
+{
+  socket_close(SG_NGINX_SOCKET(data));
+  unpin_object(data);
+}
+
+/* the event loop is not on the thread pool */
+static void check_event_loop(SgObject who, SgObject req)
+{
+  ngx_http_request_t *r = SG_NGINX_REQUEST(req)->rawNginxRequest;
+  ngx_http_sagittarius_conf_t *sg_conf;
+
+  sg_conf = ngx_http_get_module_loc_conf(r, ngx_http_sagittarius_module);
+  if (sg_conf->pool_name.len != 0 ||
+      SG_FALSEP(SG_NGINX_REQUEST(req)->response)) {
+    Sg_AssertionViolation(who,
+			  SG_MAKE_STRING("only available on the handler "
+					 "without thread pool"),
+			  SG_LIST1(req));
+  }
+  if (SG_NGINX_REQUEST(req)->finished) {
+    Sg_AssertionViolation(who, SG_MAKE_STRING("response is already sent"),
+			  SG_LIST1(req));
+  }
+}
+
+static void socket_start(SgObject who, SgNginxSocket *s, socket_op_t op,
+			 SgObject callback)
+{
+  if (!SG_PROCEDUREP(callback)) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("procedure"),
+				    callback, SG_NIL);
+  }
+  if (SG_NGINX_REQUEST(s->request)->finished) {
+    Sg_AssertionViolation(who, SG_MAKE_STRING("response is already sent"),
+			  SG_LIST1(SG_OBJ(s)));
+  }
+  if (s->op != SOCKET_IDLE) {
+    Sg_AssertionViolation(who, SG_MAKE_STRING("operation is in progress"),
+			  SG_LIST1(SG_OBJ(s)));
+  }
+  if (op != SOCKET_CONNECT && s->peer.connection == NULL) {
+    Sg_AssertionViolation(who, SG_MAKE_STRING("socket is closed"),
+			  SG_LIST1(SG_OBJ(s)));
+  }
+  s->op = op;
+  s->callback = callback;
+  SG_NGINX_REQUEST(s->request)->pending++;
+}
+
+static void socket_keepalive_close(socket_keepalive_t *k)
+{
+  ngx_queue_remove(&k->queue);
+  k->pool->nidle--;
+  ngx_queue_insert_head(&k->pool->free, &k->queue);
+  ngx_close_connection(k->connection);
+  k->connection = NULL;
+}
+
+/* an idle connection must not receive anything, so close on any event */
+static void socket_keepalive_handler(ngx_event_t *ev)
+{
+  ngx_connection_t *c = ev->data;
+  socket_keepalive_t *k = c->data;
+  char buf[1];
+  ssize_t n;
+
+  if (ev->write) return;
+  if (!ev->timedout && !c->close) {
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+      if (ngx_handle_read_event(c->read, 0) == NGX_OK) return;
+    }
+  }
+  socket_keepalive_close(k);
+}
+
+static socket_pool_t *find_socket_pool(ngx_http_request_t *r, SgObject name,
+				       SgObject address)
+{
+  char *n = Sg_Utf32sToUtf8s(SG_STRING(name));
+  char *a = Sg_Utf32sToUtf8s(SG_STRING(address));
+  size_t nlen = ngx_strlen(n), len = nlen + 1 + ngx_strlen(a);
+  socket_pool_t *p;
+  ngx_queue_t *q;
+
+  for (q = ngx_queue_head(&socket_pools);
+       q != ngx_queue_sentinel(&socket_pools);
+       q = ngx_queue_next(q)) {
+    p = ngx_queue_data(q, socket_pool_t, queue);
+    if (p->key.len == len && ngx_strcmp(p->key.data, n) == 0 &&
+	ngx_strcmp(p->key.data + nlen + 1, a) == 0) {
+      return p;
+    }
+  }
+  /* lives as long as the worker */
+  p = ngx_pcalloc(ngx_cycle->pool, sizeof(socket_pool_t) + len + 1);
+  if (p == NULL) return NULL;
+  p->key.len = len;
+  p->key.data = (u_char *)(p + 1);
+  ngx_memcpy(p->key.data, n, nlen + 1);
+  ngx_memcpy(p->key.data + nlen + 1, a, len - nlen);
+  ngx_queue_init(&p->idle);
+  ngx_queue_init(&p->free);
+  ngx_queue_insert_tail(&socket_pools, &p->queue);
+  ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0,
+		"'sagittarius': Socket pool '%s' for %s is created", n, a);
+  return p;
+}
+
+static void socket_attach(SgNginxSocket *s, ngx_http_request_t *r)
+{
+  ngx_connection_t *c = s->peer.connection;
+  c->data = s;
+  c->read->handler = socket_event_handler;
+  c->write->handler = socket_event_handler;
+  c->log = r->connection->log;
+  c->read->log = c->log;
+  c->write->log = c->log;
+  c->idle = 0;
+}
+
+/* (%nginx-socket-connect request address timeout pool max-idle
+                          idle-timeout max-requests callback) */
+static SgObject nginx_socket_connect(SgObject *argv, int argc, void *data)
+{
+  SgObject who = SG_INTERN("nginx-socket-connect");
+  SgNginxSocket *s;
+  ngx_http_request_t *r;
+  ngx_pool_cleanup_t *cln;
+  socket_pool_t *pool = NULL;
+  ngx_url_t u;
+  ngx_int_t rc;
+  char *address;
+  int i;
+
+  if (argc != 8) {
+    Sg_WrongNumberOfArgumentsViolation(who, 8, argc, SG_NIL);
+  }
+  if (!SG_NGINX_REQUESTP(argv[0])) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("nginx-request"),
+				    argv[0], SG_NIL);
+  }
+  if (!SG_STRINGP(argv[1])) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("string"), argv[1], SG_NIL);
+  }
+  if (!SG_INTP(argv[2]) || SG_INT_VALUE(argv[2]) <= 0) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("positive fixnum"),
+				    argv[2], SG_NIL);
+  }
+  if (!SG_FALSEP(argv[3]) && !SG_STRINGP(argv[3])) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("string"), argv[3], SG_NIL);
+  }
+  for (i = 4; i < 7; i++) {
+    if (!SG_INTP(argv[i]) || SG_INT_VALUE(argv[i]) < 0) {
+      Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("non negative fixnum"),
+				      argv[i], SG_NIL);
+    }
+  }
+  r = SG_NGINX_REQUEST(argv[0])->rawNginxRequest;
+  check_event_loop(who, argv[0]);
+  if (SG_STRINGP(argv[3])) {
+    pool = find_socket_pool(r, argv[3], argv[1]);
+    if (pool == NULL) goto err;
+    /* the last one wins */
+    pool->max_idle = SG_INT_VALUE(argv[4]);
+    pool->idle_timeout = SG_INT_VALUE(argv[5]);
+    pool->max_requests = SG_INT_VALUE(argv[6]);
+  }
+
+  s = SG_NEW(SgNginxSocket);
+  SG_SET_CLASS(s, SG_CLASS_NGINX_SOCKET);
+  s->request = argv[0];
+  s->address = argv[1];
+  s->callback = s->buffer = s->result = SG_FALSE;
+  s->done = 0;
+  s->op = SOCKET_IDLE;
+  s->timeout = (ngx_msec_t)SG_INT_VALUE(argv[2]);
+  s->pool = pool;
+  s->requests = 0;
+  s->peer.log = r->connection->log;
+  s->peer.log_error = NGX_ERROR_ERR;
+  s->done_event.handler = socket_done_handler;
+  s->done_event.data = s;
+  s->done_event.log = r->connection->log;
+
+  cln = ngx_pool_cleanup_add(r->pool, 0);
+  if (cln == NULL) goto err;
+  pin_object(r, SG_OBJ(s));
+  cln->handler = socket_cleanup;
+  cln->data = s;
+
+  if (pool && !ngx_queue_empty(&pool->idle)) {
+    ngx_queue_t *q = ngx_queue_head(&pool->idle);
+    socket_keepalive_t *k = ngx_queue_data(q, socket_keepalive_t, queue);
+    ngx_queue_remove(q);
+    pool->nidle--;
+    ngx_queue_insert_head(&pool->free, q);
+    ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0,
+		  "'sagittarius': Reusing connection %d", k->connection->fd);
+    if (k->connection->read->timer_set) ngx_del_timer(k->connection->read);
+    s->peer.connection = k->connection;
+    s->requests = k->requests;
+    k->connection = NULL;
+    socket_attach(s, r);
+    socket_start(who, s, SOCKET_CONNECT, argv[7]);
+    socket_done(s, SG_OBJ(s));
+    return SG_OBJ(s);
+  }
+
+  address = Sg_Utf32sToUtf8s(SG_STRING(argv[1]));
+  ngx_memzero(&u, sizeof(ngx_url_t));
+  u.url.len = ngx_strlen(address);
+  u.url.data = ngx_pnalloc(r->pool, u.url.len);
+  if (u.url.data == NULL) goto err;
+  ngx_memcpy(u.url.data, address, u.url.len);
+  /* NOTE: host names are resolved synchronously */
+  if (ngx_parse_url(r->pool, &u) != NGX_OK || u.no_port || u.naddrs == 0) {
+    Sg_AssertionViolation(who, SG_MAKE_STRING("invalid address"),
+			  SG_LIST1(argv[1]));
+  }
+  s->peer.sockaddr = u.addrs[0].sockaddr;
+  s->peer.socklen = u.addrs[0].socklen;
+  s->peer.name = &u.addrs[0].name;
+  s->peer.get = ngx_event_get_peer;
+  s->peer.tries = 1;
+
+  socket_start(who, s, SOCKET_CONNECT, argv[7]);
+  rc = ngx_event_connect_peer(&s->peer);
+  if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+    socket_error(s, "Failed to connect", ngx_socket_errno);
+    return SG_OBJ(s);
+  }
+  socket_attach(s, r);
+  if (rc == NGX_AGAIN) {
+    ngx_add_timer(s->peer.connection->write, s->timeout);
+  } else {
+    socket_done(s, SG_OBJ(s));
+  }
+  return SG_OBJ(s);
+
+ err:
+  raise_nginx_error(who, SG_MAKE_STRING("Failed to allocate socket"),
+		    Sg_MakeNginxError(NGX_HTTP_INTERNAL_SERVER_ERROR),
+		    SG_LIST1(argv[1]));
+  return SG_UNDEF;		/* dummy */
+}
+static SG_DEFINE_SUBR(nginx_socket_connect_stub, 8, 0,
+		      nginx_socket_connect, SG_FALSE, NULL);
+
+static SgObject nginx_socket_send(SgObject *argv, int argc, void *data)
+{
+  SgObject who = SG_INTERN("nginx-socket-send");
+  SgNginxSocket *s;
+  if (argc != 3) {
+    Sg_WrongNumberOfArgumentsViolation(who, 3, argc, SG_NIL);
+  }
+  if (!SG_NGINX_SOCKETP(argv[0])) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("nginx-socket"),
+				    argv[0], SG_NIL);
+  }
+  if (!SG_BVECTORP(argv[1])) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("bytevector"),
+				    argv[1], SG_NIL);
+  }
+  s = SG_NGINX_SOCKET(argv[0]);
+  socket_start(who, s, SOCKET_SEND, argv[2]);
+  s->buffer = argv[1];
+  s->done = 0;
+  socket_send(s);
+  return SG_UNDEF;
+}
+static SG_DEFINE_SUBR(nginx_socket_send_stub, 3, 0,
+		      nginx_socket_send, SG_FALSE, NULL);
+
+static SgObject nginx_socket_receive(SgObject *argv, int argc, void *data)
+{
+  SgObject who = SG_INTERN("nginx-socket-receive");
+  SgNginxSocket *s;
+  if (argc != 3) {
+    Sg_WrongNumberOfArgumentsViolation(who, 3, argc, SG_NIL);
+  }
+  if (!SG_NGINX_SOCKETP(argv[0])) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("nginx-socket"),
+				    argv[0], SG_NIL);
+  }
+  if (!SG_INTP(argv[1]) || SG_INT_VALUE(argv[1]) <= 0) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("positive fixnum"),
+				    argv[1], SG_NIL);
+  }
+  s = SG_NGINX_SOCKET(argv[0]);
+  socket_start(who, s, SOCKET_RECEIVE, argv[2]);
+  s->buffer = Sg_MakeByteVector(SG_INT_VALUE(argv[1]), 0);
+  socket_receive(s);
+  return SG_UNDEF;
+}
+static SG_DEFINE_SUBR(nginx_socket_receive_stub, 3, 0,
+		      nginx_socket_receive, SG_FALSE, NULL);
+
+static SgObject nginx_socket_close(SgObject *argv, int argc, void *data)
+{
+  if (argc != 1) {
+    Sg_WrongNumberOfArgumentsViolation(SG_INTERN("nginx-socket-close"),
+				       1, argc, SG_NIL);
+  }
+  if (!SG_NGINX_SOCKETP(argv[0])) {
+    Sg_WrongTypeOfArgumentViolation(SG_INTERN("nginx-socket-close"),
+				    SG_INTERN("nginx-socket"),
+				    argv[0], SG_NIL);
+  }
+  socket_close(SG_NGINX_SOCKET(argv[0]));
+  return SG_UNDEF;
+}
+static SG_DEFINE_SUBR(nginx_socket_close_stub, 1, 0,
+		      nginx_socket_close, SG_FALSE, NULL);
+
+/* returns the connection to the pool, or closes it if it can't be */
+static SgObject nginx_socket_release(SgObject *argv, int argc, void *data)
+{
+  SgObject who = SG_INTERN("nginx-socket-release");
+  SgNginxSocket *s;
+  ngx_connection_t *c;
+  socket_keepalive_t *k;
+  socket_pool_t *p;
+
+  if (argc != 1) {
+    Sg_WrongNumberOfArgumentsViolation(who, 1, argc, SG_NIL);
+  }
+  if (!SG_NGINX_SOCKETP(argv[0])) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("nginx-socket"),
+				    argv[0], SG_NIL);
+  }
+  s = SG_NGINX_SOCKET(argv[0]);
+  if (s->op != SOCKET_IDLE) {
+    Sg_AssertionViolation(who, SG_MAKE_STRING("operation is in progress"),
+			  SG_LIST1(argv[0]));
+  }
+  c = s->peer.connection;
+  p = s->pool;
+  if (c == NULL) return SG_UNDEF;
+
+  s->requests++;
+  if (p == NULL || p->max_idle == 0 || c->error || c->read->eof ||
+      c->read->timedout || c->write->timedout ||
+      (p->max_requests > 0 && s->requests >= p->max_requests) ||
+      ngx_terminate || ngx_exiting) {
+    socket_close(s);
+    return SG_UNDEF;
+  }
+  if (p->nidle >= p->max_idle) {
+    socket_keepalive_close(ngx_queue_data(ngx_queue_last(&p->idle),
+					  socket_keepalive_t, queue));
+  }
+  if (ngx_queue_empty(&p->free)) {
+    k = ngx_pcalloc(ngx_cycle->pool, sizeof(socket_keepalive_t));
+    if (k == NULL) {
+      socket_close(s);
+      return SG_UNDEF;
+    }
+    k->pool = p;
+  } else {
+    ngx_queue_t *q = ngx_queue_head(&p->free);
+    ngx_queue_remove(q);
+    k = ngx_queue_data(q, socket_keepalive_t, queue);
+  }
+  k->connection = c;
+  k->requests = s->requests;
+  ngx_queue_insert_head(&p->idle, &k->queue);
+  p->nidle++;
+  s->peer.connection = NULL;
+
+  /* the request's log will be gone */
+  c->data = k;
+  c->read->handler = socket_keepalive_handler;
+  c->write->handler = socket_keepalive_handler;
+  c->log = ngx_cycle->log;
+  c->read->log = c->log;
+  c->write->log = c->log;
+  c->idle = 1;
+  if (c->write->timer_set) ngx_del_timer(c->write);
+  if (c->read->timer_set) ngx_del_timer(c->read);
+  if (p->idle_timeout > 0) ngx_add_timer(c->read, p->idle_timeout);
+  if (c->read->ready) {
+    socket_keepalive_handler(c->read);
+  } else if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+    socket_keepalive_close(k);
+  }
+  return SG_UNDEF;
+}
+static SG_DEFINE_SUBR(nginx_socket_release_stub, 1, 0,
+		      nginx_socket_release, SG_FALSE, NULL);
+
+static SgObject nginx_socket_p(SgObject *argv, int argc, void *data)
+{
+  if (argc != 1) {
+    Sg_WrongNumberOfArgumentsViolation(SG_INTERN("nginx-socket?"), 1,
+				       argc, SG_NIL);
+  }
+  return SG_MAKE_BOOL(SG_NGINX_SOCKETP(argv[0]));
+}
+static SG_DEFINE_SUBR(nginx_socket_p_stub, 1, 0, nginx_socket_p,
+		      SG_FALSE, NULL);
+/* 
+   Subrequests.
+   The response of a subrequest is kept in memory. Waiting subrequests
+   is a pending operation the same as the sockets, so the callback is
+   called when all of them are finished.
+ */
+typedef struct
+{
+  SgObject request;
+  SgObject callback;
+  SgObject subrequests;
+  ngx_uint_t remaining;
+  ngx_event_t done_event;
+} subrequest_waiter_t;
+
+typedef struct
+{
+  SG_HEADER;
+  SgObject request;		/* parent nginx-request */
+  SgObject uri;
+  SgObject status;		/* #f until it's done */
+  SgObject body;
+  subrequest_waiter_t *waiter;
+} SgNginxSubrequest;
+SG_CLASS_DECL(Sg_NginxSubrequestClass);
+#define SG_CLASS_NGINX_SUBREQUEST (&Sg_NginxSubrequestClass)
+#define SG_NGINX_SUBREQUEST(obj)  ((SgNginxSubrequest *)obj)
+#define SG_NGINX_SUBREQUESTP(obj) SG_XTYPEP(obj, SG_CLASS_NGINX_SUBREQUEST)
+
+static void nginx_subrequest_printer(SgObject self, SgPort *port,
+				     SgWriteContext *ctx)
+{
+  Sg_Printf(port, UC("#<nginx-subrequest %A %A>"),
+	    SG_NGINX_SUBREQUEST(self)->uri, SG_NGINX_SUBREQUEST(self)->status);
+}
+SG_DEFINE_BUILTIN_CLASS_SIMPLE(Sg_NginxSubrequestClass,
+			       nginx_subrequest_printer);
+
+static SgObject nsr_uri(SgNginxSubrequest *s)    { return s->uri; }
+static SgObject nsr_status(SgNginxSubrequest *s) { return s->status; }
+static SgObject nsr_body(SgNginxSubrequest *s)   { return s->body; }
+
+SG_DEFINE_GETTER("nginx-subrequest-uri", "nginx-subrequest",
+		 SG_NGINX_SUBREQUESTP, nsr_uri, SG_NGINX_SUBREQUEST,
+		 nginx_subrequest_uri);
+SG_DEFINE_GETTER("nginx-subrequest-status", "nginx-subrequest",
+		 SG_NGINX_SUBREQUESTP, nsr_status, SG_NGINX_SUBREQUEST,
+		 nginx_subrequest_status);
+SG_DEFINE_GETTER("nginx-subrequest-body", "nginx-subrequest",
+		 SG_NGINX_SUBREQUESTP, nsr_body, SG_NGINX_SUBREQUEST,
+		 nginx_subrequest_body);
+
+static SgObject nginx_subrequest_p(SgObject *argv, int argc, void *data)
+{
+  if (argc != 1) {
+    Sg_WrongNumberOfArgumentsViolation(SG_INTERN("nginx-subrequest?"), 1,
+				       argc, SG_NIL);
+  }
+  return SG_MAKE_BOOL(SG_NGINX_SUBREQUESTP(argv[0]));
+}
+static SG_DEFINE_SUBR(nginx_subrequest_p_stub, 1, 0, nginx_subrequest_p,
+		      SG_FALSE, NULL);
+
+static void subrequest_waiter_handler(ngx_event_t *ev)
+{
+  subrequest_waiter_t *w = ev->data;
+  run_request_callback(w->request, w->callback, w->subrequests);
+}
+
+/* the request may be terminated while the waiter is posted */
+static void subrequest_waiter_cleanup(void *data)
+{
+  subrequest_waiter_t *w = data;
+  if (w->done_event.posted) ngx_delete_posted_event(&w->done_event);
+}
+
+/* 
+   NGINX may call this more than once, the first one is the result.
+   NGX_ERROR, e.g. a response larger than subrequest_output_buffer_size,
+   is reported as 500 so that it doesn't terminate the parent request.
+ */
+static ngx_int_t subrequest_done(ngx_http_request_t *sr, void *data,
+				 ngx_int_t rc)
+{
+  SgNginxSubrequest *s = data;
+  ngx_int_t status = sr->headers_out.status;
+
+  if (!SG_FALSEP(s->status)) return rc == NGX_ERROR ? NGX_OK : rc;
+
+  if (rc == NGX_ERROR) {
+    status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+  } else if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+    status = rc;
+  } else if (status == 0) {
+    status = NGX_HTTP_OK;
+  }
+  s->status = SG_MAKE_INT(status);
+  if (rc != NGX_ERROR &&
+      sr->out && sr->out->buf && ngx_buf_in_memory(sr->out->buf)) {
+    ngx_buf_t *b = sr->out->buf;
+    s->body = Sg_MakeByteVectorFromU8Array(b->pos, b->last - b->pos);
+  } else {
+    s->body = Sg_MakeByteVector(0, 0);
+  }
+  if (s->waiter && --s->waiter->remaining == 0) {
+    ngx_post_event(&s->waiter->done_event, &ngx_posted_events);
+  }
+  return rc == NGX_ERROR ? NGX_OK : rc;
+}
+
+/* (%nginx-subrequest request uri args) */
+static SgObject nginx_subrequest(SgObject *argv, int argc, void *data)
+{
+  SgObject who = SG_INTERN("nginx-subrequest");
+  SgNginxSubrequest *s;
+  ngx_http_request_t *r, *sr;
+  ngx_http_post_subrequest_t *ps;
+  ngx_str_t uri, args, *argsp = NULL;
+  char *p;
+
+  if (argc != 3) {
+    Sg_WrongNumberOfArgumentsViolation(who, 3, argc, SG_NIL);
+  }
+  if (!SG_NGINX_REQUESTP(argv[0])) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("nginx-request"),
+				    argv[0], SG_NIL);
+  }
+  if (!SG_STRINGP(argv[1])) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("string"), argv[1], SG_NIL);
+  }
+  if (!SG_FALSEP(argv[2]) && !SG_STRINGP(argv[2])) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("string"), argv[2], SG_NIL);
+  }
+  check_event_loop(who, argv[0]);
+  r = SG_NGINX_REQUEST(argv[0])->rawNginxRequest;
+
+  p = Sg_Utf32sToUtf8s(SG_STRING(argv[1]));
+  uri.len = ngx_strlen(p);
+  uri.data = ngx_pnalloc(r->pool, uri.len);
+  if (uri.data == NULL) goto err;
+  ngx_memcpy(uri.data, p, uri.len);
+  if (SG_STRINGP(argv[2])) {
+    p = Sg_Utf32sToUtf8s(SG_STRING(argv[2]));
+    args.len = ngx_strlen(p);
+    args.data = ngx_pnalloc(r->pool, args.len);
+    if (args.data == NULL) goto err;
+    ngx_memcpy(args.data, p, args.len);
+    argsp = &args;
+  }
+
+  s = SG_NEW(SgNginxSubrequest);
+  SG_SET_CLASS(s, SG_CLASS_NGINX_SUBREQUEST);
+  s->request = argv[0];
+  s->uri = argv[1];
+  s->status = SG_FALSE;
+  s->body = SG_FALSE;
+  s->waiter = NULL;
+
+  ps = ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t));
+  if (ps == NULL) goto err;
+  ps->handler = subrequest_done;
+  ps->data = s;
+  pin_value(who, r, argv[0], SG_OBJ(s));
+
+  if (ngx_http_subrequest(r, &uri, argsp, &sr, ps,
+			  NGX_HTTP_SUBREQUEST_IN_MEMORY
+			  | NGX_HTTP_SUBREQUEST_WAITED) != NGX_OK) {
+    raise_nginx_error(who, SG_MAKE_STRING("Failed to create subrequest"),
+		      Sg_MakeNginxError(NGX_HTTP_INTERNAL_SERVER_ERROR),
+		      SG_LIST1(argv[1]));
+  }
+  return SG_OBJ(s);
+
+ err:
+  raise_nginx_error(who, SG_MAKE_STRING("Failed to allocate subrequest"),
+		    Sg_MakeNginxError(NGX_HTTP_INTERNAL_SERVER_ERROR),
+		    SG_LIST1(argv[1]));
+  return SG_UNDEF;		/* dummy */
+}
+static SG_DEFINE_SUBR(nginx_subrequest_stub, 3, 0, nginx_subrequest,
+		      SG_FALSE, NULL);
+
+/* (nginx-subrequests-wait request subrequests callback) */
+static SgObject nginx_subrequests_wait(SgObject *argv, int argc, void *data)
+{
+  SgObject who = SG_INTERN("nginx-subrequests-wait");
+  subrequest_waiter_t *w;
+  ngx_http_request_t *r;
+  ngx_pool_cleanup_t *cln;
+  SgObject cp;
+
+  if (argc != 3) {
+    Sg_WrongNumberOfArgumentsViolation(who, 3, argc, SG_NIL);
+  }
+  if (!SG_NGINX_REQUESTP(argv[0])) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("nginx-request"),
+				    argv[0], SG_NIL);
+  }
+  if (!SG_LISTP(argv[1])) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("list"), argv[1], SG_NIL);
+  }
+  if (!SG_PROCEDUREP(argv[2])) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("procedure"),
+				    argv[2], SG_NIL);
+  }
+  check_event_loop(who, argv[0]);
+  SG_FOR_EACH(cp, argv[1]) {
+    SgObject o = SG_CAR(cp);
+    if (!SG_NGINX_SUBREQUESTP(o) ||
+	SG_NGINX_SUBREQUEST(o)->request != argv[0]) {
+      Sg_WrongTypeOfArgumentViolation(who,
+				      SG_INTERN("nginx-subrequest"
+						" of the request"),
+				      o, SG_LIST1(argv[1]));
+    }
+    if (SG_NGINX_SUBREQUEST(o)->waiter) {
+      Sg_AssertionViolation(who, SG_MAKE_STRING("already waited"),
+			    SG_LIST1(o));
+    }
+  }
+  r = SG_NGINX_REQUEST(argv[0])->rawNginxRequest;
+
+  w = SG_NEW(subrequest_waiter_t);
+  w->request = argv[0];
+  w->callback = argv[2];
+  w->subrequests = argv[1];
+  w->remaining = 0;
+  w->done_event.handler = subrequest_waiter_handler;
+  w->done_event.data = w;
+  w->done_event.log = r->connection->log;
+  pin_value(who, r, argv[0], SG_OBJ(w));
+  /* runs before the waiter is unpinned */
+  cln = ngx_pool_cleanup_add(r->pool, 0);
+  if (cln == NULL) {
+    raise_nginx_error(who, SG_MAKE_STRING("Failed to allocate cleanup"),
+		      Sg_MakeNginxError(NGX_HTTP_INTERNAL_SERVER_ERROR),
+		      SG_NIL);
+  }
+  cln->handler = subrequest_waiter_cleanup;
+  cln->data = w;
+
+  SG_FOR_EACH(cp, argv[1]) {
+    SgNginxSubrequest *s = SG_NGINX_SUBREQUEST(SG_CAR(cp));
+    s->waiter = w;
+    if (SG_FALSEP(s->status)) w->remaining++;
+  }
+  SG_NGINX_REQUEST(argv[0])->pending++;
+  if (w->remaining == 0) {
+    ngx_post_event(&w->done_event, &ngx_posted_events);
+  }
+  return SG_UNDEF;
+}
+static SG_DEFINE_SUBR(nginx_subrequests_wait_stub, 3, 0,
+		      nginx_subrequests_wait, SG_FALSE, NULL);
+
+/* 
+   Shared dictionary.
+   The entries are in a shared memory zone of `sagittarius_shared_dict`
+   so all the workers see the same values. The entries are kept in a
+   rbtree keyed by the CRC32 of the key, and in a LRU queue which is
+   used to evict the entries when the zone is full. The expiration is
+   in wall clock milliseconds as the workers don't share the monotonic
+   clock.
+ */
+typedef enum {
+  DICT_BYTEVECTOR,
+  DICT_STRING,
+  DICT_INTEGER
+} shared_dict_type_t;
+
+/* overlaps ngx_rbtree_node_t from its color */
+typedef struct
+{
+  u_char color;
+  u_char type;
+  u_short key_len;
+  uint32_t value_len;
+  ngx_queue_t queue;
+  uint64_t expires;		/* 0 = never */
+  u_char data[1];		/* key then value */
+} shared_dict_node_t;
+
+typedef struct
+{
+  ngx_rbtree_t rbtree;
+  ngx_rbtree_node_t sentinel;
+  ngx_queue_t lru;
+} shared_dict_shctx_t;
+
+typedef struct
+{
+  ngx_str_t name;
+  shared_dict_shctx_t *sh;
+  ngx_slab_pool_t *shpool;
+} shared_dict_t;
+
+static ngx_array_t *shared_dicts; /* array of shared_dict_t *, per cycle */
+static ngx_array_t *executors;	  /* array of executor_t *, per cycle */
+
+#define DICT_NODE(n)							\
+  ((shared_dict_node_t *)&((ngx_rbtree_node_t *)(n))->color)
+#define DICT_RBNODE(d)							\
+  ((ngx_rbtree_node_t *)((u_char *)(d) - offsetof(ngx_rbtree_node_t, color)))
+#define DICT_MAX_EVICTION 30
+
+static uint64_t dict_now(void)
+{
+  ngx_time_t *tp = ngx_timeofday();
+  return (uint64_t)tp->sec * 1000 + tp->msec;
+}
+
+static void shared_dict_insert_value(ngx_rbtree_node_t *temp,
+				     ngx_rbtree_node_t *node,
+				     ngx_rbtree_node_t *sentinel)
+{
+  ngx_rbtree_node_t **p;
+  shared_dict_node_t *dn, *dt;
+
+  for (;;) {
+    if (node->key != temp->key) {
+      p = (node->key < temp->key) ? &temp->left : &temp->right;
+    } else {
+      dn = DICT_NODE(node);
+      dt = DICT_NODE(temp);
+      p = (ngx_memn2cmp(dn->data, dt->data, dn->key_len, dt->key_len) < 0)
+	? &temp->left : &temp->right;
+    }
+    if (*p == sentinel) break;
+    temp = *p;
+  }
+  *p = node;
+  node->parent = temp;
+  node->left = sentinel;
+  node->right = sentinel;
+  ngx_rbt_red(node);
+}
+
+static ngx_int_t shared_dict_init_zone(ngx_shm_zone_t *zone, void *data)
+{
+  shared_dict_t *octx = data, *ctx = zone->data;
+  size_t len;
+
+  if (octx) {
+    /* reloaded, the entries are kept */
+    ctx->sh = octx->sh;
+    ctx->shpool = octx->shpool;
+    return NGX_OK;
+  }
+  ctx->shpool = (ngx_slab_pool_t *)zone->shm.addr;
+  if (zone->shm.exists) {
+    ctx->sh = ctx->shpool->data;
+    return NGX_OK;
+  }
+  ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(shared_dict_shctx_t));
+  if (ctx->sh == NULL) return NGX_ERROR;
+  ctx->shpool->data = ctx->sh;
+  ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
+		  shared_dict_insert_value);
+  ngx_queue_init(&ctx->sh->lru);
+
+  len = sizeof(" in sagittarius_shared_dict \"\"") + ctx->name.len;
+  ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+  if (ctx->shpool->log_ctx == NULL) return NGX_ERROR;
+  ngx_sprintf(ctx->shpool->log_ctx, " in sagittarius_shared_dict \"%V\"%Z",
+	      &ctx->name);
+  /* it's full when the eviction is needed, not an error */
+  ctx->shpool->log_nomem = 0;
+  return NGX_OK;
+}
+
+static void shared_dict_delete_node(shared_dict_t *dict, shared_dict_node_t *d)
+{
+  ngx_queue_remove(&d->queue);
+  ngx_rbtree_delete(&dict->sh->rbtree, DICT_RBNODE(d));
+  ngx_slab_free_locked(dict->shpool, DICT_RBNODE(d));
+}
+
+/* returns the live entry, the expired one is removed */
+static shared_dict_node_t *shared_dict_lookup(shared_dict_t *dict,
+					      u_char *key, size_t len,
+					      uint32_t hash)
+{
+  ngx_rbtree_node_t *node = dict->sh->rbtree.root;
+  ngx_rbtree_node_t *sentinel = dict->sh->rbtree.sentinel;
+  shared_dict_node_t *d;
+  ngx_int_t rc;
+
+  while (node != sentinel) {
+    if (hash != node->key) {
+      node = (hash < node->key) ? node->left : node->right;
+      continue;
+    }
+    d = DICT_NODE(node);
+    rc = ngx_memn2cmp(key, d->data, len, d->key_len);
+    if (rc == 0) {
+      if (d->expires != 0 && d->expires <= dict_now()) {
+	shared_dict_delete_node(dict, d);
+	return NULL;
+      }
+      return d;
+    }
+    node = (rc < 0) ? node->left : node->right;
+  }
+  return NULL;
+}
+
+/* allocates a new entry, evicting the least recently used ones if needed */
+static shared_dict_node_t *shared_dict_alloc(shared_dict_t *dict,
+					     size_t key_len, size_t value_len)
+{
+  size_t n = offsetof(ngx_rbtree_node_t, color)
+    + offsetof(shared_dict_node_t, data) + key_len + value_len;
+  ngx_rbtree_node_t *node;
+  int i;
+
+  node = ngx_slab_alloc_locked(dict->shpool, n);
+  for (i = 0; node == NULL && i < DICT_MAX_EVICTION; i++) {
+    if (ngx_queue_empty(&dict->sh->lru)) break;
+    shared_dict_delete_node(dict,
+			    ngx_queue_data(ngx_queue_last(&dict->sh->lru),
+					   shared_dict_node_t, queue));
+    node = ngx_slab_alloc_locked(dict->shpool, n);
+  }
+  return node ? DICT_NODE(node) : NULL;
+}
+
+typedef struct
+{
+  u_char *key;
+  size_t key_len;
+  uint32_t hash;
+  shared_dict_type_t type;
+  u_char *value;
+  size_t value_len;
+  int64_t integer;		/* value of DICT_INTEGER */
+} dict_args_t;
+
+typedef struct
+{
+  SG_HEADER;
+  shared_dict_t *dict;
+} SgNginxSharedDict;
+SG_CLASS_DECL(Sg_NginxSharedDictClass);
+#define SG_CLASS_NGINX_SHARED_DICT (&Sg_NginxSharedDictClass)
+#define SG_NGINX_SHARED_DICT(obj)  ((SgNginxSharedDict *)obj)
+#define SG_NGINX_SHARED_DICTP(obj) SG_XTYPEP(obj, SG_CLASS_NGINX_SHARED_DICT)
+
+static void nginx_shared_dict_printer(SgObject self, SgPort *port,
+				      SgWriteContext *ctx)
+{
+  Sg_Printf(port, UC("#<nginx-shared-dict %A>"),
+	    ngx_str_to_string(&SG_NGINX_SHARED_DICT(self)->dict->name));
+}
+SG_DEFINE_BUILTIN_CLASS_SIMPLE(Sg_NginxSharedDictClass,
+			       nginx_shared_dict_printer);
+
+/* converts the arguments before locking, so no error under the lock */
+static shared_dict_t *dict_arguments(SgObject who, SgObject *argv,
+				     SgObject value, dict_args_t *args)
+{
+  char *key;
+  if (!SG_NGINX_SHARED_DICTP(argv[0])) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("nginx-shared-dict"),
+				    argv[0], SG_NIL);
+  }
+  if (!SG_STRINGP(argv[1])) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("string"), argv[1], SG_NIL);
+  }
+  key = Sg_Utf32sToUtf8s(SG_STRING(argv[1]));
+  args->key = (u_char *)key;
+  args->key_len = ngx_strlen(key);
+  if (args->key_len == 0 || args->key_len > 0xffff) {
+    Sg_AssertionViolation(who, SG_MAKE_STRING("invalid key length"),
+			  SG_LIST1(argv[1]));
+  }
+  args->hash = ngx_crc32_short(args->key, args->key_len);
+
+  if (value == NULL) {
+    /* no value */
+  } else if (SG_BVECTORP(value)) {
+    args->type = DICT_BYTEVECTOR;
+    args->value = SG_BVECTOR_ELEMENTS(value);
+    args->value_len = SG_BVECTOR_SIZE(value);
+  } else if (SG_STRINGP(value)) {
+    char *v = Sg_Utf32sToUtf8s(SG_STRING(value));
+    args->type = DICT_STRING;
+    args->value = (u_char *)v;
+    args->value_len = ngx_strlen(v);
+  } else if (SG_EXACT_INTP(value)) {
+    args->type = DICT_INTEGER;
+    args->integer = Sg_GetIntegerS64Clamp(value, SG_CLAMP_NONE, NULL);
+    args->value = (u_char *)&args->integer;
+    args->value_len = sizeof(int64_t);
+  } else {
+    Sg_WrongTypeOfArgumentViolation(who,
+				    SG_INTERN("bytevector, string or integer"),
+				    value, SG_NIL);
+  }
+  return SG_NGINX_SHARED_DICT(argv[0])->dict;
+}
+
+static uint64_t dict_ttl(SgObject who, SgObject ttl)
+{
+  if (!SG_INTP(ttl) || SG_INT_VALUE(ttl) < 0) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("non negative fixnum"),
+				    ttl, SG_NIL);
+  }
+  return SG_INT_VALUE(ttl) == 0 ? 0 : dict_now() + SG_INT_VALUE(ttl);
+}
+
+/* (nginx-shared-dict name) */
+static SgObject nginx_shared_dict(SgObject *argv, int argc, void *data)
+{
+  SgObject who = SG_INTERN("nginx-shared-dict");
+  shared_dict_t **dicts;
+  SgNginxSharedDict *d;
+  ngx_uint_t i;
+  char *name;
+  size_t len;
+
+  if (argc != 1) {
+    Sg_WrongNumberOfArgumentsViolation(who, 1, argc, SG_NIL);
+  }
+  if (!SG_STRINGP(argv[0])) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("string"), argv[0], SG_NIL);
+  }
+  if (shared_dicts == NULL) return SG_FALSE;
+  name = Sg_Utf32sToUtf8s(SG_STRING(argv[0]));
+  len = ngx_strlen(name);
+  dicts = shared_dicts->elts;
+  for (i = 0; i < shared_dicts->nelts; i++) {
+    if (dicts[i]->name.len == len &&
+	ngx_strncmp(dicts[i]->name.data, name, len) == 0) {
+      d = SG_NEW(SgNginxSharedDict);
+      SG_SET_CLASS(d, SG_CLASS_NGINX_SHARED_DICT);
+      d->dict = dicts[i];
+      return SG_OBJ(d);
+    }
+  }
+  return SG_FALSE;
+}
+static SG_DEFINE_SUBR(nginx_shared_dict_stub, 1, 0, nginx_shared_dict,
+		      SG_FALSE, NULL);
+
+static SgObject nginx_shared_dict_p(SgObject *argv, int argc, void *data)
+{
+  if (argc != 1) {
+    Sg_WrongNumberOfArgumentsViolation(SG_INTERN("nginx-shared-dict?"), 1,
+				       argc, SG_NIL);
+  }
+  return SG_MAKE_BOOL(SG_NGINX_SHARED_DICTP(argv[0]));
+}
+static SG_DEFINE_SUBR(nginx_shared_dict_p_stub, 1, 0, nginx_shared_dict_p,
+		      SG_FALSE, NULL);
+
+/* (%nginx-shared-dict-ref dict key default) */
+static SgObject nginx_shared_dict_ref(SgObject *argv, int argc, void *data)
+{
+  SgObject who = SG_INTERN("nginx-shared-dict-ref");
+  SgObject r;
+  shared_dict_node_t *d;
+  shared_dict_t *dict;
+  dict_args_t args;
+  int64_t integer;
+
+  if (argc != 3) {
+    Sg_WrongNumberOfArgumentsViolation(who, 3, argc, SG_NIL);
+  }
+  dict = dict_arguments(who, argv, NULL, &args);
+  r = argv[2];
+
+  ngx_shmtx_lock(&dict->shpool->mutex);
+  d = shared_dict_lookup(dict, args.key, args.key_len, args.hash);
+  if (d) {
+    u_char *v = d->data + d->key_len;
+    ngx_queue_remove(&d->queue);
+    ngx_queue_insert_head(&dict->sh->lru, &d->queue);
+    switch (d->type) {
+    case DICT_BYTEVECTOR:
+      r = Sg_MakeByteVectorFromU8Array(v, d->value_len);
+      break;
+    case DICT_STRING:
+      r = Sg_Utf8sToUtf32s((const char *)v, d->value_len);
+      break;
+    default:
+      ngx_memcpy(&integer, v, sizeof(int64_t));
+      r = Sg_MakeIntegerFromS64(integer);
+      break;
+    }
+  }
+  ngx_shmtx_unlock(&dict->shpool->mutex);
+  return r;
+}
+static SG_DEFINE_SUBR(nginx_shared_dict_ref_stub, 3, 0,
+		      nginx_shared_dict_ref, SG_FALSE, NULL);
+
+/* (%nginx-shared-dict-store! dict key value ttl add?) */
+static SgObject nginx_shared_dict_store(SgObject *argv, int argc, void *data)
+{
+  SgObject who = SG_INTERN("nginx-shared-dict-set!");
+  shared_dict_node_t *d;
+  shared_dict_t *dict;
+  dict_args_t args;
+  uint64_t expires;
+  int add;
+
+  if (argc != 5) {
+    Sg_WrongNumberOfArgumentsViolation(who, 5, argc, SG_NIL);
+  }
+  add = !SG_FALSEP(argv[4]);
+  if (add) who = SG_INTERN("nginx-shared-dict-add!");
+  dict = dict_arguments(who, argv, argv[2], &args);
+  expires = dict_ttl(who, argv[3]);
+
+  ngx_shmtx_lock(&dict->shpool->mutex);
+  d = shared_dict_lookup(dict, args.key, args.key_len, args.hash);
+  if (d && add) {
+    ngx_shmtx_unlock(&dict->shpool->mutex);
+    return SG_FALSE;
+  }
+  if (d && d->value_len == args.value_len) {
+    /* reuse the entry */
+    ngx_queue_remove(&d->queue);
+  } else {
+    if (d) shared_dict_delete_node(dict, d);
+    d = shared_dict_alloc(dict, args.key_len, args.value_len);
+    if (d == NULL) {
+      ngx_shmtx_unlock(&dict->shpool->mutex);
+      return SG_FALSE;
+    }
+    DICT_RBNODE(d)->key = args.hash;
+    d->key_len = (u_short)args.key_len;
+    d->value_len = (uint32_t)args.value_len;
+    ngx_memcpy(d->data, args.key, args.key_len);
+    ngx_rbtree_insert(&dict->sh->rbtree, DICT_RBNODE(d));
+  }
+  d->type = (u_char)args.type;
+  d->expires = expires;
+  ngx_memcpy(d->data + d->key_len, args.value, args.value_len);
+  ngx_queue_insert_head(&dict->sh->lru, &d->queue);
+  ngx_shmtx_unlock(&dict->shpool->mutex);
+  return SG_TRUE;
+}
+static SG_DEFINE_SUBR(nginx_shared_dict_store_stub, 5, 0,
+		      nginx_shared_dict_store, SG_FALSE, NULL);
+
+/* (%nginx-shared-dict-incr! dict key delta init ttl) */
+static SgObject nginx_shared_dict_incr(SgObject *argv, int argc, void *data)
+{
+  SgObject who = SG_INTERN("nginx-shared-dict-incr!");
+  shared_dict_node_t *d;
+  shared_dict_t *dict;
+  dict_args_t args;
+  int64_t delta, value;
+  uint64_t expires;
+
+  if (argc != 5) {
+    Sg_WrongNumberOfArgumentsViolation(who, 5, argc, SG_NIL);
+  }
+  if (!SG_EXACT_INTP(argv[2])) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("exact integer"),
+				    argv[2], SG_NIL);
+  }
+  if (!SG_FALSEP(argv[3]) && !SG_EXACT_INTP(argv[3])) {
+    Sg_WrongTypeOfArgumentViolation(who, SG_INTERN("exact integer"),
+				    argv[3], SG_NIL);
+  }
+  delta = Sg_GetIntegerS64Clamp(argv[2], SG_CLAMP_NONE, NULL);
+  dict = dict_arguments(who, argv,
+			SG_FALSEP(argv[3]) ? NULL : argv[3], &args);
+  expires = dict_ttl(who, argv[4]);
+
+  ngx_shmtx_lock(&dict->shpool->mutex);
+  d = shared_dict_lookup(dict, args.key, args.key_len, args.hash);
+  if (d == NULL) {
+    if (SG_FALSEP(argv[3])) {
+      ngx_shmtx_unlock(&dict->shpool->mutex);
+      return SG_FALSE;
+    }
+    d = shared_dict_alloc(dict, args.key_len, sizeof(int64_t));
+    if (d == NULL) {
+      ngx_shmtx_unlock(&dict->shpool->mutex);
+      return SG_FALSE;
+    }
+    DICT_RBNODE(d)->key = args.hash;
+    d->type = DICT_INTEGER;
+    d->key_len = (u_short)args.key_len;
+    d->value_len = sizeof(int64_t);
+    d->expires = expires;
+    ngx_memcpy(d->data, args.key, args.key_len);
+    ngx_rbtree_insert(&dict->sh->rbtree, DICT_RBNODE(d));
+    value = args.integer;
+  } else if (d->type != DICT_INTEGER) {
+    ngx_shmtx_unlock(&dict->shpool->mutex);
+    Sg_AssertionViolation(who, SG_MAKE_STRING("value is not an integer"),
+			  SG_LIST1(argv[1]));
+    return SG_UNDEF;		/* dummy */
+  } else {
+    ngx_memcpy(&value, d->data + d->key_len, sizeof(int64_t));
+    ngx_queue_remove(&d->queue);
+  }
+  value += delta;
+  ngx_memcpy(d->data + d->key_len, &value, sizeof(int64_t));
+  ngx_queue_insert_head(&dict->sh->lru, &d->queue);
+  ngx_shmtx_unlock(&dict->shpool->mutex);
+  return Sg_MakeIntegerFromS64(value);
+}
+static SG_DEFINE_SUBR(nginx_shared_dict_incr_stub, 5, 0,
+		      nginx_shared_dict_incr, SG_FALSE, NULL);
+
+static SgObject nginx_shared_dict_delete(SgObject *argv, int argc, void *data)
+{
+  SgObject who = SG_INTERN("nginx-shared-dict-delete!");
+  shared_dict_node_t *d;
+  shared_dict_t *dict;
+  dict_args_t args;
+
+  if (argc != 2) {
+    Sg_WrongNumberOfArgumentsViolation(who, 2, argc, SG_NIL);
+  }
+  dict = dict_arguments(who, argv, NULL, &args);
+
+  ngx_shmtx_lock(&dict->shpool->mutex);
+  d = shared_dict_lookup(dict, args.key, args.key_len, args.hash);
+  if (d) shared_dict_delete_node(dict, d);
+  ngx_shmtx_unlock(&dict->shpool->mutex);
+  return SG_MAKE_BOOL(d != NULL);
+}
+static SG_DEFINE_SUBR(nginx_shared_dict_delete_stub, 2, 0,
+		      nginx_shared_dict_delete, SG_FALSE, NULL);
+
+/* remaining milliseconds, 0 if it never expires */
+static SgObject nginx_shared_dict_ttl(SgObject *argv, int argc, void *data)
+{
+  SgObject who = SG_INTERN("nginx-shared-dict-ttl");
+  shared_dict_node_t *d;
+  shared_dict_t *dict;
+  dict_args_t args;
+  SgObject r = SG_FALSE;
+
+  if (argc != 2) {
+    Sg_WrongNumberOfArgumentsViolation(who, 2, argc, SG_NIL);
+  }
+  dict = dict_arguments(who, argv, NULL, &args);
+
+  ngx_shmtx_lock(&dict->shpool->mutex);
+  d = shared_dict_lookup(dict, args.key, args.key_len, args.hash);
+  if (d) {
+    uint64_t now = dict_now();
+    /* the live entry has at least 1ms */
+    r = d->expires == 0
+      ? SG_MAKE_INT(0)
+      : Sg_MakeIntegerFromU64(d->expires > now ? d->expires - now : 1);
+  }
+  ngx_shmtx_unlock(&dict->shpool->mutex);
+  return r;
+}
+static SG_DEFINE_SUBR(nginx_shared_dict_ttl_stub, 2, 0,
+		      nginx_shared_dict_ttl, SG_FALSE, NULL);
+
+/*
+  Response cache.
+  The `cache` directive keeps the responses of the location in the
+  worker process, so the hit is replayed without entering the VM. The
+  entries are allocated in one block, the status, the headers and the
+  body, and kept in a rbtree of the key and in a LRU queue. The body is
+  sent directly from the entry, so the entry is reference counted by
+  the requests sending it and freed by the last one if it's evicted in
+  the mean time. The cache is touched by the threads of the thread pool
+  mode, thus the lock.
+ */
+typedef enum {
+  CACHE_KEY_URI,
+  CACHE_KEY_ARGS,
+  CACHE_KEY_HEADER
+} cache_key_kind_t;
+
+typedef struct
+{
+  cache_key_kind_t kind;
+  ngx_str_t        name;	/* header name of CACHE_KEY_HEADER */
+} cache_key_t;
+
+struct response_cache_s
+{
+  ngx_msec_t         ttl;
+  ngx_uint_t         max_entries;
+  size_t             max_size;	/* 0 means unlimited */
+  ngx_array_t       *keys;	/* array of cache_key_t */
+  ngx_rbtree_t       rbtree;
+  ngx_rbtree_node_t  sentinel;
+  ngx_queue_t        lru;
+  ngx_uint_t         entries;
+  size_t             size;	/* total size of the entries */
+  ngx_thread_mutex_t mutex;
+};
+
+typedef struct
+{
+  ngx_str_node_t     sn;	/* must be the first, str is the key */
+  ngx_queue_t        queue;
+  response_cache_t  *cache;
+  ngx_msec_t         expires;
+  ngx_uint_t         refs;	/* number of requests sending the body */
+  unsigned           evicted:1;
+  ngx_uint_t         status;
+  ngx_str_t          content_type;
+  ngx_uint_t         nheaders;
+  ngx_table_elt_t   *headers;
+  ngx_str_t          body;
+  size_t             size;	/* size of the block */
+} response_cache_entry_t;
+
+#define RESPONSE_CACHE_ENTRIES 1024
+/* the response header to opt in (yes) or out (no), never sent */
+#define CACHE_CONTROL_HEADER "x-sagittarius-cache"
+
+/* cache ttl [uri] [args] [header:name] [max_entries=n] [max_size=size] */
+static char *parse_response_cache(ngx_conf_t *cf,
+				  ngx_http_sagittarius_conf_t *sg_conf)
+{
+  ngx_str_t *value = cf->args->elts, v;
+  response_cache_t *cache;
+  cache_key_t *key;
+  ngx_uint_t i;
+  ngx_int_t ttl;
+
+  if (cf->args->nelts < 2) {
+    ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+		  "'sagittarius': 'cache' must take at least "
+		  "1 element (ttl)");
+    return NGX_CONF_ERROR;
+  }
+  cache = ngx_pcalloc(cf->pool, sizeof(response_cache_t));
+  if (cache == NULL) return NGX_CONF_ERROR;
+  ttl = ngx_parse_time(&value[1], 0);
+  if (ttl == NGX_ERROR || ttl == 0) {
+    ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+		  "'sagittarius': invalid 'cache' ttl %V", &value[1]);
+    return NGX_CONF_ERROR;
+  }
+  cache->ttl = (ngx_msec_t)ttl;
+  cache->max_entries = RESPONSE_CACHE_ENTRIES;
+  cache->keys = ngx_array_create(cf->pool, 4, sizeof(cache_key_t));
+  if (cache->keys == NULL) return NGX_CONF_ERROR;
+
+  for (i = 2; i < cf->args->nelts; i++) {
+    if (ngx_strncmp(value[i].data, "max_entries=", 12) == 0) {
+      ngx_int_t n = ngx_atoi(value[i].data + 12, value[i].len - 12);
+      if (n == NGX_ERROR || n == 0) {
+	ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+		      "'sagittarius': invalid 'cache' %V", &value[i]);
+	return NGX_CONF_ERROR;
+      }
+      cache->max_entries = n;
+      continue;
+    }
+    if (ngx_strncmp(value[i].data, "max_size=", 9) == 0) {
+      ssize_t size;
+      v.data = value[i].data + 9;
+      v.len = value[i].len - 9;
+      size = ngx_parse_size(&v);
+      if (size == NGX_ERROR) {
+	ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+		      "'sagittarius': invalid 'cache' %V", &value[i]);
+	return NGX_CONF_ERROR;
+      }
+      cache->max_size = (size_t)size;
+      continue;
+    }
+
+    key = ngx_array_push(cache->keys);
+    if (key == NULL) return NGX_CONF_ERROR;
+    ngx_str_null(&key->name);
+    if (ngx_strcmp(value[i].data, "uri") == 0) {
+      key->kind = CACHE_KEY_URI;
+    } else if (ngx_strcmp(value[i].data, "args") == 0) {
+      key->kind = CACHE_KEY_ARGS;
+    } else if (ngx_strncmp(value[i].data, "header:", 7) == 0
+	       && value[i].len > 7) {
+      key->kind = CACHE_KEY_HEADER;
+      key->name.data = value[i].data + 7;
+      key->name.len = value[i].len - 7;
+    } else {
+      ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+		    "'sagittarius': unknown 'cache' key %V", &value[i]);
+      return NGX_CONF_ERROR;
+    }
+  }
+  if (cache->keys->nelts == 0) {
+    /* uri and args by default */
+    key = ngx_array_push_n(cache->keys, 2);
+    if (key == NULL) return NGX_CONF_ERROR;
+    key[0].kind = CACHE_KEY_URI;
+    ngx_str_null(&key[0].name);
+    key[1].kind = CACHE_KEY_ARGS;
+    ngx_str_null(&key[1].name);
+  }
+
+  ngx_rbtree_init(&cache->rbtree, &cache->sentinel,
+		  ngx_str_rbtree_insert_value);
+  ngx_queue_init(&cache->lru);
+  if (ngx_thread_mutex_create(&cache->mutex, cf->log) != NGX_OK) {
+    return NGX_CONF_ERROR;
+  }
+  sg_conf->cache = cache;
+  return NGX_CONF_OK;
+}
+
+static ngx_str_t *find_request_header(ngx_http_request_t *r, ngx_str_t *name)
+{
+  ngx_list_part_t *part = &r->headers_in.headers.part;
+  ngx_table_elt_t *data = part->elts;
+  ngx_uint_t i;
+
+  for (i = 0; ; i++) {
+    if (i >= part->nelts) {
+      if (part->next == NULL) return NULL;
+      part = part->next;
+      data = part->elts;
+      i = 0;
+    }
+    if (data[i].key.len == name->len &&
+	ngx_strncasecmp(data[i].key.data, name->data, name->len) == 0) {
+      return &data[i].value;
+    }
+  }
+}
+
+/* the components are length prefixed, so the key is unambiguous */
+static ngx_int_t make_cache_key(ngx_http_request_t *r, response_cache_t *cache,
+				ngx_str_t *key)
+{
+  cache_key_t *keys = cache->keys->elts;
+  ngx_str_t *values, *v, empty = ngx_null_string;
+  ngx_uint_t i;
+  size_t len = 0;
+  u_char *p;
+
+  values = ngx_palloc(r->pool, sizeof(ngx_str_t) * cache->keys->nelts);
+  if (values == NULL) return NGX_ERROR;
+  for (i = 0; i < cache->keys->nelts; i++) {
+    switch (keys[i].kind) {
+    case CACHE_KEY_URI:  v = &r->uri; break;
+    case CACHE_KEY_ARGS: v = &r->args; break;
+    default:
+      v = find_request_header(r, &keys[i].name);
+      if (v == NULL) v = &empty;
+      break;
+    }
+    values[i] = *v;
+    len += sizeof(uint32_t) + v->len;
+  }
+  key->data = p = ngx_pnalloc(r->pool, len);
+  if (p == NULL) return NGX_ERROR;
+  key->len = len;
+  for (i = 0; i < cache->keys->nelts; i++) {
+    uint32_t n = (uint32_t)values[i].len;
+    p = ngx_cpymem(p, &n, sizeof(uint32_t));
+    p = ngx_cpymem(p, values[i].data, values[i].len);
+  }
+  return NGX_OK;
+}
+
+/* must be called with the lock */
+static void evict_cache_entry(response_cache_t *cache,
+			      response_cache_entry_t *e)
+{
+  ngx_rbtree_delete(&cache->rbtree, &e->sn.node);
+  ngx_queue_remove(&e->queue);
+  cache->entries--;
+  cache->size -= e->size;
+  if (e->refs == 0) {
+    ngx_free(e);
+  } else {
+    e->evicted = 1;		/* freed by the last request */
+  }
+}
+
+static void release_cache_entry(void *data)
+{
+  response_cache_entry_t *e = data;
+  response_cache_t *cache = e->cache;
+  int evicted;
+
+  ngx_thread_mutex_lock(&cache->mutex, ngx_cycle->log);
+  e->refs--;
+  evicted = e->refs == 0 && e->evicted;
+  ngx_thread_mutex_unlock(&cache->mutex, ngx_cycle->log);
+  if (evicted) ngx_free(e);
+}
+
+/* returns NGX_DECLINED if the response isn't cached */
+static ngx_int_t replay_cached_response(ngx_http_request_t *r,
+					response_cache_t *cache,
+					ngx_str_t *key, uint32_t hash)
+{
+  response_cache_entry_t *e;
+  request_timing_t *timing;
+  ngx_pool_cleanup_t *cln;
+  ngx_table_elt_t *h;
+  ngx_chain_t out;
+  ngx_buf_t *b;
+  ngx_uint_t i;
+  ngx_int_t rc;
+
+  cln = ngx_pool_cleanup_add(r->pool, 0);
+  if (cln == NULL) return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+  ngx_thread_mutex_lock(&cache->mutex, r->connection->log);
+  e = (response_cache_entry_t *)ngx_str_rbtree_lookup(&cache->rbtree, key,
+						       hash);
+  if (e && (ngx_msec_int_t)(e->expires - ngx_current_msec) <= 0) {
+    evict_cache_entry(cache, e);
+    e = NULL;
+  }
+  if (e) {
+    ngx_queue_remove(&e->queue);
+    ngx_queue_insert_head(&cache->lru, &e->queue);
+    e->refs++;
+  }
+  ngx_thread_mutex_unlock(&cache->mutex, r->connection->log);
+  if (e == NULL) return NGX_DECLINED;
+
+  /* on miss, the cleanup is left without handler which NGINX skips */
+  cln->handler = release_cache_entry;
+  cln->data = e;
+  ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0,
+		"'sagittarius': Replaying the cached response of %V", &r->uri);
+
+  rc = ngx_http_discard_request_body(r);
+  if (rc != NGX_OK) return rc;
+
+  r->headers_out.status = e->status;
+  r->headers_out.content_type = e->content_type;
+  r->headers_out.content_type_len = e->content_type.len;
+  r->headers_out.content_type_lowcase = NULL;
+  for (i = 0; i < e->nheaders; i++) {
+    header_name_t hn;
+    response_field_t *f;
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    *h = e->headers[i];
+    hn.key = h->key;
+    hn.lowcase_key = h->lowcase_key;
+    hn.hash = h->hash;
+    f = lookup_response_field(&hn);
+    if (f) *response_field_slot(r, f) = h;
+  }
+  r->headers_out.content_length_n = e->body.len;
+  r->header_only = (e->body.len == 0);
+  timing = request_timing(r);
+  if (timing) timing->response_bytes = e->body.len;
+
+  rc = ngx_http_send_header(r);
+  if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) return rc;
+
+  b = ngx_calloc_buf(r->pool);
+  if (b == NULL) return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  b->pos = e->body.data;
+  b->last = e->body.data + e->body.len;
+  b->memory = 1;
+  b->last_buf = (r == r->main);
+  b->last_in_chain = 1;
+  out.buf = b;
+  out.next = NULL;
+  return ngx_http_output_filter(r, &out);
+}
+
+/* 
+   Stores the response if it's cacheable. By default, 200 responses
+   without Set-Cookie are stored, the handler can override it by the
+   X-Sagittarius-Cache header. The header is removed in any case.
+   The key doesn't contain the method, a HEAD request is answered from
+   the GET entry but never stores its own (usually empty) response.
+ */
+static void store_cached_response(ngx_http_request_t *r,
+				  response_cache_t *cache,
+				  SgObject req, ngx_chain_t *out)
+{
+  static ngx_str_t control = ngx_string(CACHE_CONTROL_HEADER);
+  static ngx_str_t cookie = ngx_string("set-cookie");
+  ngx_list_part_t *part;
+  ngx_table_elt_t *data, *h;
+  ngx_chain_t *c;
+  response_cache_entry_t *e, *old;
+  ngx_uint_t i, nheaders = 0;
+  int force = FALSE, cookies = FALSE;
+  size_t size, body = 0;
+  u_char *p;
+
+  part = &r->headers_out.headers.part;
+  data = part->elts;
+  size = 0;
+  for (i = 0; ; i++) {
+    if (i >= part->nelts) {
+      if (part->next == NULL) break;
+      part = part->next;
+      data = part->elts;
+      i = 0;
+    }
+    h = &data[i];
+    if (h->hash == 0) continue;
+    if (h->key.len == control.len &&
+	ngx_strncasecmp(h->key.data, control.data, control.len) == 0) {
+      h->hash = 0;		/* never sent */
+      if (h->value.len == 2 && ngx_strncasecmp(h->value.data,
+					       (u_char *)"no", 2) == 0) {
+	return;
+      }
+      force = h->value.len == 3 &&
+	ngx_strncasecmp(h->value.data, (u_char *)"yes", 3) == 0;
+      continue;
+    }
+    if (h->key.len == cookie.len &&
+	ngx_strncasecmp(h->key.data, cookie.data, cookie.len) == 0) {
+      cookies = TRUE;
+    }
+    nheaders++;
+    size += h->key.len * 2 + h->value.len;
+  }
+
+  if (SG_NGINX_REQUEST(req)->cache_key.len == 0) return;
+  /* HEAD shares the entry of GET, so only GET responses are stored */
+  if (r->method != NGX_HTTP_GET) return;
+  if (!force && (r->headers_out.status != NGX_HTTP_OK || cookies)) return;
+  for (c = out; c; c = c->next) {
+    /* files are not cached */
+    if (!ngx_buf_in_memory(c->buf) && ngx_buf_size(c->buf) > 0) return;
+    body += ngx_buf_size(c->buf);
+  }
+
+  size += sizeof(response_cache_entry_t)
+    + nheaders * sizeof(ngx_table_elt_t)
+    + SG_NGINX_REQUEST(req)->cache_key.len
+    + r->headers_out.content_type.len
+    + body;
+  if (cache->max_size != 0 && size > cache->max_size) return;
+
+  e = ngx_alloc(size, r->connection->log);
+  if (e == NULL) return;
+  e->cache = cache;
+  e->refs = 0;
+  e->evicted = 0;
+  e->size = size;
+  e->status = r->headers_out.status;
+  e->expires = ngx_current_msec + cache->ttl;
+  e->nheaders = nheaders;
+  e->headers = (ngx_table_elt_t *)(e + 1);
+  p = (u_char *)(e->headers + nheaders);
+
+  e->sn.str.data = p;
+  e->sn.str.len = SG_NGINX_REQUEST(req)->cache_key.len;
+  e->sn.node.key = SG_NGINX_REQUEST(req)->cache_hash;
+  p = ngx_cpymem(p, SG_NGINX_REQUEST(req)->cache_key.data, e->sn.str.len);
+  e->content_type.data = p;
+  e->content_type.len = r->headers_out.content_type.len;
+  p = ngx_cpymem(p, r->headers_out.content_type.data, e->content_type.len);
+
+  part = &r->headers_out.headers.part;
+  data = part->elts;
+  nheaders = 0;
+  for (i = 0; ; i++) {
+    if (i >= part->nelts) {
+      if (part->next == NULL) break;
+      part = part->next;
+      data = part->elts;
+      i = 0;
+    }
+    if (data[i].hash == 0) continue;
+    h = &e->headers[nheaders++];
+    h->hash = data[i].hash;
+    h->key.data = p;
+    h->key.len = data[i].key.len;
+    p = ngx_cpymem(p, data[i].key.data, h->key.len);
+    h->lowcase_key = p;
+    p = ngx_cpymem(p, data[i].lowcase_key, h->key.len);
+    h->value.data = p;
+    h->value.len = data[i].value.len;
+    p = ngx_cpymem(p, data[i].value.data, h->value.len);
+  }
+  e->body.data = p;
+  e->body.len = body;
+  for (c = out; c; c = c->next) {
+    p = ngx_cpymem(p, c->buf->pos, ngx_buf_size(c->buf));
+  }
+
+  ngx_thread_mutex_lock(&cache->mutex, r->connection->log);
+  old = (response_cache_entry_t *)ngx_str_rbtree_lookup(&cache->rbtree,
+							 &e->sn.str,
+							 e->sn.node.key);
+  if (old) evict_cache_entry(cache, old);
+  ngx_rbtree_insert(&cache->rbtree, &e->sn.node);
+  ngx_queue_insert_head(&cache->lru, &e->queue);
+  cache->entries++;
+  cache->size += size;
+  while (cache->entries > cache->max_entries ||
+	 (cache->max_size != 0 && cache->size > cache->max_size)) {
+    ngx_queue_t *q = ngx_queue_last(&cache->lru);
+    evict_cache_entry(cache,
+		      ngx_queue_data(q, response_cache_entry_t, queue));
+  }
+  ngx_thread_mutex_unlock(&cache->mutex, r->connection->log);
+}
+
+static void preload_contexts(ngx_cycle_t *cycle);
+static void init_status_worker(ngx_cycle_t *cycle);
+static ngx_int_t init_executors(ngx_cycle_t *cycle);
+static void stop_executors(ngx_cycle_t *cycle);
+
+static ngx_int_t ngx_http_sagittarius_init_process(ngx_cycle_t *cycle)
+{
+  SgObject sym, lib;
+  ngx_log_error(NGX_LOG_DEBUG, cycle->log, 0,
+		"'sagittarius': Initialising Sagittarius process");
+
+  if (ngx_thread_mutex_create(&global_lock, cycle->log) != NGX_OK) {
+    ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
+		"'sagittarius': Failed to initialise the mutex");
+    return NGX_ERROR;
+  }
+  /* Initialise the sagittarius VM */
+  Sg_Init();
+  pinned_objects = Sg_MakeHashTableSimple(SG_HASH_EQ, 0);
+  ngx_queue_init(&socket_pools);
+  init_status_worker(cycle);
+  if (init_executors(cycle) != NGX_OK) return NGX_ERROR;
+
+  sym = SG_INTERN("(sagittarius nginx internal)");
+  ngx_log_error(NGX_LOG_DEBUG, cycle->log, 0,
+		"'sagittarius': "
+		"Initialising '(sagittarius nginx internal)' library");
+  lib = Sg_FindLibrary(sym, TRUE);
+
+  Sg_InitStaticClassWithMeta(SG_CLASS_NGINX_CONTEXT, UC("<nginx-context>"),
+			     SG_LIBRARY(lib), NULL,
+			     SG_FALSE, nc_slots, 0);
+  Sg_InitStaticClassWithMeta(SG_CLASS_NGINX_FILTER_CONTEXT,
+			     UC("<nginx-filter-context>"),
+			     SG_LIBRARY(lib), NULL,
+			     SG_FALSE, nf_slots, 0);
+  Sg_InitStaticClassWithMeta(SG_CLASS_NGINX_REQUEST, UC("<nginx-request>"),
+			     SG_LIBRARY(lib), NULL,
+			     SG_FALSE, nr_slots, 0);
+  Sg_InitStaticClassWithMeta(SG_CLASS_NGINX_RESPONSE, UC("<nginx-response>"),
+			     SG_LIBRARY(lib), NULL,
+			     SG_FALSE, nres_slots, 0);
+  Sg_InitStaticClass(SG_CLASS_RESPONSE_OUTPUT_PORT, UC("<nginx-response-port>"),
+		     SG_LIBRARY(lib), NULL, 0);
+  Sg_InitStaticClass(SG_CLASS_NGINX_SOCKET, UC("<nginx-socket>"),
+		     SG_LIBRARY(lib), NULL, 0);
+  Sg_InitStaticClass(SG_CLASS_NGINX_SUBREQUEST, UC("<nginx-subrequest>"),
+		     SG_LIBRARY(lib), NULL, 0);
+  Sg_InitStaticClass(SG_CLASS_NGINX_SHARED_DICT, UC("<nginx-shared-dict>"),
+		     SG_LIBRARY(lib), NULL, 0);
+
+  Sg_InsertBinding(SG_LIBRARY(lib),
+		   SG_INTERN("nginx-context?"), &nginx_context_p_stub);
+  SG_PROCEDURE_NAME(&nginx_context_p_stub) = SG_MAKE_STRING("nginx-context?");
+  SG_PROCEDURE_TRANSPARENT(&nginx_context_p_stub) = SG_PROC_TRANSPARENT;
+
+  Sg_InsertBinding(SG_LIBRARY(lib), SG_INTERN("nginx-context-parameter-ref"),
+		   &nginx_context_parameter_ref_stub);
+  SG_PROCEDURE_NAME(&nginx_context_parameter_ref_stub) =
+    SG_MAKE_STRING("nginx-context-parameter-ref");
+  SG_PROCEDURE_TRANSPARENT(&nginx_context_parameter_ref_stub) =
+    SG_PROC_NO_SIDE_EFFECT;
+
+  Sg_InsertBinding(SG_LIBRARY(lib),
+		   SG_INTERN("nginx-filter-context?"),
+		   &nginx_filter_context_p_stub);
+  SG_PROCEDURE_NAME(&nginx_filter_context_p_stub) =
+    SG_MAKE_STRING("nginx-filter-context?");
+  SG_PROCEDURE_TRANSPARENT(&nginx_filter_context_p_stub) = SG_PROC_TRANSPARENT;
+
+  Sg_InsertBinding(SG_LIBRARY(lib),
+		   SG_INTERN("nginx-filter-context-parameter-ref"),
+		   &nginx_filter_context_parameter_ref_stub);
+  SG_PROCEDURE_NAME(&nginx_filter_context_parameter_ref_stub) =
+    SG_MAKE_STRING("nginx-filter-context-parameter-ref");
+  SG_PROCEDURE_TRANSPARENT(&nginx_filter_context_parameter_ref_stub) =
+    SG_PROC_NO_SIDE_EFFECT;
+  Sg_InsertBinding(SG_LIBRARY(lib),
+		   SG_INTERN("nginx-filter-context-name"),
+		   &nginx_filter_context_name_stub);
+  SG_PROCEDURE_NAME(&nginx_filter_context_name_stub) =
+    SG_MAKE_STRING("nginx-filter-context-name");
+  SG_PROCEDURE_TRANSPARENT(&nginx_filter_context_name_stub) =
+    SG_PROC_NO_SIDE_EFFECT;
+
+  
+  Sg_InsertBinding(SG_LIBRARY(lib),
+		   SG_INTERN("nginx-request?"), &nginx_request_p_stub);
+  SG_PROCEDURE_NAME(&nginx_request_p_stub) = SG_MAKE_STRING("nginx-request?");
+  SG_PROCEDURE_TRANSPARENT(&nginx_request_p_stub) = SG_PROC_TRANSPARENT;
+
+  Sg_InsertBinding(SG_LIBRARY(lib),
+		   SG_INTERN("%nginx-response-send-file"),
+		   &nginx_response_send_file_stub);
+  SG_PROCEDURE_NAME(&nginx_response_send_file_stub) =
+    SG_MAKE_STRING("nginx-response-send-file");
+  SG_PROCEDURE_TRANSPARENT(&nginx_response_send_file_stub) =
+    SG_SUBR_SIDE_EFFECT;
+
+  Sg_InsertBinding(SG_LIBRARY(lib),
+		   SG_INTERN("%nginx-socket-connect"),
+		   &nginx_socket_connect_stub);
+  SG_PROCEDURE_NAME(&nginx_socket_connect_stub) =
+    SG_MAKE_STRING("nginx-socket-connect");
+  SG_PROCEDURE_TRANSPARENT(&nginx_socket_connect_stub) = SG_SUBR_SIDE_EFFECT;
+  Sg_InsertBinding(SG_LIBRARY(lib), SG_INTERN("nginx-socket-send"),
+		   &nginx_socket_send_stub);
+  SG_PROCEDURE_NAME(&nginx_socket_send_stub) =
+    SG_MAKE_STRING("nginx-socket-send");
+  SG_PROCEDURE_TRANSPARENT(&nginx_socket_send_stub) = SG_SUBR_SIDE_EFFECT;
+  Sg_InsertBinding(SG_LIBRARY(lib), SG_INTERN("nginx-socket-receive"),
+		   &nginx_socket_receive_stub);
+  SG_PROCEDURE_NAME(&nginx_socket_receive_stub) =
+    SG_MAKE_STRING("nginx-socket-receive");
+  SG_PROCEDURE_TRANSPARENT(&nginx_socket_receive_stub) = SG_SUBR_SIDE_EFFECT;
+  Sg_InsertBinding(SG_LIBRARY(lib), SG_INTERN("nginx-socket-close"),
+		   &nginx_socket_close_stub);
+  SG_PROCEDURE_NAME(&nginx_socket_close_stub) =
+    SG_MAKE_STRING("nginx-socket-close");
+  SG_PROCEDURE_TRANSPARENT(&nginx_socket_close_stub) = SG_SUBR_SIDE_EFFECT;
+  Sg_InsertBinding(SG_LIBRARY(lib), SG_INTERN("nginx-socket-release"),
+		   &nginx_socket_release_stub);
+  SG_PROCEDURE_NAME(&nginx_socket_release_stub) =
+    SG_MAKE_STRING("nginx-socket-release");
+  SG_PROCEDURE_TRANSPARENT(&nginx_socket_release_stub) = SG_SUBR_SIDE_EFFECT;
+  Sg_InsertBinding(SG_LIBRARY(lib), SG_INTERN("nginx-socket?"),
+		   &nginx_socket_p_stub);
+  SG_PROCEDURE_NAME(&nginx_socket_p_stub) = SG_MAKE_STRING("nginx-socket?");
+  SG_PROCEDURE_TRANSPARENT(&nginx_socket_p_stub) = SG_PROC_TRANSPARENT;
+
+  Sg_InsertBinding(SG_LIBRARY(lib), SG_INTERN("%nginx-subrequest"),
+		   &nginx_subrequest_stub);
+  SG_PROCEDURE_NAME(&nginx_subrequest_stub) =
+    SG_MAKE_STRING("nginx-subrequest");
+  SG_PROCEDURE_TRANSPARENT(&nginx_subrequest_stub) = SG_SUBR_SIDE_EFFECT;
+  Sg_InsertBinding(SG_LIBRARY(lib), SG_INTERN("nginx-subrequests-wait"),
+		   &nginx_subrequests_wait_stub);
+  SG_PROCEDURE_NAME(&nginx_subrequests_wait_stub) =
+    SG_MAKE_STRING("nginx-subrequests-wait");
+  SG_PROCEDURE_TRANSPARENT(&nginx_subrequests_wait_stub) =
+    SG_SUBR_SIDE_EFFECT;
+  Sg_InsertBinding(SG_LIBRARY(lib), SG_INTERN("nginx-subrequest?"),
+		   &nginx_subrequest_p_stub);
+  SG_PROCEDURE_NAME(&nginx_subrequest_p_stub) =
+    SG_MAKE_STRING("nginx-subrequest?");
+  SG_PROCEDURE_TRANSPARENT(&nginx_subrequest_p_stub) = SG_PROC_TRANSPARENT;
+
+#define INSERT_DICT_PROC(name, cname, effect)				\
+  do {									\
+    Sg_InsertBinding(SG_LIBRARY(lib), SG_INTERN(name), &cname);		\
+    SG_PROCEDURE_NAME(&cname) = SG_MAKE_STRING(name);			\
+    SG_PROCEDURE_TRANSPARENT(&cname) = effect;				\
+  } while (0)
+  INSERT_DICT_PROC("nginx-shared-dict", nginx_shared_dict_stub,
+		   SG_PROC_NO_SIDE_EFFECT);
+  INSERT_DICT_PROC("nginx-shared-dict?", nginx_shared_dict_p_stub,
+		   SG_PROC_TRANSPARENT);
+  INSERT_DICT_PROC("%nginx-shared-dict-ref", nginx_shared_dict_ref_stub,
+		   SG_SUBR_SIDE_EFFECT);
+  INSERT_DICT_PROC("%nginx-shared-dict-store!", nginx_shared_dict_store_stub,
+		   SG_SUBR_SIDE_EFFECT);
+  INSERT_DICT_PROC("%nginx-shared-dict-incr!", nginx_shared_dict_incr_stub,
+		   SG_SUBR_SIDE_EFFECT);
+  INSERT_DICT_PROC("nginx-shared-dict-delete!", nginx_shared_dict_delete_stub,
+		   SG_SUBR_SIDE_EFFECT);
+  INSERT_DICT_PROC("nginx-shared-dict-ttl", nginx_shared_dict_ttl_stub,
+		   SG_SUBR_SIDE_EFFECT);
+#undef INSERT_DICT_PROC
+
+  Sg_InsertBinding(SG_LIBRARY(lib),
+		   SG_INTERN("%nginx-response-body-add!"),
+		   &nginx_response_body_add_stub);
+  SG_PROCEDURE_NAME(&nginx_response_body_add_stub) =
+    SG_MAKE_STRING("nginx-response-body-add!");
+  SG_PROCEDURE_TRANSPARENT(&nginx_response_body_add_stub) =
+    SG_SUBR_SIDE_EFFECT;
+
+  Sg_InsertBinding(SG_LIBRARY(lib),
+		   SG_INTERN("%nginx-response-cookie-add!"),
+		   &nginx_response_add_cookie_stub);
+  SG_PROCEDURE_NAME(&nginx_response_add_cookie_stub) =
+    SG_MAKE_STRING("nginx-response-cookie-add!");
+  SG_PROCEDURE_TRANSPARENT(&nginx_response_add_cookie_stub) =
+    SG_SUBR_SIDE_EFFECT;
+
+  Sg_InsertBinding(SG_LIBRARY(lib),
+		   SG_INTERN("%nginx-request-body-bytevector"),
+		   &nginx_request_body_bytevector_stub);
+  SG_PROCEDURE_NAME(&nginx_request_body_bytevector_stub) =
+    SG_MAKE_STRING("nginx-request-body-bytevector");
+  SG_PROCEDURE_TRANSPARENT(&nginx_request_body_bytevector_stub) =
+    SG_PROC_NO_SIDE_EFFECT;
+
+  Sg_InsertBinding(SG_LIBRARY(lib),
 		   SG_INTERN("nginx-response?"), &nginx_response_p_stub);
   SG_PROCEDURE_NAME(&nginx_response_p_stub) = SG_MAKE_STRING("nginx-response?");
   SG_PROCEDURE_TRANSPARENT(&nginx_response_p_stub) = SG_PROC_TRANSPARENT;
@@ -1339,6 +4644,13 @@ static ngx_int_t ngx_http_sagittarius_init_process(ngx_cycle_t *cycle)
   SG_PROCEDURE_TRANSPARENT(&nginx_response_del_header_stub) =
     SG_SUBR_SIDE_EFFECT;
 
+  Sg_InsertBinding(SG_LIBRARY(lib), SG_INTERN("nginx-response-headers-set!"),
+		   &nginx_response_set_headers_stub);
+  SG_PROCEDURE_NAME(&nginx_response_set_headers_stub) =
+    SG_MAKE_STRING("nginx-response-headers-set!");
+  SG_PROCEDURE_TRANSPARENT(&nginx_response_set_headers_stub) =
+    SG_SUBR_SIDE_EFFECT;
+
   
 #define INSERT_ACCESSOR(name, cname, effect)				\
   do {									\
@@ -1361,8 +4673,12 @@ static ngx_int_t ngx_http_sagittarius_init_process(ngx_cycle_t *cycle)
 		  SG_PROC_NO_SIDE_EFFECT);
   INSERT_ACCESSOR("nginx-request-cookies", nginx_request_cookies,
 		  SG_PROC_NO_SIDE_EFFECT);
-  INSERT_ACCESSOR("nginx-request-cookies-set!", nginx_request_cookies_set,
-		  SG_SUBR_SIDE_EFFECT);
+  INSERT_ACCESSOR("nginx-request-cookie-ref", nginx_request_cookie_ref,
+		  SG_PROC_NO_SIDE_EFFECT);
+  INSERT_ACCESSOR("nginx-request-header-ref", nginx_request_header_ref,
+		  SG_PROC_NO_SIDE_EFFECT);
+  INSERT_ACCESSOR("nginx-request-header-values", nginx_request_header_values,
+		  SG_PROC_NO_SIDE_EFFECT);
   INSERT_ACCESSOR("nginx-request-query-string", nginx_request_query_string,
 		  SG_PROC_NO_SIDE_EFFECT);
   INSERT_ACCESSOR("nginx-request-original-uri", nginx_request_original_uri,
@@ -1391,6 +4707,12 @@ static ngx_int_t ngx_http_sagittarius_init_process(ngx_cycle_t *cycle)
 		  SG_PROC_NO_SIDE_EFFECT);
   INSERT_ACCESSOR("nginx-response-output-port", nginx_response_output_port,
 		  SG_PROC_NO_SIDE_EFFECT);
+  INSERT_ACCESSOR("nginx-subrequest-uri", nginx_subrequest_uri,
+		  SG_PROC_NO_SIDE_EFFECT);
+  INSERT_ACCESSOR("nginx-subrequest-status", nginx_subrequest_status,
+		  SG_PROC_NO_SIDE_EFFECT);
+  INSERT_ACCESSOR("nginx-subrequest-body", nginx_subrequest_body,
+		  SG_PROC_NO_SIDE_EFFECT);
 
 #undef INSERT_ACCESSOR
 
@@ -1400,63 +4722,683 @@ static ngx_int_t ngx_http_sagittarius_init_process(ngx_cycle_t *cycle)
   SG_INIT_CONDITION_CTR(SG_CLASS_NGINX_ERROR, lib, "make-nginx-error", 1);
   SG_INIT_CONDITION_ACC(nginx_error_status, lib, "&nginx-error-status");
 
-  ngx_log_error(NGX_LOG_DEBUG, cycle->log, 0,
-		"'sagittarius': "
-		"'(sagittarius nginx internal)' library is initialised");
-  return NGX_OK;
+  ngx_log_error(NGX_LOG_DEBUG, cycle->log, 0,
+		"'sagittarius': "
+		"'(sagittarius nginx internal)' library is initialised");
+
+  preload_contexts(cycle);
+  return NGX_OK;
+}
+
+static ngx_rbtree_t       nginx_contexts;
+static ngx_rbtree_node_t  sentinel;
+struct nginx_context_node_s
+{
+  ngx_str_node_t sn;
+  SgObject       context;	/* must be accessed via context_load/store */
+  ngx_http_sagittarius_conf_t *conf; /* temporary storage */
+  ngx_uint_t     index;		/* slot of the status zone */
+  /* the thread pool, per worker */
+  ngx_uint_t     posted;	/* tasks in the thread pool */
+  ngx_atomic_t   queued;	/* posted tasks which haven't started */
+  ngx_queue_t    waiting[LANES]; /* requests held by max_concurrency */
+  ngx_uint_t     nwaiting;
+  ngx_int_t      current[LANES]; /* of weighted round robin */
+  const ngx_int_t *weights;	/* of the executor or lane_weights */
+};
+
+/*
+  The context is created only once per node. The creation is done under
+  the global_lock and published with release semantics, so the readers
+  only need one acquire load once it's created.
+ */
+#define context_load(node) __atomic_load_n(&(node)->context, __ATOMIC_ACQUIRE)
+#define context_store(node, c)					\
+  __atomic_store_n(&(node)->context, (c), __ATOMIC_RELEASE)
+
+static void call_cleanup(ngx_cycle_t *cycle, ngx_rbtree_node_t *node)
+{
+  nginx_context_node_t *cn;
+  if (node != nginx_contexts.sentinel) {
+    cn = (nginx_context_node_t *)node;
+    if (!SG_FALSEP(cn->context) &&
+	!SG_FALSEP(SG_NGINX_CONTEXT(cn->context)->cleanup) &&
+	!SG_UNBOUNDP(SG_NGINX_CONTEXT(cn->context)->cleanup)) {
+      ngx_log_error(NGX_LOG_DEBUG, cycle->log, 0,
+		    "'sagittarius': Cleaning up context '%V'", &cn->sn.str);
+      SG_UNWIND_PROTECT {
+	Sg_Apply1(SG_NGINX_CONTEXT(cn->context)->cleanup, cn->context);
+      } SG_WHEN_ERROR {
+	ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
+		      "'sagittarius': Failed to call cleanup procedure");
+      } SG_END_PROTECT;
+    } else {
+      ngx_log_error(NGX_LOG_DEBUG, cycle->log, 0,
+		    "'sagittarius': Skip cleaning up context '%V'",
+		    &cn->sn.str);
+    }
+    call_cleanup(cycle, node->left);
+    call_cleanup(cycle, node->right);
+  }
+}
+
+static void ngx_http_sagittarius_exit_process(ngx_cycle_t *cycle)
+{
+  /* go through the rbtree */
+  /* http://nginx.org/en/docs/dev/development_guide.html#red_black_tree */
+  ngx_log_error(NGX_LOG_DEBUG, cycle->log, 0, "'sagittarius': Cleaning up");
+  /* no thread may run Scheme during the cleanup */
+  stop_executors(cycle);
+  call_cleanup(cycle, nginx_contexts.root);
+}
+
+/*
+  Status.
+  The `sagittarius_status` directive exposes the counters of the contexts
+  and the GC statistics of the workers. The counters are in a shared
+  memory zone which is only added if the directive is used, so all the
+  workers update the same ones atomically. The GC statistics are per
+  process, so each worker has its own slot in the zone.
+  The latency histogram is log-linear, each decade from STATUS_MIN_US
+  is divided into 9 linear buckets.
+ */
+#define STATUS_DECADES     6
+#define STATUS_BUCKETS     (STATUS_DECADES * 9 + 1) /* the last one is +Inf */
+#define STATUS_MIN_US      10
+#define STATUS_MAX_WORKERS 64
+
+enum {
+  STATUS_PROMETHEUS,
+  STATUS_JSON
+};
+
+typedef struct
+{
+  ngx_atomic_t started;		/* taken from the thread pool queue */
+  ngx_atomic_t queue_time;	/* microseconds */
+} status_lane_t;
+
+typedef struct
+{
+  ngx_atomic_t requests;
+  ngx_atomic_t cache_hits;
+  ngx_atomic_t in_flight;
+  ngx_atomic_t queued;		/* waiting for the thread pool */
+  ngx_atomic_t rejected;	/* by the limits of the thread pool */
+  status_lane_t lanes[LANES];
+  ngx_atomic_t responses[6];	/* by status class, 0 is unknown */
+  ngx_atomic_t latency_sum;	/* microseconds */
+  ngx_atomic_t latency[STATUS_BUCKETS];
+} status_context_t;
+
+typedef struct
+{
+  ngx_atomic_t pid;		/* 0 if the slot isn't used */
+  ngx_atomic_t heap_size;
+  ngx_atomic_t free_bytes;
+  ngx_atomic_t collections;
+  ngx_atomic_t pause_sum;	/* microseconds */
+  ngx_atomic_t pause_max;
+  ngx_atomic_t executor_threads; /* of all the executors */
+  ngx_atomic_t executor_steals;	/* tasks taken from the other threads */
+} status_worker_t;
+
+typedef struct
+{
+  ngx_uint_t       count;	/* the contexts of the cycle ... */
+  uint32_t         paths;	/* ... and the CRC32 of their paths */
+  status_worker_t  workers[STATUS_MAX_WORKERS];
+  status_context_t contexts[1];	/* as many as the contexts */
+} status_shctx_t;
+
+static ngx_uint_t             status_enabled;
+static nginx_context_node_t **status_nodes; /* indexed by the node index */
+static ngx_uint_t             status_count;
+static size_t                 status_max_path;
+static uint32_t               status_paths;
+static status_shctx_t        *status_sh;
+static status_worker_t       *status_worker; /* the slot of this process */
+static ngx_atomic_uint_t      status_gc_seen;
+static uint64_t               status_gc_start;
+static GC_on_collection_event_proc status_gc_previous;
+
+static ngx_uint_t status_bucket(uint64_t us)
+{
+  uint64_t scaled = us / STATUS_MIN_US;
+  ngx_uint_t d = 0;
+
+  while (scaled >= 10) {
+    if (++d == STATUS_DECADES) return STATUS_BUCKETS - 1;
+    scaled /= 10;
+  }
+  return d * 9 + (scaled > 1 ? scaled : 1) - 1;
+}
+
+/* upper bound of the bucket in microseconds */
+static uint64_t status_bound(ngx_uint_t i)
+{
+  uint64_t b = (i % 9 + 2) * STATUS_MIN_US;
+  ngx_uint_t d;
+  for (d = 0; d < i / 9; d++) b *= 10;
+  return b;
+}
+
+static void status_index_contexts(ngx_rbtree_node_t *node)
+{
+  nginx_context_node_t *cn;
+  if (node != nginx_contexts.sentinel) {
+    cn = (nginx_context_node_t *)node;
+    cn->index = status_count++;
+    if (cn->sn.str.len > status_max_path) status_max_path = cn->sn.str.len;
+    status_index_contexts(node->left);
+    status_index_contexts(node->right);
+  }
+}
+
+static void status_collect_contexts(ngx_rbtree_node_t *node)
+{
+  nginx_context_node_t *cn;
+  if (node != nginx_contexts.sentinel) {
+    cn = (nginx_context_node_t *)node;
+    status_nodes[cn->index] = cn;
+    status_collect_contexts(node->left);
+    status_collect_contexts(node->right);
+  }
+}
+
+static size_t status_zone_size(void)
+{
+  return sizeof(status_shctx_t)
+    + sizeof(status_context_t) * (status_count ? status_count - 1 : 0);
+}
+
+/*
+  The zone name contains the number of the contexts and the CRC32 of
+  their paths, so a reload only reuses the zone, and keeps the counters,
+  if the contexts are the same and indexed in the same order. Otherwise
+  it's a new zone, the old workers keep using the old one until they
+  exit. The header is checked in case of a collision of CRC32, the size
+  is the same then, so the counters are just cleared.
+ */
+static ngx_int_t status_init_zone(ngx_shm_zone_t *zone, void *data)
+{
+  ngx_slab_pool_t *shpool = (ngx_slab_pool_t *)zone->shm.addr;
+
+  if (data || zone->shm.exists) {
+    status_sh = data ? data : shpool->data;
+    zone->data = status_sh;
+    if (status_sh->count != status_count || status_sh->paths != status_paths) {
+      ngx_memzero(status_sh, status_zone_size());
+      status_sh->count = status_count;
+      status_sh->paths = status_paths;
+    }
+    return NGX_OK;
+  }
+  status_sh = ngx_slab_alloc(shpool, status_zone_size());
+  if (status_sh == NULL) return NGX_ERROR;
+  ngx_memzero(status_sh, status_zone_size());
+  status_sh->count = status_count;
+  status_sh->paths = status_paths;
+  shpool->data = zone->data = status_sh;
+  return NGX_OK;
+}
+
+static ngx_int_t init_status_zone(ngx_conf_t *cf)
+{
+  ngx_shm_zone_t *zone;
+  ngx_str_t name;
+  ngx_uint_t i;
+  size_t size;
+
+  status_count = 0;
+  status_max_path = 0;
+  status_index_contexts(nginx_contexts.root);
+  status_nodes = ngx_pcalloc(cf->pool,
+			     sizeof(nginx_context_node_t *) * (status_count + 1));
+  if (status_nodes == NULL) return NGX_ERROR;
+  status_collect_contexts(nginx_contexts.root);
+
+  ngx_crc32_init(status_paths);
+  for (i = 0; i < status_count; i++) {
+    ngx_crc32_update(&status_paths, status_nodes[i]->sn.str.data,
+		     status_nodes[i]->sn.str.len);
+    ngx_crc32_update(&status_paths, (u_char *)"", 1);
+  }
+  ngx_crc32_final(status_paths);
+  name.data = ngx_pnalloc(cf->pool, sizeof("sagittarius_status::") - 1
+			  + NGX_INT_T_LEN + 8);
+  if (name.data == NULL) return NGX_ERROR;
+  name.len = ngx_sprintf(name.data, "sagittarius_status:%ui:%08xD",
+			 status_count, status_paths) - name.data;
+
+  size = ngx_align(status_zone_size(), ngx_pagesize) + 8 * ngx_pagesize;
+  zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_sagittarius_module);
+  if (zone == NULL) return NGX_ERROR;
+  zone->init = status_init_zone;
+  return NGX_OK;
+}
+
+/* the allocation lock is held, so the heap size is taken later */
+static void status_gc_event(GC_EventType e)
+{
+  if (e == GC_EVENT_START) {
+    status_gc_start = now_us();
+  } else if (e == GC_EVENT_END) {
+    uint64_t pause = now_us() - status_gc_start;
+    ngx_atomic_fetch_add(&gc_pause_total, pause);
+    if (status_worker) {
+      ngx_atomic_fetch_add(&status_worker->collections, 1);
+      ngx_atomic_fetch_add(&status_worker->pause_sum, pause);
+      if (pause > (uint64_t)status_worker->pause_max) {
+	status_worker->pause_max = pause;
+      }
+    }
+  }
+  if (status_gc_previous) status_gc_previous(e);
+}
+
+static void status_update_gc(void)
+{
+  if (status_worker && status_worker->collections != status_gc_seen) {
+    status_gc_seen = status_worker->collections;
+    status_worker->heap_size = GC_get_heap_size();
+    status_worker->free_bytes = GC_get_free_bytes();
+  }
+}
+
+static void init_status_worker(ngx_cycle_t *cycle)
+{
+  /* the pause is also needed by $sagittarius_gc_time */
+  status_worker = NULL;
+  status_gc_previous = GC_get_on_collection_event();
+  GC_set_on_collection_event(status_gc_event);
+  if (status_sh == NULL) return;
+  if (ngx_worker >= STATUS_MAX_WORKERS) {
+    ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+		  "'sagittarius': GC statistics of worker %ui are not "
+		  "recorded, at most %d workers are supported",
+		  ngx_worker, STATUS_MAX_WORKERS);
+    return;
+  }
+  status_worker = &status_sh->workers[ngx_worker];
+  ngx_memzero(status_worker, sizeof(status_worker_t));
+  status_worker->pid = ngx_pid;
+  status_worker->heap_size = GC_get_heap_size();
+  status_worker->free_bytes = GC_get_free_bytes();
+  status_gc_seen = 0;
+}
+
+typedef struct
+{
+  ngx_http_request_t *request;
+  status_context_t   *metrics;
+  uint64_t            start;
+} status_request_t;
+
+static void status_request_done(void *data)
+{
+  status_request_t *s = data;
+  ngx_uint_t status = s->request->headers_out.status;
+  uint64_t us = now_us() - s->start;
+
+  ngx_atomic_fetch_add(&s->metrics->in_flight, -1);
+  ngx_atomic_fetch_add(&s->metrics->responses[status >= 100 && status < 600
+					      ? status / 100 : 0], 1);
+  ngx_atomic_fetch_add(&s->metrics->latency_sum, us);
+  ngx_atomic_fetch_add(&s->metrics->latency[status_bucket(us)], 1);
+  status_update_gc();
+}
+
+#define status_metrics(sg_conf) (&status_sh->contexts[(sg_conf)->node->index])
+#define status_lane_offset(lane, field)					\
+  (offsetof(status_context_t, lanes) + (lane) * sizeof(status_lane_t)	\
+   + offsetof(status_lane_t, field))
+
+/* the request is recorded when its pool is destroyed */
+static void status_request_begin(ngx_http_request_t *r,
+				 ngx_http_sagittarius_conf_t *sg_conf)
+{
+  ngx_pool_cleanup_t *cln;
+  status_request_t *s;
+
+  if (status_sh == NULL) return;
+  cln = ngx_pool_cleanup_add(r->pool, sizeof(status_request_t));
+  if (cln == NULL) return;
+  s = cln->data;
+  s->request = r;
+  s->metrics = status_metrics(sg_conf);
+  s->start = now_us();
+  ngx_atomic_fetch_add(&s->metrics->requests, 1);
+  ngx_atomic_fetch_add(&s->metrics->in_flight, 1);
+  cln->handler = status_request_done;
+}
+
+static void status_add(ngx_http_sagittarius_conf_t *sg_conf,
+		       size_t offset, ngx_atomic_int_t n)
+{
+  if (status_sh == NULL) return;
+  ngx_atomic_fetch_add((ngx_atomic_t *)((char *)status_metrics(sg_conf)
+					+ offset), n);
+}
+
+#define status_escape(p, cn)						\
+  (u_char *)ngx_escape_json((p), (cn)->sn.str.data, (cn)->sn.str.len)
+
+#define PROMETHEUS_FAMILY(p, name, type)				\
+  ngx_sprintf((p), "# TYPE sagittarius_" name " " type "\n")
+
+static u_char *status_prometheus(u_char *p)
+{
+  static const char *classes[] = { "other", "1xx", "2xx", "3xx", "4xx", "5xx" };
+  status_context_t *m;
+  ngx_uint_t i, j;
+
+#define PROMETHEUS_COUNTER(name, field, type)				\
+  p = PROMETHEUS_FAMILY(p, name, type);					\
+  for (i = 0; i < status_count; i++) {					\
+    p = ngx_sprintf(p, "sagittarius_" name "{context=\"");		\
+    p = status_escape(p, status_nodes[i]);				\
+    p = ngx_sprintf(p, "\"} %uA\n",					\
+		    (ngx_atomic_uint_t)status_sh->contexts[i].field);	\
+  }
+  PROMETHEUS_COUNTER("requests_total", requests, "counter");
+  PROMETHEUS_COUNTER("cache_hits_total", cache_hits, "counter");
+  PROMETHEUS_COUNTER("in_flight", in_flight, "gauge");
+  PROMETHEUS_COUNTER("thread_pool_queued", queued, "gauge");
+  PROMETHEUS_COUNTER("thread_pool_rejected_total", rejected, "counter");
+#undef PROMETHEUS_COUNTER
+
+  p = PROMETHEUS_FAMILY(p, "thread_pool_queue_seconds", "summary");
+  for (i = 0; i < status_count; i++) {
+    m = &status_sh->contexts[i];
+    for (j = 0; j < LANES; j++) {
+      p = ngx_sprintf(p, "sagittarius_thread_pool_queue_seconds_sum"
+		      "{context=\"");
+      p = status_escape(p, status_nodes[i]);
+      p = ngx_sprintf(p, "\",lane=\"%s\"} %uA.%06uA\n", lane_names[j],
+		      (ngx_atomic_uint_t)m->lanes[j].queue_time / 1000000,
+		      (ngx_atomic_uint_t)m->lanes[j].queue_time % 1000000);
+      p = ngx_sprintf(p, "sagittarius_thread_pool_queue_seconds_count"
+		      "{context=\"");
+      p = status_escape(p, status_nodes[i]);
+      p = ngx_sprintf(p, "\",lane=\"%s\"} %uA\n", lane_names[j],
+		      (ngx_atomic_uint_t)m->lanes[j].started);
+    }
+  }
+
+  p = PROMETHEUS_FAMILY(p, "responses_total", "counter");
+  for (i = 0; i < status_count; i++) {
+    for (j = 0; j < 6; j++) {
+      p = ngx_sprintf(p, "sagittarius_responses_total{context=\"");
+      p = status_escape(p, status_nodes[i]);
+      p = ngx_sprintf(p, "\",status=\"%s\"} %uA\n", classes[j],
+		      (ngx_atomic_uint_t)status_sh->contexts[i].responses[j]);
+    }
+  }
+
+  p = PROMETHEUS_FAMILY(p, "request_duration_seconds", "histogram");
+  for (i = 0; i < status_count; i++) {
+    ngx_atomic_uint_t count = 0;
+    m = &status_sh->contexts[i];
+    for (j = 0; j < STATUS_BUCKETS; j++) {
+      count += m->latency[j];
+      p = ngx_sprintf(p, "sagittarius_request_duration_seconds_bucket"
+		      "{context=\"");
+      p = status_escape(p, status_nodes[i]);
+      if (j == STATUS_BUCKETS - 1) {
+	p = ngx_sprintf(p, "\",le=\"+Inf\"} %uA\n", count);
+      } else {
+	uint64_t b = status_bound(j);
+	p = ngx_sprintf(p, "\",le=\"%uL.%06uL\"} %uA\n",
+			b / 1000000, b % 1000000, count);
+      }
+    }
+    p = ngx_sprintf(p, "sagittarius_request_duration_seconds_sum"
+		    "{context=\"");
+    p = status_escape(p, status_nodes[i]);
+    p = ngx_sprintf(p, "\"} %uA.%06uA\n",
+		    (ngx_atomic_uint_t)m->latency_sum / 1000000,
+		    (ngx_atomic_uint_t)m->latency_sum % 1000000);
+    p = ngx_sprintf(p, "sagittarius_request_duration_seconds_count"
+		    "{context=\"");
+    p = status_escape(p, status_nodes[i]);
+    p = ngx_sprintf(p, "\"} %uA\n", count);
+  }
+
+#define PROMETHEUS_WORKER(name, type, fmt, ...)				\
+  p = PROMETHEUS_FAMILY(p, name, type);					\
+  for (i = 0; i < STATUS_MAX_WORKERS; i++) {				\
+    status_worker_t *w = &status_sh->workers[i];			\
+    if (w->pid == 0) continue;						\
+    p = ngx_sprintf(p, "sagittarius_" name "{worker=\"%ui\"} " fmt "\n", \
+		    i, __VA_ARGS__);					\
+  }
+  PROMETHEUS_WORKER("gc_heap_bytes", "gauge", "%uA",
+		    (ngx_atomic_uint_t)w->heap_size);
+  PROMETHEUS_WORKER("gc_free_bytes", "gauge", "%uA",
+		    (ngx_atomic_uint_t)w->free_bytes);
+  PROMETHEUS_WORKER("gc_collections_total", "counter", "%uA",
+		    (ngx_atomic_uint_t)w->collections);
+  PROMETHEUS_WORKER("gc_pause_seconds_total", "counter", "%uA.%06uA",
+		    (ngx_atomic_uint_t)w->pause_sum / 1000000,
+		    (ngx_atomic_uint_t)w->pause_sum % 1000000);
+  PROMETHEUS_WORKER("gc_pause_max_seconds", "gauge", "%uA.%06uA",
+		    (ngx_atomic_uint_t)w->pause_max / 1000000,
+		    (ngx_atomic_uint_t)w->pause_max % 1000000);
+  PROMETHEUS_WORKER("executor_threads", "gauge", "%uA",
+		    (ngx_atomic_uint_t)w->executor_threads);
+  PROMETHEUS_WORKER("executor_steals_total", "counter", "%uA",
+		    (ngx_atomic_uint_t)w->executor_steals);
+#undef PROMETHEUS_WORKER
+  return p;
 }
 
-static ngx_rbtree_t       nginx_contexts;
-static ngx_rbtree_node_t  sentinel;
-typedef struct
+static u_char *status_json(u_char *p)
 {
-  ngx_str_node_t sn;
-  SgObject       context;
-  ngx_http_sagittarius_conf_t *conf; /* temporary storage */
-} nginx_context_node_t;
+  status_context_t *m;
+  status_worker_t *w;
+  ngx_uint_t i, j, first;
+
+  p = ngx_sprintf(p, "{\"contexts\":[");
+  for (i = 0; i < status_count; i++) {
+    m = &status_sh->contexts[i];
+    p = ngx_sprintf(p, "%s{\"context\":\"", i == 0 ? "" : ",");
+    p = status_escape(p, status_nodes[i]);
+    p = ngx_sprintf(p, "\",\"requests\":%uA,\"cache_hits\":%uA,"
+		    "\"in_flight\":%uA,\"queued\":%uA,\"rejected\":%uA,",
+		    (ngx_atomic_uint_t)m->requests,
+		    (ngx_atomic_uint_t)m->cache_hits,
+		    (ngx_atomic_uint_t)m->in_flight,
+		    (ngx_atomic_uint_t)m->queued,
+		    (ngx_atomic_uint_t)m->rejected);
+    p = ngx_sprintf(p, "\"responses\":{\"1xx\":%uA,\"2xx\":%uA,\"3xx\":%uA,"
+		    "\"4xx\":%uA,\"5xx\":%uA,\"other\":%uA},",
+		    (ngx_atomic_uint_t)m->responses[1],
+		    (ngx_atomic_uint_t)m->responses[2],
+		    (ngx_atomic_uint_t)m->responses[3],
+		    (ngx_atomic_uint_t)m->responses[4],
+		    (ngx_atomic_uint_t)m->responses[5],
+		    (ngx_atomic_uint_t)m->responses[0]);
+    p = ngx_sprintf(p, "\"lanes\":{");
+    for (j = 0; j < LANES; j++) {
+      p = ngx_sprintf(p, "%s\"%s\":{\"started\":%uA,\"queue_time_us\":%uA}",
+		      j == 0 ? "" : ",", lane_names[j],
+		      (ngx_atomic_uint_t)m->lanes[j].started,
+		      (ngx_atomic_uint_t)m->lanes[j].queue_time);
+    }
+    p = ngx_sprintf(p, "},");
+    /* the last count is the overflow, so counts has one more element */
+    p = ngx_sprintf(p, "\"latency\":{\"sum_us\":%uA,\"bounds_us\":[",
+		    (ngx_atomic_uint_t)m->latency_sum);
+    for (j = 0; j < STATUS_BUCKETS - 1; j++) {
+      p = ngx_sprintf(p, "%s%uL", j == 0 ? "" : ",", status_bound(j));
+    }
+    p = ngx_sprintf(p, "],\"counts\":[");
+    for (j = 0; j < STATUS_BUCKETS; j++) {
+      p = ngx_sprintf(p, "%s%uA", j == 0 ? "" : ",",
+		      (ngx_atomic_uint_t)m->latency[j]);
+    }
+    p = ngx_sprintf(p, "]}}");
+  }
+  p = ngx_sprintf(p, "],\"workers\":[");
+  for (i = 0, first = 1; i < STATUS_MAX_WORKERS; i++) {
+    w = &status_sh->workers[i];
+    if (w->pid == 0) continue;
+    p = ngx_sprintf(p, "%s{\"worker\":%ui,\"pid\":%uA,\"heap_size\":%uA,"
+		    "\"free_bytes\":%uA,\"collections\":%uA,"
+		    "\"pause_sum_us\":%uA,\"pause_max_us\":%uA,"
+		    "\"executor_threads\":%uA,\"executor_steals\":%uA}",
+		    first ? "" : ",", i,
+		    (ngx_atomic_uint_t)w->pid,
+		    (ngx_atomic_uint_t)w->heap_size,
+		    (ngx_atomic_uint_t)w->free_bytes,
+		    (ngx_atomic_uint_t)w->collections,
+		    (ngx_atomic_uint_t)w->pause_sum,
+		    (ngx_atomic_uint_t)w->pause_max,
+		    (ngx_atomic_uint_t)w->executor_threads,
+		    (ngx_atomic_uint_t)w->executor_steals);
+    first = 0;
+  }
+  p = ngx_sprintf(p, "]}\n");
+  return p;
+}
 
-static void call_cleanup(ngx_cycle_t *cycle, ngx_rbtree_node_t *node)
+static ngx_int_t ngx_http_sagittarius_status_handler(ngx_http_request_t *r)
 {
-  nginx_context_node_t *cn;
-  if (node != nginx_contexts.sentinel) {
-    cn = (nginx_context_node_t *)node;
-    if (!SG_FALSEP(cn->context) &&
-	!SG_FALSEP(SG_NGINX_CONTEXT(cn->context)->cleanup) &&
-	!SG_UNBOUNDP(SG_NGINX_CONTEXT(cn->context)->cleanup)) {
-      ngx_log_error(NGX_LOG_DEBUG, cycle->log, 0,
-		    "'sagittarius': Cleaning up context '%V'", &cn->sn.str);
-      SG_UNWIND_PROTECT {
-	Sg_Apply1(SG_NGINX_CONTEXT(cn->context)->cleanup, cn->context);
-      } SG_WHEN_ERROR {
-	ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
-		      "'sagittarius': Failed to call cleanup procedure");
-      } SG_END_PROTECT;
-    } else {
-      ngx_log_error(NGX_LOG_DEBUG, cycle->log, 0,
-		    "'sagittarius': Skip cleaning up context '%V'",
-		    &cn->sn.str);
+  ngx_http_sagittarius_conf_t *sg_conf;
+  ngx_uint_t format;
+  ngx_str_t arg;
+  ngx_chain_t out;
+  ngx_buf_t *b;
+  ngx_int_t rc;
+  size_t len;
+
+  if (!(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD))) {
+    return NGX_HTTP_NOT_ALLOWED;
+  }
+  rc = ngx_http_discard_request_body(r);
+  if (rc != NGX_OK) return rc;
+  if (status_sh == NULL) return NGX_HTTP_SERVICE_UNAVAILABLE;
+
+  sg_conf = ngx_http_get_module_loc_conf(r, ngx_http_sagittarius_module);
+  format = sg_conf->status_format;
+  if (ngx_http_arg(r, (u_char *)"format", 6, &arg) == NGX_OK) {
+    if (arg.len == 4 && ngx_strncmp(arg.data, "json", 4) == 0) {
+      format = STATUS_JSON;
+    } else if (arg.len == 10 && ngx_strncmp(arg.data, "prometheus", 10) == 0) {
+      format = STATUS_PROMETHEUS;
     }
-    call_cleanup(cycle, node->left);
-    call_cleanup(cycle, node->right);
   }
+  status_update_gc();
+
+  /* a line is at most 128 bytes plus the escaped path */
+  len = (status_count * (STATUS_BUCKETS + 16 + LANES * 2)
+	 + STATUS_MAX_WORKERS * 7 + 16)
+    * (128 + status_max_path * 6);
+  b = ngx_create_temp_buf(r->pool, len);
+  if (b == NULL) return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  if (format == STATUS_JSON) {
+    b->last = status_json(b->last);
+    ngx_str_set(&r->headers_out.content_type, "application/json");
+  } else {
+    b->last = status_prometheus(b->last);
+    ngx_str_set(&r->headers_out.content_type, "text/plain; version=0.0.4");
+  }
+  r->headers_out.content_type_len = r->headers_out.content_type.len;
+  r->headers_out.status = NGX_HTTP_OK;
+  r->headers_out.content_length_n = b->last - b->pos;
+  b->last_buf = (r == r->main);
+  b->last_in_chain = 1;
+
+  rc = ngx_http_send_header(r);
+  if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) return rc;
+
+  out.buf = b;
+  out.next = NULL;
+  return ngx_http_output_filter(r, &out);
 }
 
-static void ngx_http_sagittarius_exit_process(ngx_cycle_t *cycle)
+/* $sagittarius_*_time, in seconds with microsecond resolution */
+static ngx_int_t timing_time_variable(ngx_http_request_t *r,
+				      ngx_http_variable_value_t *v,
+				      uintptr_t data)
 {
-  /* go through the rbtree */
-  /* http://nginx.org/en/docs/dev/development_guide.html#red_black_tree */
-  ngx_log_error(NGX_LOG_DEBUG, cycle->log, 0, "'sagittarius': Cleaning up");
-  call_cleanup(cycle, nginx_contexts.root);
+  request_timing_t *t = ngx_http_get_module_ctx(r, ngx_http_sagittarius_module);
+  uint64_t us;
+  u_char *p;
+
+  if (t == NULL) {
+    v->not_found = 1;
+    return NGX_OK;
+  }
+  p = ngx_pnalloc(r->pool, NGX_INT64_LEN + 8);
+  if (p == NULL) return NGX_ERROR;
+  us = *(uint64_t *)((char *)t + data);
+  v->len = ngx_sprintf(p, "%uL.%06uL", us / 1000000, us % 1000000) - p;
+  v->valid = 1;
+  v->no_cacheable = 0;
+  v->not_found = 0;
+  v->data = p;
+  return NGX_OK;
+}
+
+static ngx_int_t timing_bytes_variable(ngx_http_request_t *r,
+				       ngx_http_variable_value_t *v,
+				       uintptr_t data)
+{
+  request_timing_t *t = ngx_http_get_module_ctx(r, ngx_http_sagittarius_module);
+  u_char *p;
+
+  if (t == NULL) {
+    v->not_found = 1;
+    return NGX_OK;
+  }
+  p = ngx_pnalloc(r->pool, NGX_OFF_T_LEN);
+  if (p == NULL) return NGX_ERROR;
+  v->len = ngx_sprintf(p, "%O", t->response_bytes) - p;
+  v->valid = 1;
+  v->no_cacheable = 0;
+  v->not_found = 0;
+  v->data = p;
+  return NGX_OK;
 }
 
+static ngx_http_variable_t timing_variables[] = {
+  { ngx_string("sagittarius_context_time"), NULL, timing_time_variable,
+    offsetof(request_timing_t, context_time), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+  { ngx_string("sagittarius_handler_time"), NULL, timing_time_variable,
+    offsetof(request_timing_t, handler_time), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+  { ngx_string("sagittarius_queue_time"), NULL, timing_time_variable,
+    offsetof(request_timing_t, queue_time), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+  { ngx_string("sagittarius_gc_time"), NULL, timing_time_variable,
+    offsetof(request_timing_t, gc_time), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+  { ngx_string("sagittarius_response_bytes"), NULL, timing_bytes_variable,
+    0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+  ngx_http_null_variable
+};
+
 static ngx_int_t ngx_http_sagittarius_preconfiguration(ngx_conf_t *cf)
 {
+  ngx_http_variable_t *var, *v;
+
+  for (v = timing_variables; v->name.len; v++) {
+    var = ngx_http_add_variable(cf, &v->name, v->flags);
+    if (var == NULL) return NGX_ERROR;
+    var->get_handler = v->get_handler;
+    var->data = v->data;
+  }
+
   ngx_rbtree_init(&nginx_contexts, &sentinel, ngx_str_rbtree_insert_value);
-  return NGX_OK;
+  shared_dicts = NULL;
+  executors = NULL;
+  status_enabled = 0;
+  status_sh = NULL;
+  return init_response_fields(cf->log);
 }
 
 
 static ngx_int_t sagittarius_precontent_handler(ngx_http_request_t *r);
+static executor_t *find_executor(ngx_str_t *name);
 
 static void init_thread_pool(ngx_conf_t *cf, ngx_rbtree_node_t *node)
 {
@@ -1465,7 +5407,13 @@ static void init_thread_pool(ngx_conf_t *cf, ngx_rbtree_node_t *node)
     ngx_str_t nstr = ngx_null_string;
     cn = (nginx_context_node_t *)node;
 
+    executor_t *ex = NULL;
+
     if (cn->conf->pool_name.len != 0) {
+      ex = find_executor(&cn->conf->pool_name);
+    }
+    cn->weights = ex ? ex->weights : lane_weights;
+    if (cn->conf->pool_name.len != 0 && ex == NULL) {
       ngx_thread_pool_t *tp;
 
       tp = ngx_thread_pool_add(cf, &cn->conf->pool_name);
@@ -1501,9 +5449,93 @@ static ngx_int_t ngx_http_sagittarius_postconfiguration(ngx_conf_t *cf)
 
   /* initialise the thread pool */
   init_thread_pool(cf, nginx_contexts.root);
+  if (status_enabled && init_status_zone(cf) != NGX_OK) {
+    ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+		  "'sagittarius': Failed to add the status zone");
+    return NGX_ERROR;
+  }
   return NGX_OK;
 }
 
+/* sagittarius_shared_dict name size; */
+static char* ngx_http_sagittarius_shared_dict(ngx_conf_t *cf,
+					      ngx_command_t *cmd,
+					      void *conf)
+{
+  ngx_str_t *value = cf->args->elts;
+  shared_dict_t *dict, **dicts, **slot;
+  ngx_shm_zone_t *zone;
+  ngx_uint_t i;
+  ssize_t size;
+
+  size = ngx_parse_size(&value[2]);
+  if (size == NGX_ERROR || size < (ssize_t)(8 * ngx_pagesize)) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+		       "'sagittarius': invalid shared dict size \"%V\", "
+		       "at least %uz is required", &value[2], 8 * ngx_pagesize);
+    return NGX_CONF_ERROR;
+  }
+  if (shared_dicts == NULL) {
+    shared_dicts = ngx_array_create(cf->pool, 4, sizeof(shared_dict_t *));
+    if (shared_dicts == NULL) return NGX_CONF_ERROR;
+  }
+  dicts = shared_dicts->elts;
+  for (i = 0; i < shared_dicts->nelts; i++) {
+    if (dicts[i]->name.len == value[1].len &&
+	ngx_strncmp(dicts[i]->name.data, value[1].data, value[1].len) == 0) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			 "'sagittarius': duplicate shared dict \"%V\"",
+			 &value[1]);
+      return NGX_CONF_ERROR;
+    }
+  }
+
+  dict = ngx_pcalloc(cf->pool, sizeof(shared_dict_t));
+  slot = ngx_array_push(shared_dicts);
+  if (dict == NULL || slot == NULL) return NGX_CONF_ERROR;
+  dict->name = value[1];
+  zone = ngx_shared_memory_add(cf, &value[1], size,
+			       &ngx_http_sagittarius_module);
+  if (zone == NULL) return NGX_CONF_ERROR;
+  if (zone->data) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+		       "'sagittarius': zone \"%V\" is already used",
+		       &value[1]);
+    return NGX_CONF_ERROR;
+  }
+  zone->init = shared_dict_init_zone;
+  zone->data = dict;
+  *slot = dict;
+  return NGX_CONF_OK;
+}
+
+/* sagittarius_status [prometheus|json]; */
+static char* ngx_http_sagittarius_status(ngx_conf_t *cf,
+					 ngx_command_t *cmd,
+					 void *conf)
+{
+  ngx_http_sagittarius_conf_t *sg_conf = conf;
+  ngx_http_core_loc_conf_t *clcf;
+  ngx_str_t *value = cf->args->elts;
+
+  if (cf->args->nelts == 2) {
+    if (ngx_strcmp(value[1].data, "json") == 0) {
+      sg_conf->status_format = STATUS_JSON;
+    } else if (ngx_strcmp(value[1].data, "prometheus") == 0) {
+      sg_conf->status_format = STATUS_PROMETHEUS;
+    } else {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			 "'sagittarius': invalid status format \"%V\"",
+			 &value[1]);
+      return NGX_CONF_ERROR;
+    }
+  }
+  clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+  clcf->handler = ngx_http_sagittarius_status_handler;
+  status_enabled = 1;
+  return NGX_CONF_OK;
+}
+
 static char* ngx_http_sagittarius_block(ngx_conf_t *cf,
 					ngx_command_t *cmd,
 					void *conf)
@@ -1515,6 +5547,7 @@ static char* ngx_http_sagittarius_block(ngx_conf_t *cf,
   ngx_http_sagittarius_conf_t *sg_conf;
   uint32_t                     hash;
   nginx_context_node_t        *node;
+  ngx_uint_t                   i;
   ngx_log_error(NGX_LOG_DEBUG, cf->log, 0,
 		"'sagittarius': Handling Sagittarius configuration");
 
@@ -1535,12 +5568,22 @@ static char* ngx_http_sagittarius_block(ngx_conf_t *cf,
     node->sn.str = clcf->name;
     node->context = SG_FALSE;
     node->conf = sg_conf;	/* for thread pool */
+    node->index = 0;		/* assigned by init_status_zone */
+    node->posted = 0;
+    node->queued = 0;
+    for (i = 0; i < LANES; i++) {
+      ngx_queue_init(&node->waiting[i]);
+      node->current[i] = 0;
+    }
+    node->nwaiting = 0;
+    node->weights = lane_weights; /* set by init_thread_pool */
     /* 
        the sn.node is the top most location of the struct. thus inserthing
        this also means inserting the node itself.
      */
     ngx_rbtree_insert(&nginx_contexts, &node->sn.node);
   }
+  sg_conf->node = node;
   
   value = cf->args->elts;
   sg_conf->procedure = (ngx_str_t)value[1];
@@ -1708,6 +5751,175 @@ static char* ngx_http_sagittarius(ngx_conf_t *cf,
       return NGX_CONF_ERROR;
     }
     sg_conf->pool_name = value[1];
+  } else if (ngx_strcmp(value[0].data, "preload") == 0) {
+    if (cf->args->nelts != 2) {
+      ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+		    "'sagittarius': 'preload' must contain "
+		    "1 element (on or off)");
+      return NGX_CONF_ERROR;
+    }
+    if (ngx_strcasecmp(value[1].data, (u_char *)"on") == 0) {
+      sg_conf->preload = 1;
+    } else if (ngx_strcasecmp(value[1].data, (u_char *)"off") == 0) {
+      sg_conf->preload = 0;
+    } else {
+      ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+		    "'sagittarius': 'preload' must be either on or off "
+		    "(%V)", &value[1]);
+      return NGX_CONF_ERROR;
+    }
+  } else if (ngx_strcmp(value[0].data, "warmup") == 0) {
+    if (cf->args->nelts != 2) {
+      ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+		    "'sagittarius': 'warmup' must contain "
+		    "1 element (procedure)");
+      return NGX_CONF_ERROR;
+    }
+    sg_conf->warmup_proc = value[1];
+  } else if (ngx_strcmp(value[0].data, "vm_pool_size") == 0) {
+    if (cf->args->nelts != 2) {
+      ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+		    "'sagittarius': 'vm_pool_size' must contain "
+		    "1 element (size)");
+      return NGX_CONF_ERROR;
+    }
+    sg_conf->vm_pool_size = ngx_atoi(value[1].data, value[1].len);
+    if (sg_conf->vm_pool_size == NGX_ERROR) {
+      ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+		    "'sagittarius': invalid 'vm_pool_size' %V", &value[1]);
+      return NGX_CONF_ERROR;
+    }
+  } else if (ngx_strcmp(value[0].data, "max_concurrency") == 0 ||
+	     ngx_strcmp(value[0].data, "max_queue") == 0) {
+    ngx_uint_t *limit = ngx_strcmp(value[0].data, "max_queue") == 0
+      ? &sg_conf->max_queue
+      : &sg_conf->max_concurrency;
+    ngx_int_t n;
+    if (cf->args->nelts != 2) {
+      ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+		    "'sagittarius': '%V' must contain 1 element (number)",
+		    &value[0]);
+      return NGX_CONF_ERROR;
+    }
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR) {
+      ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+		    "'sagittarius': invalid '%V' %V", &value[0], &value[1]);
+      return NGX_CONF_ERROR;
+    }
+    *limit = (ngx_uint_t)n;
+  } else if (ngx_strcmp(value[0].data, "queue_timeout") == 0) {
+    ngx_msec_t timeout;
+    if (cf->args->nelts != 2) {
+      ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+		    "'sagittarius': 'queue_timeout' must contain "
+		    "1 element (time)");
+      return NGX_CONF_ERROR;
+    }
+    timeout = ngx_parse_time(&value[1], 0);
+    if (timeout == (ngx_msec_t)NGX_ERROR) {
+      ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+		    "'sagittarius': invalid 'queue_timeout' %V", &value[1]);
+      return NGX_CONF_ERROR;
+    }
+    sg_conf->queue_timeout = timeout;
+  } else if (ngx_strcmp(value[0].data, "reject_status") == 0) {
+    ngx_int_t status;
+    if (cf->args->nelts != 2) {
+      ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+		    "'sagittarius': 'reject_status' must contain "
+		    "1 element (status)");
+      return NGX_CONF_ERROR;
+    }
+    status = ngx_atoi(value[1].data, value[1].len);
+    if (status < 400 || status > 599) {
+      ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+		    "'sagittarius': 'reject_status' must be between "
+		    "400 and 599 (%V)", &value[1]);
+      return NGX_CONF_ERROR;
+    }
+    sg_conf->reject_status = (ngx_uint_t)status;
+  } else if (ngx_strcmp(value[0].data, "retry_after") == 0) {
+    ngx_msec_t retry;
+    if (cf->args->nelts != 2) {
+      ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+		    "'sagittarius': 'retry_after' must contain "
+		    "1 element (time)");
+      return NGX_CONF_ERROR;
+    }
+    retry = ngx_parse_time(&value[1], 0);
+    if (retry == (ngx_msec_t)NGX_ERROR) {
+      ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+		    "'sagittarius': invalid 'retry_after' %V", &value[1]);
+      return NGX_CONF_ERROR;
+    }
+    /* the header is in seconds, e.g. 500ms is sent as 1 */
+    sg_conf->retry_after = (time_t)((retry + 999) / 1000);
+  } else if (ngx_strcmp(value[0].data, "priority") == 0) {
+    ngx_http_compile_complex_value_t ccv;
+    ngx_int_t lane;
+    if (cf->args->nelts != 2) {
+      ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+		    "'sagittarius': 'priority' must contain "
+		    "1 element (high, normal, low or variable)");
+      return NGX_CONF_ERROR;
+    }
+    if (ngx_http_script_variables_count(&value[1]) == 0) {
+      lane = lane_by_name(&value[1]);
+      if (lane == NGX_ERROR) {
+	ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+		      "'sagittarius': 'priority' must be either high, normal "
+		      "or low (%V)", &value[1]);
+	return NGX_CONF_ERROR;
+      }
+      sg_conf->priority = (ngx_uint_t)lane;
+    } else {
+      sg_conf->priority_value =
+	ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+      if (sg_conf->priority_value == NULL) return NGX_CONF_ERROR;
+      ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+      ccv.cf = cf;
+      ccv.value = &value[1];
+      ccv.complex_value = sg_conf->priority_value;
+      if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+	return NGX_CONF_ERROR;
+      }
+    }
+  } else if (ngx_strcmp(value[0].data, "streaming") == 0) {
+    if (cf->args->nelts != 2) {
+      ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+		    "'sagittarius': 'streaming' must contain "
+		    "1 element (on or off)");
+      return NGX_CONF_ERROR;
+    }
+    if (ngx_strcasecmp(value[1].data, (u_char *)"on") == 0) {
+      sg_conf->streaming = 1;
+    } else if (ngx_strcasecmp(value[1].data, (u_char *)"off") == 0) {
+      sg_conf->streaming = 0;
+    } else {
+      ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+		    "'sagittarius': 'streaming' must be either on or off "
+		    "(%V)", &value[1]);
+      return NGX_CONF_ERROR;
+    }
+  } else if (ngx_strcmp(value[0].data, "large_write_threshold") == 0) {
+    ssize_t size;
+    if (cf->args->nelts != 2) {
+      ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+		    "'sagittarius': 'large_write_threshold' must contain "
+		    "1 element (size)");
+      return NGX_CONF_ERROR;
+    }
+    size = ngx_parse_size(&value[1]);
+    if (size == NGX_ERROR) {
+      ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+		    "'sagittarius': invalid 'large_write_threshold' %V",
+		    &value[1]);
+      return NGX_CONF_ERROR;
+    }
+    sg_conf->large_write = (size_t)size;
+  } else if (ngx_strcmp(value[0].data, "cache") == 0) {
+    return parse_response_cache(cf, sg_conf);
   } else {
     ngx_log_error(NGX_LOG_ERR, cf->log, 0,
 		  "'sagittarius': unknown directive %V", &value[0]);
@@ -1731,6 +5943,21 @@ static void* ngx_http_sagittarius_create_loc_conf(ngx_conf_t *cf)
   conf->parameters = NULL;
   conf->filters = NULL;
   conf->pool_name = nstr;
+  conf->streaming = 0;
+  conf->large_write = LARGE_WRITE_THRESHOLD;
+  conf->vm_pool_size = VM_POOL_SIZE;
+  conf->max_concurrency = 0;
+  conf->max_queue = NGX_CONF_UNSET_UINT;
+  conf->queue_timeout = 0;
+  conf->reject_status = NGX_HTTP_SERVICE_UNAVAILABLE;
+  conf->retry_after = 1;
+  conf->priority = LANE_NORMAL;
+  conf->priority_value = NULL;
+  conf->preload = 0;
+  conf->warmup_proc = nstr;
+  conf->cache = NULL;
+  conf->status_format = 0;	/* STATUS_PROMETHEUS */
+  conf->node = NULL;		/* set by the sagittarius block */
   return conf;
 }
 
@@ -1849,21 +6076,28 @@ SgObject get_filter_applied_procedure(SgObject library,
   return next;
 }
 
-static SgObject make_nginx_context(ngx_http_request_t *r)
+static ngx_int_t init_base_library(ngx_log_t *log);
+static SgObject setup_load_path(volatile SgVM *vm,
+				ngx_log_t *log,
+				ngx_http_sagittarius_conf_t *sg_conf);
+
+static SgObject make_nginx_context(ngx_str_t *path,
+				   ngx_http_sagittarius_conf_t *sg_conf,
+				   ngx_log_t *log)
 {
-  ngx_http_core_loc_conf_t *clcf;
-  ngx_http_sagittarius_conf_t *sg_conf;
   ngx_array_t *params;
   ngx_keyval_t *value;
   ngx_uint_t i;
   SgNginxContext *c = SG_NEW(SgNginxContext);
   SG_SET_CLASS(c, SG_CLASS_NGINX_CONTEXT);
 
-  clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-  sg_conf = ngx_http_get_module_loc_conf(r, ngx_http_sagittarius_module);
-  c->path = ngx_str_to_string(&clcf->name);
+  c->path = ngx_str_to_string(path);
   c->cleanup = SG_FALSE;
   c->procedure = SG_FALSE;
+  c->loadPath = SG_NIL;
+  c->vms = c->idle_vms = NULL;
+  c->vm_count = c->idle_count = 0;
+  c->vm_max = (int)sg_conf->vm_pool_size;
   params = sg_conf->parameters;
   if (params) {
     c->parameters = Sg_MakeHashTableSimple(SG_HASH_STRING, params->nelts);
@@ -1882,31 +6116,44 @@ static SgObject make_nginx_context(ngx_http_request_t *r)
     Sg_FindLibrary(Sg_Intern(ngx_str_to_string(&sg_conf->library)), FALSE);
   if (!SG_FALSEP(c->library)) {
     if (sg_conf->cleanup_proc.len != 0) {
-      retrieve_procedure(c->cleanup, c->library, r->connection->log,
+      retrieve_procedure(c->cleanup, c->library, log,
 			 &sg_conf->cleanup_proc);
     }
     if (sg_conf->init_proc.len != 0) {
       volatile SgObject p;
-      retrieve_procedure(p, c->library, r->connection->log,
+      retrieve_procedure(p, c->library, log,
 			 &sg_conf->init_proc);
       if (!SG_UNBOUNDP(p)) {
-	ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0,
+	ngx_log_error(NGX_LOG_DEBUG, log, 0,
 		      "'sagittarius': calling init procedure '%V'",
 		      &sg_conf->init_proc);
 	SG_UNWIND_PROTECT {
 	  Sg_Apply1(p, c);
 	} SG_WHEN_ERROR {
-	  ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+	  ngx_log_error(NGX_LOG_ERR, log, 0,
 			"'sagittarius': Failed to call init procedure");
 	} SG_END_PROTECT;
       }
     }
-    c->procedure = get_filter_applied_procedure(c->library,
-						r->connection->log,
-						sg_conf);
+    c->procedure = get_filter_applied_procedure(c->library, log, sg_conf);
+    if (sg_conf->warmup_proc.len != 0 && SG_PROCEDUREP(c->procedure)) {
+      volatile SgObject p;
+      retrieve_procedure(p, c->library, log, &sg_conf->warmup_proc);
+      if (!SG_UNBOUNDP(p)) {
+	ngx_log_error(NGX_LOG_DEBUG, log, 0,
+		      "'sagittarius': calling warmup procedure '%V'",
+		      &sg_conf->warmup_proc);
+	SG_UNWIND_PROTECT {
+	  Sg_Apply1(p, c);
+	} SG_WHEN_ERROR {
+	  ngx_log_error(NGX_LOG_ERR, log, 0,
+			"'sagittarius': Failed to call warmup procedure");
+	} SG_END_PROTECT;
+      }
+    }
   } else {
     /* log it */
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+    ngx_log_error(NGX_LOG_ERR, log, 0,
 		  "'sagittarius': Web application library '%V' not found.",
 		  &sg_conf->library);
   }
@@ -1915,59 +6162,83 @@ static SgObject make_nginx_context(ngx_http_request_t *r)
   return SG_OBJ(c);
 }
 
-static int has_context(ngx_http_request_t *r)
+/*
+  Creates the context with the load path specified by the configuration.
+  The load path is kept in the context, so requests only need to swap
+  the one of the VM.
+ */
+static SgObject create_nginx_context(ngx_str_t *path,
+				     ngx_http_sagittarius_conf_t *sg_conf,
+				     ngx_log_t *log)
 {
-  ngx_http_core_loc_conf_t *clcf;
-  nginx_context_node_t     *node;
-  uint32_t                  hash;
-
-  clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-  hash = ngx_crc32_long(clcf->name.data, clcf->name.len);
-  node = (nginx_context_node_t *)
-    ngx_str_rbtree_lookup(&nginx_contexts, &clcf->name, hash);
-
-  if (!node) return FALSE;	/* ??? */
-  return !SG_FALSEP(node->context);
+  volatile SgVM *vm = Sg_VM();
+  SgObject saved, loadPath, context = SG_UNDEF;
+
+  saved = setup_load_path(vm, log, sg_conf);
+  loadPath = vm->loadPath;
+  /* If the context is not there, this may not be loaded either. */
+  if (!SG_UNDEFP(nginx_dispatch) || init_base_library(log) == NGX_OK) {
+    context = make_nginx_context(path, sg_conf, log);
+    SG_NGINX_CONTEXT(context)->loadPath = loadPath;
+  }
+  vm->loadPath = saved;
+  return context;
 }
 
 static SgObject get_context(ngx_http_request_t *r)
 {
-  ngx_http_core_loc_conf_t *clcf;
-  nginx_context_node_t     *node;
-  uint32_t                  hash;
+  ngx_http_sagittarius_conf_t *sg_conf;
+  nginx_context_node_t        *node;
+  SgObject                     context;
 
-  clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-  hash = ngx_crc32_long(clcf->name.data, clcf->name.len);
-  node = (nginx_context_node_t *)
-    ngx_str_rbtree_lookup(&nginx_contexts, &clcf->name, hash);
-  
-  if (!node) {
-    /* this should never happend but in case of something overlooked */
-    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
-		  "'sagittarius': Unknown context node");
-    /* we create fresh ones */
-    return make_nginx_context(r);
-  }
-  /* okay it's already inserted :) */
-  if (!SG_FALSEP(node->context)) return node->context;
+  sg_conf = ngx_http_get_module_loc_conf(r, ngx_http_sagittarius_module);
+  node = sg_conf->node;
+  /* okay it's already created :) */
+  context = context_load(node);
+  if (!SG_FALSEP(context)) return context;
 
-  ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0,
-		"'sagittarius': Creating a context of %V", &clcf->name);
   if (ngx_thread_mutex_lock(&global_lock, r->connection->log) != NGX_OK) {
     ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
 		  "'sagittarius': Failed to lock the mutex");
     return SG_UNDEF;
   }
-  
-  node->context = make_nginx_context(r);
-
+  /* other thread may have created it while we were waiting */
+  context = node->context;
+  if (SG_FALSEP(context)) {
+    ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0,
+		  "'sagittarius': Creating a context of %V", &node->sn.str);
+    context = create_nginx_context(&node->sn.str, sg_conf,
+				   r->connection->log);
+    if (!SG_UNDEFP(context)) context_store(node, context);
+  }
   if (ngx_thread_mutex_unlock(&global_lock, r->connection->log) != NGX_OK) {
     ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
 		  "'sagittarius': Failed to unlock the mutex");
-    return SG_UNDEF;
   }
   
-  return node->context;
+  return context;
+}
+
+static void preload_context(ngx_cycle_t *cycle, ngx_rbtree_node_t *node)
+{
+  nginx_context_node_t *cn;
+  if (node != nginx_contexts.sentinel) {
+    cn = (nginx_context_node_t *)node;
+    if (cn->conf->preload && SG_FALSEP(cn->context)) {
+      SgObject context;
+      ngx_log_error(NGX_LOG_DEBUG, cycle->log, 0,
+		    "'sagittarius': Preloading context '%V'", &cn->sn.str);
+      context = create_nginx_context(&cn->sn.str, cn->conf, cycle->log);
+      if (!SG_UNDEFP(context)) context_store(cn, context);
+    }
+    preload_context(cycle, node->left);
+    preload_context(cycle, node->right);
+  }
+}
+
+static void preload_contexts(ngx_cycle_t *cycle)
+{
+  preload_context(cycle, nginx_contexts.root);
 }
 
 
@@ -1979,7 +6250,6 @@ static SgObject make_nginx_request(ngx_http_request_t *req, SgObject context)
   ngxReq->uri = ngx_str_to_string(&req->uri);
   ngxReq->headers = SG_FALSE;	/* initialise lazily */
   ngxReq->cookies = SG_FALSE;	/* initialise lazily */
-  ngxReq->cookies_parsed_p = FALSE;
   ngxReq->query_string = SG_FALSE; /* initialise lazily */
   ngxReq->original_uri = SG_FALSE; /* initialise lazily */
   ngxReq->request_line = SG_FALSE; /* initialise lazily */
@@ -1988,15 +6258,25 @@ static SgObject make_nginx_request(ngx_http_request_t *req, SgObject context)
   ngxReq->rawNginxRequest = req;
   ngxReq->context = context;
   ngxReq->peer_certificate = SG_UNDEF;
+  ngxReq->response = SG_FALSE;
+  ngxReq->pending = 0;
+  ngxReq->finished = FALSE;
+  ngxReq->cache_key.len = 0;
+  ngxReq->cache_key.data = NULL;
+  ngxReq->cache_hash = 0;
+  ngxReq->header_cached = 0;
   return SG_OBJ(ngxReq);
 }
 
 static SgObject make_nginx_response(ngx_http_request_t *req)
 {
+  ngx_http_sagittarius_conf_t *sg_conf;
   SgNginxResponse *ngxRes = SG_NEW(SgNginxResponse);
+
+  sg_conf = ngx_http_get_module_loc_conf(req, ngx_http_sagittarius_module);
   SG_SET_CLASS(ngxRes, SG_CLASS_NGINX_RESPONSE);
   ngxRes->headers = SG_FALSE;	/* just a cache */
-  ngxRes->out = make_response_output_port(req);
+  ngxRes->out = make_response_output_port(req, sg_conf);
   ngxRes->request = req;
   req->headers_out.content_type.len = sizeof("application/octet-stream") - 1;
   req->headers_out.content_type.data = (u_char *) "application/octet-stream";
@@ -2004,59 +6284,122 @@ static SgObject make_nginx_response(ngx_http_request_t *req)
   return SG_OBJ(ngxRes);
 }
 
-static ngx_int_t init_base_library(ngx_log_t *log);
-static SgObject setup_load_path(volatile SgVM *vm,
-				ngx_log_t *log,
-				ngx_http_sagittarius_conf_t *sg_conf);
-static off_t compute_content_length(ngx_chain_t *out);
-
 static ngx_int_t sagittarius_call(ngx_http_request_t *r)
 {
   SgObject req, resp, saved_loadpath, proc, context;
+  ngx_http_sagittarius_conf_t *sg_conf;
+  ngx_str_t cache_key = ngx_null_string;
+  uint32_t cache_hash = 0;
+  request_timing_t *timing;
+  timing_mark_t mark;
   volatile SgVM *vm;
   volatile SgObject status;
   ngx_int_t rc;
-  ngx_chain_t *out;
-  ngx_http_sagittarius_conf_t *sg_conf;
-      
-  sg_conf = ngx_http_get_module_loc_conf(r, ngx_http_sagittarius_module);
 
-  vm = Sg_VM();
-
-  saved_loadpath = setup_load_path(vm, r->connection->log, sg_conf);
-  /* The dispatcher will always be the same so no lock needed */
-  if (SG_UNDEFP(nginx_dispatch)) {
-    if (init_base_library(r->connection->log) != NGX_OK) {
+  sg_conf = ngx_http_get_module_loc_conf(r, ngx_http_sagittarius_module);
+  if (sg_conf->cache && (r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD))) {
+    if (make_cache_key(r, sg_conf->cache, &cache_key) != NGX_OK) {
       return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
+    cache_hash = ngx_crc32_long(cache_key.data, cache_key.len);
+    rc = replay_cached_response(r, sg_conf->cache, &cache_key, cache_hash);
+    if (rc != NGX_DECLINED) {
+      status_add(sg_conf, offsetof(status_context_t, cache_hits), 1);
+      return rc;
+    }
   }
+
+  vm = Sg_VM();
+
+  /* The context also initialises the dispatcher */
+  timing = request_timing(r);
+  if (timing == NULL) return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  timing_begin(&mark);
   context = get_context(r);
+  timing->context_time += now_us() - mark.start;
+  if (SG_UNDEFP(context)) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
   proc = SG_NGINX_CONTEXT(context)->procedure;
   if (!SG_PROCEDUREP(proc)) {
     return NGX_HTTP_NOT_FOUND;
   }
+  /* the load path is computed when the context is created */
+  saved_loadpath = vm->loadPath;
+  vm->loadPath = SG_NGINX_CONTEXT(context)->loadPath;
   
   req = make_nginx_request(r, context);
   resp = make_nginx_response(r);
+  SG_NGINX_REQUEST(req)->response = resp;
+  SG_NGINX_REQUEST(req)->cache_key = cache_key;
+  SG_NGINX_REQUEST(req)->cache_hash = cache_hash;
 
+  timing_begin(&mark);
   SG_UNWIND_PROTECT {
     status = Sg_Apply3(nginx_dispatch, proc, req, resp);
   } SG_WHEN_ERROR {
     ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
 		  "'sagittarius': Failed to execute nginx-dispatch-request");
+    timing_end(r, &mark);
     vm->loadPath = saved_loadpath;
+    SG_NGINX_REQUEST(req)->finished = TRUE;
     ngx_http_discard_request_body(r);
+    if (SG_RESPONSE_OUTPUT_PORT(SG_NGINX_RESPONSE(resp)->out)->header_sent) {
+      /* we can't send the status anymore */
+      return NGX_ERROR;
+    }
     return NGX_HTTP_INTERNAL_SERVER_ERROR;    
   } SG_END_PROTECT;
 
+  timing_end(r, &mark);
   vm->loadPath = saved_loadpath;
     
   /* The procedure didn't consume the request, so discard it */
   rc = ngx_http_discard_request_body(r);
 
   if (rc != NGX_OK && rc != NGX_AGAIN) {
+    SG_NGINX_REQUEST(req)->finished = TRUE;
     return rc;
   }
+
+  rc = finish_response(r, req, status);
+  if (rc == NGX_DONE) {
+    /* released by ngx_http_finalize_request when the sockets are done */
+    r->main->count++;
+  }
+  return rc;
+}
+
+/* 
+   Sends the response unless socket operations are pending. The last
+   callback of the operations sends it then.
+ */
+static ngx_int_t finish_response(ngx_http_request_t *r, SgObject req,
+				 SgObject status)
+{
+  SgObject resp = SG_NGINX_REQUEST(req)->response;
+  ngx_http_sagittarius_conf_t *sg_conf =
+    ngx_http_get_module_loc_conf(r, ngx_http_sagittarius_module);
+  request_timing_t *timing;
+  ngx_chain_t *out;
+  ngx_int_t rc;
+
+  /* #f means an error, then don't wait for the sockets */
+  if (SG_NGINX_REQUEST(req)->pending > 0 && !SG_FALSEP(status)) {
+    return NGX_DONE;
+  }
+  SG_NGINX_REQUEST(req)->finished = TRUE;
+
+  if (SG_RESPONSE_OUTPUT_PORT(SG_NGINX_RESPONSE(resp)->out)->header_sent) {
+    /* streaming response, the status and headers are already sent */
+    if (!SG_INTP(status)) {
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+		    "'sagittarius': Scheme program returned non fixnum "
+		    "after the response is flushed.");
+      return NGX_ERROR;
+    }
+    return response_out_send(SG_NGINX_RESPONSE(resp)->out, SEND_LAST);
+  }
   
   if (SG_INTP(status)) {
     ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0,
@@ -2067,8 +6410,11 @@ static ngx_int_t sagittarius_call(ngx_http_request_t *r)
     /* convert Scheme response to C response */
     out = SG_RESPONSE_OUTPUT_PORT_ROOT(SG_NGINX_RESPONSE(resp)->out);
     r->headers_out.status = SG_INT_VALUE(status);
+    if (sg_conf->cache) store_cached_response(r, sg_conf->cache, req, out);
     r->headers_out.content_length_n = compute_content_length(out);
     r->header_only = (r->headers_out.content_length_n == 0);
+    timing = request_timing(r);
+    if (timing) timing->response_bytes = r->headers_out.content_length_n;
 
     rc = ngx_http_send_header(r);
   
@@ -2116,16 +6462,88 @@ static ngx_int_t ngx_http_sagittarius_handle_request(ngx_http_request_t *r)
 
 typedef struct
 {
+  request_timing_t timing;	/* must be the first */
   ngx_http_request_t *request;
-  /* TBD */
+  SgObject context;
+  SgVM *vm;			/* worker VM */
+  int pooled;			/* the worker VM is pooled or not */
+  int expired;			/* waited longer than queue_timeout */
+  ngx_thread_pool_t *pool;	/* NULL if the executor is used */
+  executor_t *executor;
+  ngx_thread_task_t *task;
+  ngx_queue_t queue;		/* in waiting of the context node */
+  ngx_event_t timer;		/* queue_timeout while waiting */
 } thread_request_ctx_t;
 
+/* 
+   Reset the per VM state which may have been modified by the previous
+   request to what Sg_NewVM(parent) would set. The global bindings and
+   the loaded libraries are shared by all VMs anyway, the same as the
+   requests handled on the main thread, so they aren't touched. A pending
+   finalizer keeps its attention request so it still runs.
+ */
+static void reset_worker_vm(SgVM *vm, SgVM *parent)
+{
+  vm->parameters = Sg_MakeWeakHashTableSimple(SG_HASH_EQ, SG_WEAK_KEY,
+					      64, SG_FALSE);
+  vm->flags = parent->flags;
+  vm->stopRequest = FALSE;
+  vm->attentionRequest = vm->finalizerPending;
+  vm->dynamicWinders = SG_NIL;
+  vm->exceptionHandlers = parent->exceptionHandlers;
+  vm->currentLibrary = parent->currentLibrary;
+  vm->currentInputPort = parent->currentInputPort;
+  vm->currentOutputPort = parent->currentOutputPort;
+  vm->currentErrorPort = parent->currentErrorPort;
+  vm->logPort = parent->logPort;
+  vm->loadPath = parent->loadPath;
+  vm->dynamicLoadPath = parent->dynamicLoadPath;
+}
+
+static void acquire_worker_vm(thread_request_ctx_t *ctx, SgVM *parent)
+{
+  SgNginxContext *c = SG_NGINX_CONTEXT(ctx->context);
+
+  ctx->pooled = FALSE;
+  if (SG_NGINX_CONTEXTP(c) && c->vm_max > 0) {
+    if (c->idle_count > 0) {
+      ctx->vm = c->idle_vms[--c->idle_count];
+      c->idle_vms[c->idle_count] = NULL;
+      ctx->pooled = TRUE;
+      return;
+    }
+    if (c->vms == NULL) {
+      c->vms = SG_NEW_ARRAY(SgVM *, c->vm_max);
+      c->idle_vms = SG_NEW_ARRAY(SgVM *, c->vm_max);
+    }
+    if (c->vm_count < c->vm_max) {
+      ctx->vm = Sg_NewVM(parent, SG_MAKE_STRING("worker vm"));
+      c->vms[c->vm_count++] = ctx->vm;
+      ctx->pooled = TRUE;
+      return;
+    }
+  }
+  /* the pool is exhausted, use a disposable one */
+  ctx->vm = Sg_NewVM(parent, SG_MAKE_STRING("worker vm"));
+}
+
+static void release_worker_vm(thread_request_ctx_t *ctx)
+{
+  SgNginxContext *c = SG_NGINX_CONTEXT(ctx->context);
+  if (ctx->pooled) {
+    reset_worker_vm(ctx->vm, Sg_VM());
+    c->idle_vms[c->idle_count++] = ctx->vm;
+  }
+  ctx->vm = NULL;
+}
+
 
 typedef struct
 {
   thread_request_ctx_t *request_ctx;
   SgVM *vm;
-  /* TBD */
+  uint64_t posted;		/* when it's posted to the executor */
+  ngx_uint_t lane;
 } thread_task_ctx_t;
 
 static void* alien_thread_invoker(void *data)
@@ -2141,13 +6559,788 @@ static void* alien_thread_invoker(void *data)
   return NULL;
 }
 
+/* 
+   Executor.
+   The alternative of the NGINX thread pool defined by the
+   `sagittarius_executor` directive. Each thread has its own task queue
+   and VM. The tasks are put into the queues in round robin and an idle
+   thread steals from the others, both the owner and the thieves take
+   the oldest task so that the requests are served in order. The
+   threads are kept between min_threads and max_threads; one is added
+   when the tasks have waited longer than grow_latency, and one exits
+   when it's been idle for idle_timeout. Each queue has a lane per
+   priority, the lanes are served by smooth weighted round robin, the
+   same as the weights of NGINX upstream. The completed tasks are passed
+   back to the event loop the same way as the thread pool does. It can't
+   use ngx_notify as it takes only one handler per process, which is
+   the one of the thread pool, so each executor has a socket pair.
+   The threads are joined when they exit, and all of them are stopped
+   before the contexts are cleaned up on the process exit.
+ */
+#define EXECUTOR_FREE    0	/* the slot isn't used */
+#define EXECUTOR_RUNNING 1
+#define EXECUTOR_EXITED  2	/* the VM is released by the event loop */
+
+typedef struct
+{
+  executor_t *executor;
+  ngx_uint_t index;
+  ngx_uint_t state;		/* under the lock */
+  ngx_thread_mutex_t lock;	/* of the queue */
+  ngx_thread_task_t *first[LANES];
+  ngx_thread_task_t **last[LANES];
+  ngx_int_t current[LANES];	/* of weighted round robin */
+  SgVM *vm;
+  pthread_t tid;
+} executor_thread_t;
+
+struct executor_s
+{
+  ngx_str_t name;
+  ngx_uint_t min_threads;
+  ngx_uint_t max_threads;
+  ngx_msec_t grow_latency;
+  ngx_msec_t idle_timeout;
+  ngx_int_t weights[LANES];
+  /* the followings are per worker */
+  executor_thread_t *threads;	/* max_threads slots */
+  SgVM *vm;			/* the VMs of the threads are reset to this */
+  ngx_thread_mutex_t lock;	/* for the idle threads */
+  ngx_thread_cond_t cond;
+  ngx_uint_t nthreads;		/* under the lock */
+  ngx_uint_t nidle;		/* under the lock */
+  ngx_atomic_t stop;		/* set under the lock */
+  ngx_uint_t next;		/* round robin, event loop only */
+  uint64_t last_grow;		/* event loop only */
+  ngx_event_t grow_timer;	/* checks the growth while all are busy */
+  ngx_atomic_t pending;		/* tasks in the queues */
+  ngx_atomic_t latency;		/* the last queue latency in microseconds */
+  ngx_atomic_t last_start;	/* when the last task is started */
+  ngx_atomic_t done_lock;
+  ngx_thread_task_t *done_first;
+  ngx_thread_task_t **done_last;
+  ngx_socket_t notify[2];
+  ngx_connection_t *connection;	/* of notify[0] */
+};
+
+static executor_t *find_executor(ngx_str_t *name)
+{
+  executor_t **ex;
+  ngx_uint_t i;
+
+  if (executors == NULL) return NULL;
+  ex = executors->elts;
+  for (i = 0; i < executors->nelts; i++) {
+    if (ex[i]->name.len == name->len &&
+	ngx_strncmp(ex[i]->name.data, name->data, name->len) == 0) {
+      return ex[i];
+    }
+  }
+  return NULL;
+}
+
+static void executor_count_threads(ngx_atomic_int_t n)
+{
+  if (status_worker) ngx_atomic_fetch_add(&status_worker->executor_threads, n);
+}
+
+static void executor_notify(executor_t *ex)
+{
+  /* the event loop may be behind, then the socket is full and it's fine */
+  (void) send(ex->notify[1], "", 1, 0);
+}
+
+static ngx_thread_task_t *executor_pop(executor_thread_t *t)
+{
+  executor_t *ex = t->executor;
+  ngx_thread_task_t *task = NULL;
+  ngx_uint_t ready = 0;
+  ngx_int_t best, i;
+
+  ngx_thread_mutex_lock(&t->lock, ngx_cycle->log);
+  for (i = 0; i < LANES; i++) {
+    if (t->first[i] != NULL) ready |= 1 << i;
+  }
+  best = select_lane(t->current, ex->weights, ready);
+  if (best != -1) {
+    task = t->first[best];
+    t->first[best] = task->next;
+    if (t->first[best] == NULL) t->last[best] = &t->first[best];
+  }
+  ngx_thread_mutex_unlock(&t->lock, ngx_cycle->log);
+  return task;
+}
+
+static ngx_thread_task_t *executor_take(executor_t *ex, executor_thread_t *t)
+{
+  ngx_thread_task_t *task;
+  ngx_uint_t i;
+
+  task = executor_pop(t);
+  for (i = 1; task == NULL && i < ex->max_threads; i++) {
+    task = executor_pop(&ex->threads[(t->index + i) % ex->max_threads]);
+    if (task && status_worker) {
+      ngx_atomic_fetch_add(&status_worker->executor_steals, 1);
+    }
+  }
+  if (task) ngx_atomic_fetch_add(&ex->pending, -1);
+  return task;
+}
+
+static void executor_done(executor_t *ex, ngx_thread_task_t *task)
+{
+  int empty;
+
+  task->next = NULL;
+  ngx_spinlock(&ex->done_lock, 1, 2048);
+  empty = ex->done_first == NULL;
+  *ex->done_last = task;
+  ex->done_last = &task->next;
+  ngx_memory_barrier();
+  ngx_unlock(&ex->done_lock);
+  if (empty) executor_notify(ex);
+}
+
+/* the thread exits only if nothing is put into its queue */
+static int executor_retire(executor_thread_t *t)
+{
+  int retired = FALSE;
+
+  ngx_thread_mutex_lock(&t->lock, ngx_cycle->log);
+  if (t->first[LANE_HIGH] == NULL && t->first[LANE_NORMAL] == NULL &&
+      t->first[LANE_LOW] == NULL) {
+    t->state = EXECUTOR_EXITED;
+    retired = TRUE;
+  }
+  ngx_thread_mutex_unlock(&t->lock, ngx_cycle->log);
+  return retired;
+}
+
+static void *executor_cycle(void *data)
+{
+  executor_thread_t *t = data;
+  executor_t *ex = t->executor;
+  ngx_thread_task_t *task;
+  thread_task_ctx_t *task_ctx;
+  struct timespec deadline;
+  sigset_t set;
+  uint64_t now;
+  int rc;
+
+  /* the same as the thread pool */
+  sigfillset(&set);
+  sigdelset(&set, SIGILL);
+  sigdelset(&set, SIGFPE);
+  sigdelset(&set, SIGSEGV);
+  sigdelset(&set, SIGBUS);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  while (!ex->stop) {
+    task = executor_take(ex, t);
+    if (task) {
+      task_ctx = task->ctx;
+      now = now_us();
+      ex->latency = now - task_ctx->posted;
+      ex->last_start = now;
+      reset_worker_vm(t->vm, ex->vm);
+      task_ctx->vm = t->vm;
+      task->handler(task->ctx, ngx_cycle->log);
+      executor_done(ex, task);
+      continue;
+    }
+
+    ngx_thread_mutex_lock(&ex->lock, ngx_cycle->log);
+    if (ex->pending == 0 && !ex->stop) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += ex->idle_timeout / 1000;
+      deadline.tv_nsec += (ex->idle_timeout % 1000) * 1000000;
+      if (deadline.tv_nsec >= 1000000000) {
+	deadline.tv_sec++;
+	deadline.tv_nsec -= 1000000000;
+      }
+      ex->nidle++;
+      rc = pthread_cond_timedwait(&ex->cond, &ex->lock, &deadline);
+      ex->nidle--;
+      if (rc == ETIMEDOUT && ex->pending == 0 && !ex->stop &&
+	  ex->nthreads > ex->min_threads && executor_retire(t)) {
+	ex->nthreads--;
+	ngx_thread_mutex_unlock(&ex->lock, ngx_cycle->log);
+	executor_count_threads(-1);
+	executor_notify(ex);
+	return NULL;
+      }
+    }
+    ngx_thread_mutex_unlock(&ex->lock, ngx_cycle->log);
+  }
+  /* stopped, the tasks left in the queues are never run */
+  return NULL;
+}
+
+/* event loop only */
+static ngx_int_t executor_spawn(executor_t *ex, ngx_log_t *log)
+{
+  executor_thread_t *t = NULL;
+  pthread_attr_t attr;
+  ngx_uint_t i;
+  int err;
+
+  for (i = 0; i < ex->max_threads && t == NULL; i++) {
+    ngx_thread_mutex_lock(&ex->threads[i].lock, log);
+    if (ex->threads[i].state == EXECUTOR_FREE) t = &ex->threads[i];
+    ngx_thread_mutex_unlock(&ex->threads[i].lock, log);
+  }
+  if (t == NULL) return NGX_DECLINED;
+
+  t->vm = Sg_NewVM(ex->vm, SG_MAKE_STRING("executor vm"));
+  ngx_thread_mutex_lock(&global_lock, log);
+  Sg_HashTableSet(SG_HASHTABLE(pinned_objects), SG_OBJ(t->vm), SG_TRUE, 0);
+  ngx_thread_mutex_unlock(&global_lock, log);
+  ngx_thread_mutex_lock(&t->lock, log);
+  t->state = EXECUTOR_RUNNING;
+  ngx_thread_mutex_unlock(&t->lock, log);
+  ngx_thread_mutex_lock(&ex->lock, log);
+  ex->nthreads++;
+  ngx_thread_mutex_unlock(&ex->lock, log);
+
+  pthread_attr_init(&attr);
+  err = pthread_create(&t->tid, &attr, executor_cycle, t);
+  pthread_attr_destroy(&attr);
+  if (err) {
+    ngx_log_error(NGX_LOG_ALERT, log, err,
+		  "'sagittarius': Failed to create a thread of executor %V",
+		  &ex->name);
+    ngx_thread_mutex_lock(&ex->lock, log);
+    ex->nthreads--;
+    ngx_thread_mutex_unlock(&ex->lock, log);
+    ngx_thread_mutex_lock(&t->lock, log);
+    t->state = EXECUTOR_FREE;
+    ngx_thread_mutex_unlock(&t->lock, log);
+    unpin_object(t->vm);
+    t->vm = NULL;
+    return NGX_ERROR;
+  }
+  executor_count_threads(1);
+  ex->last_grow = now_us();
+  ngx_log_error(NGX_LOG_DEBUG, log, 0,
+		"'sagittarius': Executor %V started a thread", &ex->name);
+  return NGX_OK;
+}
+
+/* adds a thread if the tasks wait too long, event loop only */
+static void executor_grow(executor_t *ex, ngx_log_t *log)
+{
+  uint64_t now, wait, threshold = (uint64_t)ex->grow_latency * 1000;
+  ngx_uint_t nthreads, nidle;
+
+  ngx_thread_mutex_lock(&ex->lock, log);
+  nthreads = ex->nthreads;
+  nidle = ex->nidle;
+  ngx_thread_mutex_unlock(&ex->lock, log);
+  if (nthreads >= ex->max_threads || ex->pending <= nidle) return;
+
+  now = now_us();
+  /* nothing may have been started if all the threads are busy */
+  wait = ngx_max((uint64_t)ex->latency, now - (uint64_t)ex->last_start);
+  if (wait >= threshold && now - ex->last_grow >= threshold) {
+    executor_spawn(ex, log);
+  }
+  /* nothing else checks it if a burst blocks all the threads */
+  if (!ex->grow_timer.timer_set) {
+    ngx_add_timer(&ex->grow_timer, ngx_max(ex->grow_latency, 1));
+  }
+}
+
+static void executor_grow_handler(ngx_event_t *ev)
+{
+  executor_grow(ev->data, ev->log);
+}
+
+static ngx_int_t executor_post(executor_t *ex, ngx_thread_task_t *task,
+			       ngx_log_t *log)
+{
+  thread_task_ctx_t *task_ctx = task->ctx;
+  executor_thread_t *t;
+  ngx_uint_t i, n = ex->max_threads;
+
+  task->next = NULL;
+  task->event.active = 1;
+  task_ctx->posted = now_us();
+  /* before the task is visible, so it never goes below 0 */
+  ngx_atomic_fetch_add(&ex->pending, 1);
+  for (i = 0; i < n; i++) {
+    t = &ex->threads[(ex->next + i) % n];
+    ngx_thread_mutex_lock(&t->lock, log);
+    if (t->state == EXECUTOR_RUNNING) {
+      *t->last[task_ctx->lane] = task;
+      t->last[task_ctx->lane] = &task->next;
+      ngx_thread_mutex_unlock(&t->lock, log);
+      break;
+    }
+    ngx_thread_mutex_unlock(&t->lock, log);
+  }
+  if (i == n) {
+    ngx_atomic_fetch_add(&ex->pending, -1);
+    task->event.active = 0;
+    return NGX_ERROR;
+  }
+  ex->next = (ex->next + i + 1) % n;
+
+  ngx_thread_mutex_lock(&ex->lock, log);
+  if (ex->nidle > 0) ngx_thread_cond_signal(&ex->cond, log);
+  ngx_thread_mutex_unlock(&ex->lock, log);
+  executor_grow(ex, log);
+  return NGX_OK;
+}
+
+static void executor_notify_handler(ngx_event_t *ev)
+{
+  ngx_connection_t *c = ev->data;
+  executor_t *ex = c->data;
+  ngx_thread_task_t *task;
+  ngx_event_t *event;
+  executor_thread_t *t;
+  u_char buf[64];
+  ngx_uint_t i;
+
+  while (recv(c->fd, buf, sizeof(buf), 0) > 0) /* drain */;
+
+  /* releases the VMs of the exited threads */
+  for (i = 0; i < ex->max_threads; i++) {
+    t = &ex->threads[i];
+    ngx_thread_mutex_lock(&t->lock, ev->log);
+    if (t->state == EXECUTOR_EXITED) {
+      /* it's about to return, if it hasn't */
+      pthread_join(t->tid, NULL);
+      unpin_object(t->vm);
+      t->vm = NULL;
+      t->state = EXECUTOR_FREE;
+      ngx_log_error(NGX_LOG_DEBUG, ev->log, 0,
+		    "'sagittarius': A thread of executor %V exited",
+		    &ex->name);
+    }
+    ngx_thread_mutex_unlock(&t->lock, ev->log);
+  }
+
+  ngx_spinlock(&ex->done_lock, 1, 2048);
+  task = ex->done_first;
+  ex->done_first = NULL;
+  ex->done_last = &ex->done_first;
+  ngx_unlock(&ex->done_lock);
+
+  while (task) {
+    event = &task->event;
+    task = task->next;
+    event->complete = 1;
+    event->active = 0;
+    event->handler(event);
+  }
+  executor_grow(ex, ev->log);
+}
+
+static ngx_int_t init_executor(ngx_cycle_t *cycle, executor_t *ex)
+{
+  ngx_connection_t *c;
+  ngx_uint_t i, j;
+
+  ex->notify[0] = ex->notify[1] = (ngx_socket_t) -1;
+  ex->connection = NULL;
+  ex->vm = NULL;
+  ex->threads = ngx_pcalloc(cycle->pool,
+			    sizeof(executor_thread_t) * ex->max_threads);
+  if (ex->threads == NULL) return NGX_ERROR;
+  for (i = 0; i < ex->max_threads; i++) {
+    ex->threads[i].executor = ex;
+    ex->threads[i].index = i;
+    ex->threads[i].state = EXECUTOR_FREE;
+    for (j = 0; j < LANES; j++) {
+      ex->threads[i].last[j] = &ex->threads[i].first[j];
+    }
+    if (ngx_thread_mutex_create(&ex->threads[i].lock, cycle->log) != NGX_OK) {
+      return NGX_ERROR;
+    }
+  }
+  if (ngx_thread_mutex_create(&ex->lock, cycle->log) != NGX_OK ||
+      ngx_thread_cond_create(&ex->cond, cycle->log) != NGX_OK) {
+    return NGX_ERROR;
+  }
+  ex->vm = Sg_NewVM(Sg_VM(), SG_MAKE_STRING("executor"));
+  ngx_thread_mutex_lock(&global_lock, cycle->log);
+  Sg_HashTableSet(SG_HASHTABLE(pinned_objects), SG_OBJ(ex->vm), SG_TRUE, 0);
+  ngx_thread_mutex_unlock(&global_lock, cycle->log);
+  ex->nthreads = ex->nidle = ex->next = 0;
+  ex->stop = 0;
+  ex->last_grow = 0;
+  ex->pending = ex->latency = ex->done_lock = 0;
+  ex->last_start = now_us();
+  ex->grow_timer.handler = executor_grow_handler;
+  ex->grow_timer.data = ex;
+  ex->grow_timer.log = cycle->log;
+  ex->grow_timer.cancelable = 1;
+  ex->done_first = NULL;
+  ex->done_last = &ex->done_first;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, ex->notify) == -1) {
+    ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+		  "'sagittarius': socketpair() failed for executor %V",
+		  &ex->name);
+    return NGX_ERROR;
+  }
+  if (ngx_nonblocking(ex->notify[0]) == -1 ||
+      ngx_nonblocking(ex->notify[1]) == -1) {
+    ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+		  "'sagittarius': Failed to set non blocking for executor %V",
+		  &ex->name);
+    return NGX_ERROR;
+  }
+  c = ngx_get_connection(ex->notify[0], cycle->log);
+  if (c == NULL) return NGX_ERROR;
+  ex->connection = c;
+  c->data = ex;
+  c->log = cycle->log;
+  c->read->log = cycle->log;
+  c->read->handler = executor_notify_handler;
+  /* it lives as long as the process, like the channel */
+  c->read->channel = 1;
+  if (ngx_add_event(c->read, NGX_READ_EVENT, 0) == NGX_ERROR) return NGX_ERROR;
+
+  for (i = 0; i < ex->min_threads; i++) {
+    if (executor_spawn(ex, cycle->log) != NGX_OK) return NGX_ERROR;
+  }
+  return NGX_OK;
+}
+
+static ngx_int_t init_executors(ngx_cycle_t *cycle)
+{
+  executor_t **ex;
+  ngx_uint_t i;
+
+  if (executors == NULL) return NGX_OK;
+  ex = executors->elts;
+  for (i = 0; i < executors->nelts; i++) {
+    if (init_executor(cycle, ex[i]) != NGX_OK) {
+      ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
+		    "'sagittarius': Failed to initialise executor %V",
+		    &ex[i]->name);
+      return NGX_ERROR;
+    }
+  }
+  return NGX_OK;
+}
+
+/* waits for the running tasks, the queued ones are dropped */
+static void stop_executor(ngx_cycle_t *cycle, executor_t *ex)
+{
+  executor_thread_t *t;
+  ngx_uint_t i, state;
+
+  if (ex->grow_timer.timer_set) ngx_del_timer(&ex->grow_timer);
+  ngx_thread_mutex_lock(&ex->lock, cycle->log);
+  ex->stop = 1;
+  (void) pthread_cond_broadcast(&ex->cond);
+  ngx_thread_mutex_unlock(&ex->lock, cycle->log);
+
+  for (i = 0; i < ex->max_threads; i++) {
+    t = &ex->threads[i];
+    ngx_thread_mutex_lock(&t->lock, cycle->log);
+    state = t->state;
+    ngx_thread_mutex_unlock(&t->lock, cycle->log);
+    if (state == EXECUTOR_FREE) continue;
+    pthread_join(t->tid, NULL);
+    /* it may have retired meanwhile, then it's already uncounted */
+    if (t->state == EXECUTOR_RUNNING) executor_count_threads(-1);
+    unpin_object(t->vm);
+    t->vm = NULL;
+    t->state = EXECUTOR_FREE;
+    (void) ngx_thread_mutex_destroy(&t->lock, cycle->log);
+  }
+  (void) ngx_thread_mutex_destroy(&ex->lock, cycle->log);
+  (void) ngx_thread_cond_destroy(&ex->cond, cycle->log);
+  if (ex->vm) unpin_object(ex->vm);
+  ex->vm = NULL;
+
+  if (ex->connection) {
+    ngx_close_connection(ex->connection); /* closes notify[0] */
+    ex->connection = NULL;
+  } else if (ex->notify[0] != (ngx_socket_t) -1) {
+    (void) ngx_close_socket(ex->notify[0]);
+  }
+  if (ex->notify[1] != (ngx_socket_t) -1) {
+    (void) ngx_close_socket(ex->notify[1]);
+  }
+  ex->notify[0] = ex->notify[1] = (ngx_socket_t) -1;
+}
+
+static void stop_executors(ngx_cycle_t *cycle)
+{
+  executor_t **ex;
+  ngx_uint_t i;
+
+  if (executors == NULL) return;
+  ex = executors->elts;
+  for (i = 0; i < executors->nelts; i++) {
+    /* not initialised if init_process failed before it */
+    if (ex[i]->threads == NULL) continue;
+    stop_executor(cycle, ex[i]);
+  }
+}
+
+/* 
+   sagittarius_executor name [min_threads=n] [max_threads=n]
+                             [grow_latency=time] [idle_timeout=time]
+                             [weights=high:normal:low];
+ */
+static char* ngx_http_sagittarius_executor(ngx_conf_t *cf,
+					   ngx_command_t *cmd,
+					   void *conf)
+{
+  ngx_str_t *value = cf->args->elts, v;
+  executor_t *ex, **slot;
+  ngx_uint_t i;
+  ngx_int_t n;
+
+  if (find_executor(&value[1]) != NULL) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+		       "'sagittarius': duplicate executor \"%V\"", &value[1]);
+    return NGX_CONF_ERROR;
+  }
+  if (executors == NULL) {
+    executors = ngx_array_create(cf->pool, 4, sizeof(executor_t *));
+    if (executors == NULL) return NGX_CONF_ERROR;
+  }
+  ex = ngx_pcalloc(cf->pool, sizeof(executor_t));
+  slot = ngx_array_push(executors);
+  if (ex == NULL || slot == NULL) return NGX_CONF_ERROR;
+  ex->name = value[1];
+  ex->min_threads = 2;
+  ex->max_threads = 32;
+  ex->grow_latency = 10;
+  ex->idle_timeout = 60000;
+  ngx_memcpy(ex->weights, lane_weights, sizeof(lane_weights));
+
+  for (i = 2; i < cf->args->nelts; i++) {
+    if (ngx_strncmp(value[i].data, "min_threads=", 12) == 0) {
+      n = ngx_atoi(value[i].data + 12, value[i].len - 12);
+      if (n == NGX_ERROR || n == 0) goto invalid;
+      ex->min_threads = n;
+    } else if (ngx_strncmp(value[i].data, "max_threads=", 12) == 0) {
+      n = ngx_atoi(value[i].data + 12, value[i].len - 12);
+      if (n == NGX_ERROR || n == 0) goto invalid;
+      ex->max_threads = n;
+    } else if (ngx_strncmp(value[i].data, "grow_latency=", 13) == 0) {
+      v.data = value[i].data + 13;
+      v.len = value[i].len - 13;
+      ex->grow_latency = ngx_parse_time(&v, 0);
+      if (ex->grow_latency == (ngx_msec_t)NGX_ERROR) goto invalid;
+    } else if (ngx_strncmp(value[i].data, "idle_timeout=", 13) == 0) {
+      v.data = value[i].data + 13;
+      v.len = value[i].len - 13;
+      ex->idle_timeout = ngx_parse_time(&v, 0);
+      if (ex->idle_timeout == (ngx_msec_t)NGX_ERROR) goto invalid;
+    } else if (ngx_strncmp(value[i].data, "weights=", 8) == 0) {
+      u_char *p = value[i].data + 8, *e = value[i].data + value[i].len, *c;
+      ngx_uint_t j;
+      for (j = 0; j < LANES; j++) {
+	c = ngx_strlchr(p, e, ':');
+	if (c == NULL) c = e;
+	n = ngx_atoi(p, c - p);
+	if (n == NGX_ERROR || n == 0) goto invalid;
+	ex->weights[j] = n;
+	p = c + 1;
+	if ((c == e) != (j == LANES - 1)) goto invalid;
+      }
+    } else {
+      goto invalid;
+    }
+  }
+  if (ex->min_threads > ex->max_threads) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+		       "'sagittarius': min_threads of executor \"%V\" "
+		       "must not be greater than max_threads", &value[1]);
+    return NGX_CONF_ERROR;
+  }
+  *slot = ex;
+  return NGX_CONF_OK;
+
+ invalid:
+  ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+		     "'sagittarius': invalid executor parameter \"%V\"",
+		     &value[i]);
+  return NGX_CONF_ERROR;
+}
+
+/* 
+   Backpressure.
+   A request waits in the context node while max_concurrency requests of
+   the context are in the thread pool, and is rejected if max_queue
+   requests are already waiting, either in the node or in the queue of
+   the thread pool. The counters are per worker, only the queued count
+   is decremented on the thread pool.
+ */
+static ngx_int_t reject_request(ngx_http_request_t *r, const char *reason)
+{
+  ngx_http_sagittarius_conf_t *sg_conf;
+  ngx_table_elt_t *h;
+
+  sg_conf = ngx_http_get_module_loc_conf(r, ngx_http_sagittarius_module);
+  ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+		"'sagittarius': Rejected %V, %s", &r->uri, reason);
+  status_add(sg_conf, offsetof(status_context_t, rejected), 1);
+  if (sg_conf->retry_after > 0) {
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h != NULL) {
+      h->value.data = ngx_pnalloc(r->pool, NGX_TIME_T_LEN);
+      if (h->value.data == NULL) {
+	h->hash = 0;
+      } else {
+	h->hash = 1;
+	ngx_str_set(&h->key, "Retry-After");
+	h->value.len = ngx_sprintf(h->value.data, "%T", sg_conf->retry_after)
+	  - h->value.data;
+      }
+    }
+  }
+  return sg_conf->reject_status;
+}
+
+static ngx_int_t post_request_task(thread_request_ctx_t *ctx)
+{
+  ngx_http_request_t *r = ctx->request;
+  ngx_http_sagittarius_conf_t *sg_conf;
+  thread_task_ctx_t *task_ctx = ctx->task->ctx;
+
+  sg_conf = ngx_http_get_module_loc_conf(r, ngx_http_sagittarius_module);
+  if (ctx->executor) {
+    /* the thread of the executor uses its own VM */
+    if (executor_post(ctx->executor, ctx->task, r->connection->log)
+	!= NGX_OK) {
+      return NGX_ERROR;
+    }
+  } else {
+    acquire_worker_vm(ctx, Sg_VM());
+    task_ctx->vm = ctx->vm;
+    if (ngx_thread_task_post(ctx->pool, ctx->task) != NGX_OK) {
+      release_worker_vm(ctx);
+      return NGX_ERROR;
+    }
+  }
+  sg_conf->node->posted++;
+  ngx_atomic_fetch_add(&sg_conf->node->queued, 1);
+  return NGX_OK;
+}
+
+/* the request is still blocked, so it's finalised here */
+static void finalize_rejected(thread_request_ctx_t *ctx, const char *reason)
+{
+  ngx_http_request_t *r = ctx->request;
+  ngx_connection_t *c = r->connection;
+
+  r->main->blocked--;
+  r->aio = 0;
+  status_add(ngx_http_get_module_loc_conf(r, ngx_http_sagittarius_module),
+	     offsetof(status_context_t, queued), -1);
+  ngx_http_finalize_request(r, reject_request(r, reason));
+  ngx_http_run_posted_requests(c);
+}
+
+static void queue_timeout_handler(ngx_event_t *ev)
+{
+  thread_request_ctx_t *ctx = ev->data;
+  ngx_http_request_t *r = ctx->request;
+  ngx_http_sagittarius_conf_t *sg_conf;
+
+  sg_conf = ngx_http_get_module_loc_conf(r, ngx_http_sagittarius_module);
+  ngx_http_set_log_request(r->connection->log, r);
+  ngx_queue_remove(&ctx->queue);
+  sg_conf->node->nwaiting--;
+  finalize_rejected(ctx, "queue timeout");
+}
+
+/* 
+   posts the waiting requests as many as max_concurrency allows, the
+   lanes are served the same way as the executor
+ */
+static void post_waiting_requests(nginx_context_node_t *node)
+{
+  ngx_http_sagittarius_conf_t *sg_conf;
+  thread_request_ctx_t *ctx;
+  ngx_queue_t *q;
+  ngx_uint_t ready;
+  ngx_int_t lane, i;
+
+  while (node->nwaiting > 0) {
+    for (i = 0, ready = 0, q = NULL; i < LANES; i++) {
+      if (ngx_queue_empty(&node->waiting[i])) continue;
+      ready |= 1 << i;
+      if (q == NULL) q = ngx_queue_head(&node->waiting[i]);
+    }
+    ctx = ngx_queue_data(q, thread_request_ctx_t, queue);
+    sg_conf = ngx_http_get_module_loc_conf(ctx->request,
+					   ngx_http_sagittarius_module);
+    if (node->posted >= sg_conf->max_concurrency) break;
+    lane = select_lane(node->current, node->weights, ready);
+    q = ngx_queue_head(&node->waiting[lane]);
+    ctx = ngx_queue_data(q, thread_request_ctx_t, queue);
+    ngx_queue_remove(q);
+    node->nwaiting--;
+    if (ctx->timer.timer_set) ngx_del_timer(&ctx->timer);
+    if (post_request_task(ctx) != NGX_OK) {
+      finalize_rejected(ctx, "thread pool queue is full");
+    }
+  }
+}
+
+static ngx_int_t admit_request(ngx_http_request_t *r,
+			       ngx_http_sagittarius_conf_t *sg_conf,
+			       thread_request_ctx_t *ctx)
+{
+  nginx_context_node_t *node = sg_conf->node;
+  thread_task_ctx_t *task_ctx;
+  ngx_uint_t waiting = node->nwaiting + node->queued;
+  int held = sg_conf->max_concurrency &&
+    node->posted >= sg_conf->max_concurrency;
+
+  /* the request would be the (waiting + 1)th one to wait */
+  if (sg_conf->max_queue != NGX_CONF_UNSET_UINT &&
+      (waiting > 0 || held) && waiting >= sg_conf->max_queue) {
+    return NGX_DECLINED;
+  }
+  if (held) {
+    task_ctx = ctx->task->ctx;
+    ngx_queue_insert_tail(&node->waiting[task_ctx->lane], &ctx->queue);
+    node->nwaiting++;
+    if (sg_conf->queue_timeout) {
+      ctx->timer.handler = queue_timeout_handler;
+      ctx->timer.data = ctx;
+      ctx->timer.log = r->connection->log;
+      ngx_add_timer(&ctx->timer, sg_conf->queue_timeout);
+    }
+    return NGX_OK;
+  }
+  return post_request_task(ctx);
+}
+
 static void ngx_http_sagittarius_task_handler(void *data, ngx_log_t *log)
 {
   thread_task_ctx_t *task_ctx = data;
-  ngx_http_request_t *r = task_ctx->request_ctx->request;
+  thread_request_ctx_t *ctx = task_ctx->request_ctx;
+  ngx_http_request_t *r = ctx->request;
   ngx_connection_t *c = r->connection;
+  ngx_http_sagittarius_conf_t *sg_conf;
 
+  sg_conf = ngx_http_get_module_loc_conf(r, ngx_http_sagittarius_module);
   ngx_http_set_log_request(c->log, r);
+  ngx_atomic_fetch_add(&sg_conf->node->queued, -1);
+  ctx->timing.queue_time = now_us() - ctx->timing.queued;
+  status_add(sg_conf, status_lane_offset(task_ctx->lane, started), 1);
+  status_add(sg_conf, status_lane_offset(task_ctx->lane, queue_time),
+	     (ngx_atomic_int_t)ctx->timing.queue_time);
+  if (sg_conf->queue_timeout &&
+      ctx->timing.queue_time > (uint64_t)sg_conf->queue_timeout * 1000) {
+    /* rejected by the completion handler on the event loop */
+    ctx->expired = TRUE;
+    return;
+  }
+  status_add(sg_conf, offsetof(status_context_t, queued), -1);
   Sg_InvokeOnAlienThread(alien_thread_invoker, task_ctx);
 }
 
@@ -2155,11 +7348,20 @@ static void ngx_http_sagittarius_task_completion_handler(ngx_event_t *ev)
 {
   ngx_connection_t *c;
   ngx_http_request_t *r;
+  ngx_http_sagittarius_conf_t *sg_conf;
   thread_request_ctx_t *ctx = ev->data;
   r = ctx->request;
   c = r->connection;
 
   ngx_http_set_log_request(c->log, r);
+  release_worker_vm(ctx);
+  sg_conf = ngx_http_get_module_loc_conf(r, ngx_http_sagittarius_module);
+  sg_conf->node->posted--;
+  post_waiting_requests(sg_conf->node);
+  if (ctx->expired) {
+    finalize_rejected(ctx, "queue timeout");
+    return;
+  }
   r->main->blocked--;
   r->aio = 0;
 
@@ -2181,6 +7383,8 @@ static ngx_int_t sagittarius_precontent_handler(ngx_http_request_t *r)
     ngx_thread_task_t *task;
     thread_task_ctx_t *task_ctx;
     thread_request_ctx_t *ctx;
+    timing_mark_t mark;
+    uint64_t context_time;
 
     ctx = ngx_http_get_module_ctx(r, ngx_http_sagittarius_module);
     if (ctx != NULL) {
@@ -2188,29 +7392,26 @@ static ngx_int_t sagittarius_precontent_handler(ngx_http_request_t *r)
 		    "'sagittarius': Re-entering the handler");
       return NGX_DECLINED;
     } else {
-      SgVM *vm = Sg_VM();
-      /* context must be initialised before getting into the thread.
-	 a bit of code duplication but we need to initialise it here */
-      if (!has_context(r)) {
-	SgObject saved = setup_load_path(vm, r->connection->log, sg_conf);
-	/* If the context is not there, this may not be loaded either. */
-	if (SG_UNDEFP(nginx_dispatch)) {
-	  if (init_base_library(r->connection->log) != NGX_OK) {
-	    return NGX_HTTP_INTERNAL_SERVER_ERROR;
-	  }
-	}
-	get_context(r);
-      	vm->loadPath = saved;
-      }
+      /* context must be initialised before getting into the thread. */
+      SgObject context;
+      timing_begin(&mark);
+      context = get_context(r);
+      context_time = now_us() - mark.start;
+      if (SG_UNDEFP(context)) return NGX_HTTP_INTERNAL_SERVER_ERROR;
 
       ctx = ngx_pcalloc(r->pool, sizeof(thread_request_ctx_t));
       if (ctx == NULL) return NGX_HTTP_INTERNAL_SERVER_ERROR;
+      /* includes loading the library, the thread only looks it up */
+      ctx->timing.context_time = context_time;
 
       ngx_http_set_ctx(r, ctx, ngx_http_sagittarius_module);
-	    
-      tp = ngx_thread_pool_get((ngx_cycle_t *)ngx_cycle, &sg_conf->pool_name);
 
-      if (tp == NULL) {
+      ctx->executor = find_executor(&sg_conf->pool_name);
+      tp = ctx->executor
+	? NULL
+	: ngx_thread_pool_get((ngx_cycle_t *)ngx_cycle, &sg_conf->pool_name);
+
+      if (tp == NULL && ctx->executor == NULL) {
 	ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
 		      "'sagittarius': Thread pool %V not found",
 		      &sg_conf->pool_name);
@@ -2224,19 +7425,31 @@ static ngx_int_t sagittarius_precontent_handler(ngx_http_request_t *r)
 	return NGX_HTTP_INTERNAL_SERVER_ERROR;
       }
       ctx->request = r;
-      
+      ctx->context = context;
+      ctx->pool = tp;
+      ctx->task = task;
+
       task_ctx = task->ctx;
       task_ctx->request_ctx = ctx;
-      task_ctx->vm = Sg_NewVM(vm, SG_MAKE_STRING("worker vm"));
+      task_ctx->lane = request_lane(r, sg_conf);
       task->handler = ngx_http_sagittarius_task_handler;
       task->event.handler = ngx_http_sagittarius_task_completion_handler;
       task->event.data = ctx;
 
-      if (ngx_thread_task_post(tp, task) != NGX_OK) {
+      status_request_begin(r, sg_conf);
+      status_add(sg_conf, offsetof(status_context_t, queued), 1);
+      ctx->timing.queued = now_us();
+      switch (admit_request(r, sg_conf, ctx)) {
+      case NGX_OK: break;
+      case NGX_DECLINED:
+	status_add(sg_conf, offsetof(status_context_t, queued), -1);
+	return reject_request(r, "queue is full");
+      default:
 	ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
 		      "'sagittarius': Failed to post a new task to %V",
 		      &sg_conf->pool_name);
-	return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	status_add(sg_conf, offsetof(status_context_t, queued), -1);
+	return reject_request(r, "thread pool queue is full");
       }
       r->main->blocked++;
       r->aio = 1;
@@ -2260,13 +7473,14 @@ static ngx_int_t ngx_http_sagittarius_handler(ngx_http_request_t *r)
     /* it should already be handled so decline it here */
     return NGX_DECLINED;
   } else {
+    status_request_begin(r, sg_conf);
     return ngx_http_sagittarius_handle_request(r);
   }
 }
 
 static ngx_int_t init_base_library(ngx_log_t *log)
 {
-  SgObject sym, lib, o;
+  SgObject sym, lib, o, dispatch, callback;
   ngx_log_error(NGX_LOG_DEBUG, log, 0,
 		"'sagittarius': Initialising '(sagittarius nginx)' library");
   sym = SG_INTERN("(sagittarius nginx)");
@@ -2285,7 +7499,27 @@ static ngx_int_t init_base_library(ngx_log_t *log)
 		  "'sagittarius': Failed to retrieve nginx-dispatch-request");
     return NGX_ERROR;
   }
-  nginx_dispatch = SG_GLOC_GET(SG_GLOC(o));
+  dispatch = SG_GLOC_GET(SG_GLOC(o));
+  o = Sg_FindBinding(lib, SG_INTERN("nginx-dispatch-callback"), SG_UNBOUND);
+  if (SG_UNBOUNDP(o)) {
+    ngx_log_error(NGX_LOG_ERR, log, 0,
+		  "'sagittarius': Failed to retrieve nginx-dispatch-callback");
+    return NGX_ERROR;
+  }
+  callback = SG_GLOC_GET(SG_GLOC(o));
+  /* (rfc cookie) is imported by (sagittarius nginx) so must be there */
+  lib = Sg_FindLibrary(SG_INTERN("(rfc cookie)"), FALSE);
+  o = SG_FALSEP(lib)
+    ? SG_UNBOUND
+    : Sg_FindBinding(lib, SG_INTERN("make-cookie"), SG_UNBOUND);
+  if (SG_UNBOUNDP(o)) {
+    ngx_log_error(NGX_LOG_ERR, log, 0,
+		  "'sagittarius': Failed to retrieve make-cookie");
+    return NGX_ERROR;
+  }
+  cookie_constructor = SG_GLOC_GET(SG_GLOC(o));
+  nginx_dispatch_callback = callback;
+  nginx_dispatch = dispatch;
   ngx_log_error(NGX_LOG_DEBUG, log, 0,
 		"'sagittarius': '(sagittarius nginx)' library is initialised");
   return NGX_OK;
@@ -0,0 +1,31 @@
+#!/bin/bash
+# Compares 2 results of run.sh and flags the regressions
+# usage: compare.sh base.tsv new.tsv [threshold%]
+# Exits with 1 if the throughput is decreased or the p99 latency is
+# increased more than the threshold (default 5%) in any scenario.
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 base.tsv new.tsv [threshold%]"
+    exit 2
+fi
+
+awk -F '\t' -v threshold=${3:-5} '
+FNR == 1 { next }
+FNR == NR { rps[$1] = $2; p99[$1] = $4; next }
+{
+    if (!($1 in rps)) {
+	printf "%-10s new scenario\n", $1
+	next
+    }
+    drps = (rps[$1] > 0) ? ($2 - rps[$1]) / rps[$1] * 100 : 0
+    dp99 = (p99[$1] > 0) ? ($4 - p99[$1]) / p99[$1] * 100 : 0
+    flag = ""
+    if (drps < -threshold || dp99 > threshold) {
+	flag = "REGRESSION"
+	failed = 1
+    }
+    printf "%-10s rps %10.1f -> %10.1f (%+6.1f%%) p99 %8.3f -> %8.3f (%+6.1f%%) %s\n",
+	$1, rps[$1], $2, drps, p99[$1], $4, dp99, flag
+}
+END { exit failed }
+' "$1" "$2"
@@ -0,0 +1,13 @@
+-- wrk script which prints the result as one tab separated line
+-- rps p50 p99 p999 (milliseconds) errors
+done = function(summary, latency, requests)
+   local errors = summary.errors.connect + summary.errors.read
+      + summary.errors.write + summary.errors.status
+      + summary.errors.timeout
+   io.write(string.format("result\t%.1f\t%.3f\t%.3f\t%.3f\t%d\n",
+			  summary.requests / summary.duration * 1000000,
+			  latency:percentile(50) / 1000,
+			  latency:percentile(99) / 1000,
+			  latency:percentile(99.9) / 1000,
+			  errors))
+end
@@ -0,0 +1,54 @@
+#!/bin/bash
+# End-to-end load benchmark, requires wrk (https://github.com/wg/wrk)
+# The server must be started with test/bench/conf/bench.conf, `make bench`
+# does it. The result is written as tab separated values to BENCH_OUTPUT.
+
+set -e
+
+bench_dir=$(cd $(dirname $0); pwd)
+
+BENCH_URL=${BENCH_URL:-http://localhost:8090}
+BENCH_DURATION=${BENCH_DURATION:-10s}
+BENCH_WARMUP=${BENCH_WARMUP:-2s}
+BENCH_THREADS=${BENCH_THREADS:-2}
+BENCH_CONNECTIONS=${BENCH_CONNECTIONS:-32}
+BENCH_OUTPUT=${BENCH_OUTPUT:-bench-results.tsv}
+WRK=${WRK:-wrk}
+
+if ! command -v $WRK > /dev/null; then
+    echo "$WRK is not found, set WRK to the path of wrk"
+    exit 1
+fi
+
+header_args=()
+for i in $(seq 0 19); do
+    header_args+=(-H "X-Request-$i: sagittarius-benchmark-$i")
+done
+
+# name path [wrk options ...]
+run_scenario() {
+    name=$1
+    path=$2
+    shift 2
+
+    echo -n "$name ... "
+    $WRK -t $BENCH_THREADS -c $BENCH_CONNECTIONS -d $BENCH_WARMUP \
+	 "$@" $BENCH_URL$path > /dev/null
+    line=$($WRK -t $BENCH_THREADS -c $BENCH_CONNECTIONS -d $BENCH_DURATION \
+		-s $bench_dir/report.lua "$@" $BENCH_URL$path | grep '^result')
+    if [ -z "$line" ]; then
+	echo "failed"
+	exit 1
+    fi
+    echo "$line" | cut -f 2-
+    printf "%s\t%s\n" $name "$(echo "$line" | cut -f 2-)" >> $BENCH_OUTPUT
+}
+
+printf "scenario\trps\tp50_ms\tp99_ms\tp999_ms\terrors\n" > $BENCH_OUTPUT
+echo "scenario rps p50_ms p99_ms p999_ms errors"
+run_scenario echo    /echo
+run_scenario headers /headers "${header_args[@]}"
+run_scenario large   /large
+run_scenario filters /filters
+run_scenario thread  /thread
+echo "Result is written to $BENCH_OUTPUT"
@@ -0,0 +1,50 @@
+;; benchmark application for Sagittarius NGINX
+;; each entry point exercises one part of the module
+(library (web bench)
+    (export echo
+	    headers
+	    large
+	    filtered
+	    filter)
+    (import (rnrs)
+	    (sagittarius nginx))
+
+(define hello (string->utf8 "hello\n"))
+
+;; the smallest round trip
+(define (echo request response)
+  (values 200 'text/plain (list hello)))
+
+;; converts all the request headers and sets many response headers
+(define response-headers
+  (let loop ((i 0) (r '()))
+    (if (= i 20)
+	(reverse r)
+	(loop (+ i 1)
+	      (cons (cons (string-append "X-Bench-" (number->string i))
+			  "sagittarius")
+		    r)))))
+(define (headers request response)
+  (let ((h (nginx-request-headers request)))
+    (nginx-response-headers-set! response response-headers)
+    (values 200 'text/plain
+	    (list (number->string (length h)) " headers\n"))))
+
+;; 1MB body written to the output port in 16KB chunks
+(define chunk (make-bytevector 16384 (char->integer #\a)))
+(define (large request response)
+  (let ((out (nginx-response-output-port response)))
+    (do ((i 0 (+ i 1))) ((= i 64))
+      (put-bytevector out chunk))
+    (values 200 'application/octet-stream)))
+
+(define (filtered request response)
+  (values 200 'text/plain (list hello)))
+
+;; pass through filter, the chain is configured 3 times
+(define (filter context request response next)
+  (nginx-response-header-add! response "X-Bench-Filter"
+			      (nginx-filter-context-name context))
+  (next request response))
+
+)
@@ -0,0 +1,378 @@
+/*
+ * Copyright (c) 2018 Takashi Kato <ktakashi@ymail.com>
+ * See Licence.txt for terms and conditions of use
+ */
+
+/*
+  In-process micro benchmark.
+  The module is included as it is so that the static functions can be
+  called directly with fake NGINX structures. No network is involved.
+  Each benchmark reports the time and the bytes allocated by the GC
+  per operation.
+ */
+#include "../../src/ngx_http_sagittarius_module.c"
+#include <time.h>
+
+static ngx_open_file_t harness_log_file;
+static ngx_log_t       harness_log;
+static ngx_http_sagittarius_conf_t harness_conf;
+static ngx_cycle_t     harness_cycle;
+
+/* the number of the request headers of the fake request */
+#define HARNESS_HEADERS 16
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void init_harness(void)
+{
+  ngx_str_t nstr = ngx_null_string;
+
+  ngx_pagesize = getpagesize();
+  ngx_cacheline_size = NGX_CPU_CACHE_LINE;
+  ngx_time_init();
+
+  harness_log_file.fd = ngx_stderr;
+  harness_log.file = &harness_log_file;
+  harness_log.log_level = NGX_LOG_ERR;
+
+  harness_conf.library = nstr;
+  harness_conf.procedure = nstr;
+  harness_conf.init_proc = nstr;
+  harness_conf.cleanup_proc = nstr;
+  harness_conf.pool_name = nstr;
+  harness_conf.streaming = 0;
+  harness_conf.large_write = LARGE_WRITE_THRESHOLD;
+  harness_conf.vm_pool_size = VM_POOL_SIZE;
+  harness_conf.preload = 0;
+  harness_conf.warmup_proc = nstr;
+  harness_conf.cache = NULL;
+  harness_conf.status_format = 0;
+
+  /* context index 0 is used by the core module */
+  ngx_http_sagittarius_module.ctx_index = 1;
+  /* initialises the VM and '(sagittarius nginx internal)' */
+  harness_cycle.log = &harness_log;
+  if (ngx_http_sagittarius_init_process(&harness_cycle) != NGX_OK) {
+    fprintf(stderr, "Failed to initialise the module\n");
+    exit(1);
+  }
+}
+
+/* nginx-dispatch-request needs '(sagittarius nginx)' and a handler */
+static SgObject load_handler(void)
+{
+  SgObject lib, o;
+
+  Sg_AddLoadPath(SG_MAKE_STRING("../../scheme"), FALSE);
+  Sg_AddLoadPath(SG_MAKE_STRING("."), FALSE);
+  if (init_base_library(&harness_log) != NGX_OK) return SG_FALSE;
+  lib = Sg_FindLibrary(SG_INTERN("(micro handler)"), FALSE);
+  if (SG_FALSEP(lib)) return SG_FALSE;
+  o = Sg_FindBinding(lib, SG_INTERN("handler"), SG_UNBOUND);
+  if (SG_UNBOUNDP(o)) return SG_FALSE;
+  return SG_GLOC_GET(SG_GLOC(o));
+}
+
+static uint64_t allocated_bytes(void)
+{
+  return (uint64_t)GC_get_total_bytes();
+}
+
+static void report(const char *name, int64_t size, int64_t count,
+		   uint64_t elapsed, uint64_t allocated)
+{
+  printf("%-28s %10lld bytes %12.1f ns/op %12.1f B/op",
+	 name, (long long)size, (double)elapsed / count,
+	 (double)allocated / count);
+  if (size > 0) {
+    printf(" %10.1f MB/s", (double)(count * size) / elapsed * 1000.0);
+  }
+  printf("\n");
+}
+
+static void add_header(ngx_http_request_t *r, const char *name,
+		       const char *value, ngx_table_elt_t **slot)
+{
+  ngx_table_elt_t *h = ngx_list_push(&r->headers_in.headers);
+  size_t i;
+
+  h->key.len = ngx_strlen(name);
+  h->key.data = (u_char *)name;
+  h->value.len = ngx_strlen(value);
+  h->value.data = (u_char *)value;
+  h->lowcase_key = ngx_pnalloc(r->pool, h->key.len);
+  h->hash = 0;
+  for (i = 0; i < h->key.len; i++) {
+    h->lowcase_key[i] = ngx_tolower(h->key.data[i]);
+    h->hash = ngx_hash(h->hash, h->lowcase_key[i]);
+  }
+  if (slot) *slot = h;
+}
+
+static ngx_http_request_t *make_fake_request(ngx_pool_t *pool)
+{
+  ngx_http_request_t *r = ngx_pcalloc(pool, sizeof(ngx_http_request_t));
+
+  r->pool = pool;
+  r->connection = ngx_pcalloc(pool, sizeof(ngx_connection_t));
+  r->connection->log = &harness_log;
+  r->loc_conf = ngx_pcalloc(pool, sizeof(void *) * 2);
+  r->loc_conf[ngx_http_sagittarius_module.ctx_index] = &harness_conf;
+  ngx_list_init(&r->headers_in.headers, pool, 20, sizeof(ngx_table_elt_t));
+  ngx_list_init(&r->headers_out.headers, pool, 20, sizeof(ngx_table_elt_t));
+  ngx_str_set(&r->method_name, "GET");
+  ngx_str_set(&r->uri, "/micro/benchmark");
+  r->method = NGX_HTTP_GET;
+  return r;
+}
+
+/* a request as a browser would send */
+static void add_fake_headers(ngx_http_request_t *r)
+{
+  static char names[HARNESS_HEADERS - 4][16];
+  int i;
+
+  add_header(r, "Host", "localhost:8080", &r->headers_in.host);
+  add_header(r, "User-Agent", "Mozilla/5.0 (X11; Linux x86_64) micro",
+	     &r->headers_in.user_agent);
+  add_header(r, "Accept", "text/html,application/xhtml+xml", NULL);
+  add_header(r, "Accept-Encoding", "gzip, deflate", NULL);
+  for (i = 0; i < HARNESS_HEADERS - 4; i++) {
+    ngx_sprintf((u_char *)names[i], "X-Header-%d%Z", i);
+    add_header(r, names[i], "some header value", NULL);
+  }
+}
+
+/* the request body is in one memory buffer */
+static void set_fake_body(ngx_http_request_t *r, uint8_t *data, int64_t size)
+{
+  ngx_buf_t *b = ngx_calloc_buf(r->pool);
+  ngx_chain_t *cl = ngx_alloc_chain_link(r->pool);
+
+  b->pos = b->start = data;
+  b->last = b->end = data + size;
+  b->memory = 1;
+  b->last_buf = 1;
+  cl->buf = b;
+  cl->next = NULL;
+  r->request_body = ngx_pcalloc(r->pool, sizeof(ngx_http_request_body_t));
+  r->request_body->bufs = cl;
+  r->headers_in.content_length_n = size;
+}
+
+/* the byte by byte copy which was used before, for comparison */
+static int64_t legacy_put_u8_array(SgObject self, uint8_t *ba, int64_t size)
+{
+  int64_t written;
+  ngx_buf_t *buf;
+  unsigned char *be;
+
+  if (!SG_RESPONSE_OUTPUT_PORT_BUFFER(self)) {
+    allocate_buffer(self, BUFFER_SIZE);
+  }
+  buf = SG_RESPONSE_OUTPUT_PORT_BUFFER(self)->buf;
+  be = buf->pos + BUFFER_SIZE;
+  for (written = 0; written < size; written++) {
+    if (buf->last == be) {
+      allocate_buffer(self, BUFFER_SIZE);
+      buf = SG_RESPONSE_OUTPUT_PORT_BUFFER(self)->buf;
+      be = buf->pos + BUFFER_SIZE;
+    }
+    *buf->last++ = *ba++;
+  }
+  return written;
+}
+
+typedef int64_t (*put_proc_t)(SgObject, uint8_t *, int64_t);
+
+static void bench_put(const char *name, put_proc_t put,
+		      int64_t size, int64_t total)
+{
+  ngx_pool_t *pool = ngx_create_pool(16384, &harness_log);
+  ngx_http_request_t *r = make_fake_request(pool);
+  uint8_t *data = ngx_alloc(size, &harness_log);
+  int64_t i, count = total / size;
+  uint64_t start, elapsed, allocated;
+  SgObject port;
+
+  ngx_memset(data, 'a', size);
+  port = make_response_output_port(r, &harness_conf);
+  allocated = allocated_bytes();
+  start = now_ns();
+  for (i = 0; i < count; i++) {
+    put(port, data, size);
+  }
+  elapsed = now_ns() - start;
+  allocated = allocated_bytes() - allocated;
+
+  report(name, size, count, elapsed, allocated);
+  ngx_free(data);
+  ngx_destroy_pool(pool);
+}
+
+static void bench_read(int64_t size, int64_t total)
+{
+  ngx_pool_t *pool = ngx_create_pool(16384, &harness_log);
+  ngx_http_request_t *r = make_fake_request(pool);
+  uint8_t *data = ngx_alloc(size, &harness_log);
+  uint8_t *buf = ngx_alloc(size, &harness_log);
+  int64_t i, count = total / size;
+  uint64_t start, elapsed, allocated;
+  SgRequestInputPort *port;
+
+  ngx_memset(data, 'a', size);
+  set_fake_body(r, data, size);
+  port = SG_REQUEST_INPUT_PORT(make_request_input_port(r));
+  allocated = allocated_bytes();
+  start = now_ns();
+  for (i = 0; i < count; i++) {
+    /* rewinds the port to read the same body again */
+    port->current_chain = NULL;
+    port->current_buffer = NULL;
+    port->consumed = 0;
+    request_in_read_u8(SG_OBJ(port), buf, size);
+  }
+  elapsed = now_ns() - start;
+  allocated = allocated_bytes() - allocated;
+
+  report("read-u8", size, count, elapsed, allocated);
+  ngx_free(buf);
+  ngx_free(data);
+  ngx_destroy_pool(pool);
+}
+
+/*
+  The request specific operations. The state is reset by the operation
+  itself where it's needed, e.g. the lazily converted headers.
+ */
+typedef struct
+{
+  ngx_http_request_t *r;
+  SgObject context;
+  SgObject req;
+  SgObject resp;
+  SgObject handler;
+} bench_state_t;
+
+typedef void (*bench_proc_t)(bench_state_t *);
+
+static void op_make_request(bench_state_t *s)
+{
+  make_nginx_request(s->r, s->context);
+}
+
+static void op_make_response(bench_state_t *s)
+{
+  make_nginx_response(s->r);
+}
+
+static void op_headers(bench_state_t *s)
+{
+  SG_NGINX_REQUEST(s->req)->headers = SG_FALSE;
+  nr_headers(SG_NGINX_REQUEST(s->req));
+}
+
+static void op_header_fields(bench_state_t *s)
+{
+  SG_NGINX_REQUEST(s->req)->header_cached = 0;
+  nr_host(SG_NGINX_REQUEST(s->req));
+  nr_user_agent(SG_NGINX_REQUEST(s->req));
+}
+
+static void op_header_fields_cached(bench_state_t *s)
+{
+  nr_host(SG_NGINX_REQUEST(s->req));
+  nr_user_agent(SG_NGINX_REQUEST(s->req));
+}
+
+static void op_dispatch(bench_state_t *s)
+{
+  Sg_Apply3(nginx_dispatch, s->handler, s->req, s->resp);
+}
+
+/* what sagittarius_call does per request, without sending */
+static void op_request(bench_state_t *s)
+{
+  SgObject req = make_nginx_request(s->r, s->context);
+  SgObject resp = make_nginx_response(s->r);
+  SG_NGINX_REQUEST(req)->response = resp;
+  Sg_Apply3(nginx_dispatch, s->handler, req, resp);
+}
+
+static void bench_request(const char *name, bench_proc_t op,
+			  bench_state_t *s, int64_t count)
+{
+  int64_t i;
+  uint64_t start, elapsed, allocated;
+
+  allocated = allocated_bytes();
+  start = now_ns();
+  for (i = 0; i < count; i++) {
+    op(s);
+  }
+  elapsed = now_ns() - start;
+  allocated = allocated_bytes() - allocated;
+
+  report(name, 0, count, elapsed, allocated);
+}
+
+static void bench_requests(int64_t count)
+{
+  ngx_pool_t *pool = ngx_create_pool(16384, &harness_log);
+  bench_state_t s;
+
+  s.r = make_fake_request(pool);
+  add_fake_headers(s.r);
+  s.context = SG_FALSE;
+  s.req = make_nginx_request(s.r, s.context);
+  s.resp = make_nginx_response(s.r);
+  SG_NGINX_REQUEST(s.req)->response = s.resp;
+  s.handler = load_handler();
+
+  bench_request("make-nginx-request", op_make_request, &s, count);
+  bench_request("make-nginx-response", op_make_response, &s, count);
+  bench_request("nginx-request-headers", op_headers, &s, count);
+  bench_request("header fields", op_header_fields, &s, count);
+  bench_request("header fields (cached)", op_header_fields_cached, &s, count);
+  if (SG_PROCEDUREP(s.handler)) {
+    bench_request("nginx-dispatch-request", op_dispatch, &s, count);
+    bench_request("request (no I/O)", op_request, &s, count);
+  } else {
+    fprintf(stderr, "'(micro handler)' is not loaded, "
+	    "nginx-dispatch-request is skipped\n");
+  }
+  ngx_destroy_pool(pool);
+}
+
+int main(int argc, char **argv)
+{
+  static const int64_t sizes[] = { 16, 256, 4096, 65536, 1024 * 1024 };
+  const int64_t total = 64 * 1024 * 1024;
+  const int64_t count = 1000000;
+  size_t i;
+
+  init_harness();
+
+  printf("== request (%lld operations, %d headers)\n",
+	 (long long)count, HARNESS_HEADERS);
+  bench_requests(count);
+
+  printf("== response output port (%lld bytes in total)\n",
+	 (long long)total);
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    bench_put("put-u8-array (legacy)", legacy_put_u8_array, sizes[i], total);
+    bench_put("put-u8-array", response_out_put_u8_array, sizes[i], total);
+  }
+
+  printf("== request input port (%lld bytes in total)\n",
+	 (long long)total);
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    bench_read(sizes[i], total);
+  }
+  return 0;
+}
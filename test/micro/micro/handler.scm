@@ -0,0 +1,10 @@
+;; Handler of the in-process micro benchmark
+(library (micro handler)
+    (export handler)
+    (import (rnrs)
+	    (sagittarius nginx))
+
+(define (handler request response)
+  (nginx-request-host request)
+  (values 200 'text/plain))
+)
@@ -40,6 +40,49 @@ check_header() {
     return -1
 }
 
+check_no_header() {
+    name=$1
+
+    echo -n Header $name is not sent ...
+    while IFS= read -r line; do
+	if [[ $line =~ ^[[:space:]]*$ ]]
+	then
+	    break
+	elif [[ $line =~ ^$name[[:space:]]*: ]]
+	then
+	    echo not ok
+	    return -1
+	fi
+    done < $tempfile
+    echo ok
+    return 0
+}
+
+check_first_line() {
+    value=$1
+    echo -n First line is $value ...
+
+    line=`head -n 1 $tempfile`
+    if [[ $line =~ $value ]]; then
+	echo ok
+	return 0
+    else
+	echo "not ok (actual $line)"
+	return -1
+    fi
+}
+
+check_no_content() {
+    echo -n Response has no body ...
+    if [ `sed -n '/^\r*$/,$p' $tempfile | wc -c` -gt 2 ]; then
+	echo not ok
+	cat $tempfile
+	return -1
+    fi
+    echo ok
+    return 0
+}
+
 check_content() {
     value=$1
     content=0
@@ -76,6 +119,16 @@ check_status '200'
 check_header 'Content-Type' 'text/plain'
 check_content 'string'
 
+echo 
+echo "Test body"
+curl -si http://localhost:8080/body > $tempfile
+check_status '400'
+
+curl -si http://localhost:8080/body -d "body-content" > $tempfile
+check_status '200'
+check_content '^body-content'
+check_content 'port=body-content'
+
 echo 
 echo "Test header"
 curl -si http://localhost:8080/test-app > $tempfile
@@ -84,18 +137,24 @@ check_header "X-Sagittarius" [[:digit:]].[[:digit:]].[[:digit:]]
 check_header "X-Context-Parameter" "value0"
 check_header "X-Context-Parameter" "value1"
 check_header "X-Context-Path" "/test-app"
+check_header "ETag" '"v1"'
+check_header "X-Removed" "replaced"
+check_no_header 'X-Frame-Options'
 
 echo 
 echo "Test request"
 # Fragment won't be sent via cURL
 # see: https://curl.haxx.se/mail/lib-2011-11/0178.html
-curl -si 'http://localhost:8080/test-app/acc?k1=v1&k2=v2#frag' > $tempfile
+curl -si 'http://localhost:8080/test-app/acc?k1=v1&k2=v2#frag' \
+     -H 'X-Request-Id: req-0' -H 'X-Multi: a' -H 'x-multi: b' > $tempfile
 cat $tempfile
 check_status '200'
 check_content 'uri=/test-app/acc'
 check_content 'query=k1=v1&k2=v2'
 check_content 'original-uri=/test-app/acc\?k1=v1\&k2=v2'
 check_content 'request-line=GET /test-app/acc\?k1=v1\&k2=v2 HTTP/1.1'
+check_content 'request-id=req-0'
+check_content 'multi=,a,b'
 
 echo
 echo "Test cookie"
@@ -104,6 +163,215 @@ curl -si http://localhost:8080/cookie -H "Cookie: key0=value0; key1=value1;" \
 check_content 'key0=value0'
 check_content 'key1=value1'
 check_content 'key2=value2'
+check_content 'ref=value2'
+check_header 'Set-Cookie' 'session=abc; Path=/cookie; Max-Age=60; HttpOnly'
+curl -si 'http://localhost:8080/cookie?remove' > $tempfile
+check_status '200'
+check_no_header 'Set-Cookie'
+
+echo
+echo "Test streaming"
+curl -si http://localhost:8080/streaming > $tempfile
+check_status '200'
+check_header 'Transfer-Encoding' 'chunked'
+check_header 'Content-Type' 'text/plain'
+check_content 'chunk 0'
+check_content 'chunk 1'
+check_content 'chunk 2'
+curl -sI http://localhost:8080/streaming > $tempfile
+check_status '200'
+check_header 'Content-Type' 'text/plain'
+# curl -I doesn't read the body, so talk HTTP/1.0 directly
+exec 3<>/dev/tcp/localhost/8080
+printf 'HEAD /streaming HTTP/1.0\r\nHost: localhost\r\n\r\n' >&3
+cat <&3 > $tempfile
+exec 3<&-
+check_status '200'
+check_header 'Content-Type' 'text/plain'
+check_no_content
+
+echo
+echo "Test file"
+curl -si http://localhost:8080/file > $tempfile
+check_status '200'
+check_header 'Content-Length' '[[:digit:]]+'
+check_header 'Last-Modified' '.+GMT'
+check_content 'head'
+check_content 'library \(web file\)'
+curl -si 'http://localhost:8080/file?part' > $tempfile
+check_status '200'
+check_header 'Content-Length' '15'
+check_content 'example'
+curl -si 'http://localhost:8080/file?body' > $tempfile
+check_status '200'
+check_header 'Content-Length' '39'
+check_content 'bytevector'
+check_content 'example'
+check_content 'tail'
+
+echo
+echo "Test socket"
+curl -si http://localhost:8080/socket > $tempfile
+check_status '200'
+check_content 'HTTP/1.[01] 200'
+check_content 'pong from backend'
+curl -si 'http://localhost:8080/socket?error' > $tempfile
+check_status '502'
+# the backend counts the requests of the connection, so the 2nd and 3rd
+# ones show the pooled connection is reused
+for i in 1 2 3; do
+    curl -si 'http://localhost:8080/socket?pool' > $tempfile
+    check_status '200'
+    check_content "^pong from backend $i\$"
+done
+
+echo
+echo "Test subrequest"
+curl -si http://localhost:8080/subrequest > $tempfile
+check_status '200'
+check_content '^/socket-backend 200 pong from backend'
+check_content '^/subrequest-backend 202 accepted 1'
+check_content '^/subrequest-backend 202 accepted 2'
+curl -si 'http://localhost:8080/subrequest?large' > $tempfile
+check_status '200'
+check_content '^/subrequest-large 500 $'
+
+echo
+echo "Test shared dict"
+curl -si 'http://localhost:8080/dict?reset' > $tempfile
+check_content '^reset$'
+curl -si http://localhost:8080/dict > $tempfile
+check_status '200'
+check_content '^greeting none$'
+curl -si 'http://localhost:8080/dict?set' > $tempfile
+check_content '^stored once$'
+curl -si http://localhost:8080/dict > $tempfile
+check_content '^greeting hello expiring$'
+curl -si 'http://localhost:8080/dict?delete' > $tempfile
+check_content '^deleted yes$'
+for i in 1 2 3; do
+    curl -si 'http://localhost:8080/dict?incr' > $tempfile
+    check_content "^count $i\$"
+done
+
+echo
+echo "Test cache"
+curl -si 'http://localhost:8080/cache?a' > $tempfile
+check_status '200'
+check_content '^call 1$'
+check_header 'X-Response-Bytes' '7'
+check_header 'X-Handler-Time' '[0-9]+\.[0-9]{6}'
+curl -si 'http://localhost:8080/cache?a' > $tempfile
+check_status '200'
+check_header 'X-Handler' 'scheme'
+check_header 'Content-Type' 'text/plain'
+check_content '^call 1$'
+curl -si 'http://localhost:8080/cache?b' > $tempfile
+check_content '^call 2$'
+curl -si 'http://localhost:8080/cache?nocache' > $tempfile
+check_content '^call 3$'
+check_no_header 'X-Sagittarius-Cache'
+curl -si 'http://localhost:8080/cache?nocache' > $tempfile
+check_content '^call 4$'
+curl -sI 'http://localhost:8080/cache?head' > $tempfile
+check_status '200'
+curl -si 'http://localhost:8080/cache?head' > $tempfile
+check_content '^call 6$'
+curl -sI 'http://localhost:8080/cache?head' > $tempfile
+check_status '200'
+check_header 'Content-Length' '7'
+
+echo
+echo "Test status"
+curl -si http://localhost:8080/status > $tempfile
+check_status '200'
+check_content '^sagittarius_requests_total\{context="/cache"\} 8$'
+check_content '^sagittarius_cache_hits_total\{context="/cache"\} 2$'
+check_content '^sagittarius_gc_heap_bytes\{worker="0"\} [0-9]+$'
+curl -si 'http://localhost:8080/status?format=json' > $tempfile
+check_status '200'
+check_header 'Content-Type' 'application/json'
+check_content '"context":"/cache","requests":8,"cache_hits":2,'
+
+echo
+echo "Test pooled VM state"
+# vm_pool_size is 1, so both requests run on the same VM
+curl -si http://localhost:8080/vmstate > $tempfile
+check_status '200'
+check_content '^state clean$'
+# the first request loads the library before it's posted to the thread
+check_header 'X-Context-Time' '([1-9][0-9]*\.[0-9]{6}|0\.0*[1-9][0-9]*)'
+check_header 'X-Queue-Time' '[0-9]+\.[0-9]{6}'
+curl -si http://localhost:8080/vmstate > $tempfile
+check_content '^state clean$'
+
+echo
+echo "Test thread pool limits"
+curl -s 'http://localhost:8080/limited?slow' > /dev/null &
+sleep 0.3
+curl -si http://localhost:8080/limited > $tempfile
+check_status '503'
+check_header 'Retry-After' '2'
+wait
+curl -si http://localhost:8080/limited > $tempfile
+check_status '200'
+check_content '^limited$'
+
+# the held request is rejected by queue_timeout before the slow one ends
+curl -s 'http://localhost:8080/timeout?slow' > /dev/null &
+sleep 0.3
+curl -si http://localhost:8080/timeout > $tempfile
+check_status '503'
+check_header 'Retry-After' '1'
+wait
+curl -si http://localhost:8080/status > $tempfile
+check_content '^sagittarius_thread_pool_rejected_total\{context="/timeout"\} 1$'
+
+# the high request overtakes the low one held by max_concurrency
+: > $tempfile
+curl -s 'http://localhost:8080/prioritized?slow' > /dev/null &
+sleep 0.3
+(curl -s -H 'X-Priority: low' 'http://localhost:8080/prioritized?slow' \
+     > /dev/null; echo low >> $tempfile) &
+sleep 0.3
+(curl -s -H 'X-Priority: high' http://localhost:8080/prioritized \
+     > /dev/null; echo high >> $tempfile) &
+wait
+check_first_line '^high$'
+
+echo
+echo "Test executor"
+curl -si http://localhost:8080/status > $tempfile
+check_content '^sagittarius_executor_threads\{worker="0"\} 1$'
+# the only thread takes all of them, so threads are added after
+# grow_latency while it's still busy, and they steal the queued requests
+for i in 1 2 3; do
+    curl -s 'http://localhost:8080/executor?slow' > /dev/null &
+done
+sleep 0.5
+curl -si http://localhost:8080/status > $tempfile
+check_content '^sagittarius_executor_threads\{worker="0"\} [2-4]$'
+check_content '^sagittarius_executor_steals_total\{worker="0"\} [1-9][0-9]*$'
+curl -si http://localhost:8080/executor > $tempfile
+check_status '200'
+check_content '^limited$'
+wait
+curl -s -H 'X-Priority: high' http://localhost:8080/executor > /dev/null
+curl -si http://localhost:8080/status > $tempfile
+check_content '^sagittarius_thread_pool_queue_seconds_count\{context="/executor",lane="high"\} 1$'
+check_content '^sagittarius_thread_pool_queue_seconds_count\{context="/executor",lane="normal"\} 4$'
+# the added threads exit after idle_timeout
+sleep 3
+curl -si http://localhost:8080/status > $tempfile
+check_content '^sagittarius_executor_threads\{worker="0"\} 1$'
+
+echo
+echo "Test preload"
+# the context is created on the worker start, at least a second before
+sleep 1
+curl -si http://localhost:8080/preload > $tempfile
+check_status '200'
+check_content '^warmed up /preload [0-9]{4,} ms ago$'
 
 echo
 echo "Test no lib"
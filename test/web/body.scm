@@ -0,0 +1,22 @@
+;; example application for Sagittarius NGINX
+(library (web body)
+    (export run)
+    (import (rnrs)
+	    (sagittarius nginx))
+
+(define (run request response) 
+  (define out (nginx-response-output-port response))
+  (let ((body (nginx-request-body-bytevector request)))
+    (cond (body
+	   (put-bytevector out body)
+	   (put-bytevector out (string->utf8 "\n"))
+	   (for-each (lambda (bv) (put-bytevector out bv))
+		     (nginx-request-body-bytevector request #t))
+	   (put-bytevector out (string->utf8 "\n"))
+	   (let ((all (get-bytevector-all (nginx-request-input-port request))))
+	     (put-bytevector out (string->utf8 "port="))
+	     (put-bytevector out all))
+	   (values 200 'text/plain))
+	  (else (values 400 'text/plain)))))
+
+)
@@ -0,0 +1,18 @@
+;; example application for Sagittarius NGINX
+;; counts the calls, so the cached responses can be seen
+(library (web cache)
+    (export run)
+    (import (rnrs)
+	    (sagittarius nginx))
+
+(define count 0)
+
+(define (run request response)
+  (set! count (+ count 1))
+  (nginx-response-header-set! response "X-Handler" "scheme")
+  (when (string=? (nginx-request-query-string request) "nocache")
+    (nginx-response-header-set! response "X-Sagittarius-Cache" "no"))
+  (values 200 'text/plain
+	  (list "call " (number->string count) "\n")))
+
+)
@@ -11,6 +11,14 @@
   (for-each (lambda (cookie)
 	      (put-string out (cookie->string cookie)) (put-string out "\n"))
 	    (nginx-request-cookies request))
+  (put-string out "ref=")
+  (put-string out (or (nginx-request-cookie-ref request "key2") "none"))
+  (put-string out "\n")
+  (nginx-response-cookie-add! response "session" "abc"
+			      :path "/cookie" :max-age 60 :http-only #t)
+  ;; the added cookie is a normal header
+  (when (equal? (nginx-request-query-string request) "remove")
+    (nginx-response-header-remove! response "Set-Cookie"))
   (values 200 'text/plain))
 
 )
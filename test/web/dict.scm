@@ -0,0 +1,36 @@
+;; example application for Sagittarius NGINX
+;; shares values among the worker processes
+(library (web dict)
+    (export run)
+    (import (rnrs)
+	    (sagittarius nginx))
+
+(define (reply . body) (values 200 'text/plain (append body '("\n"))))
+
+(define (run request response)
+  (let ((dict (nginx-shared-dict "test"))
+	(query (nginx-request-query-string request)))
+    (cond ((string=? query "set")
+	   (nginx-shared-dict-set! dict "greeting" "hello" 60000)
+	   (reply "stored " (if (nginx-shared-dict-add! dict "greeting" "bye")
+				"twice"
+				"once")))
+	  ((string=? query "incr")
+	   (reply "count "
+		  (number->string (nginx-shared-dict-incr! dict "count" 1 0))))
+	  ((string=? query "reset")
+	   ;; the shared memory survives reloads, so the tests start here
+	   (nginx-shared-dict-delete! dict "greeting")
+	   (nginx-shared-dict-delete! dict "count")
+	   (reply "reset"))
+	  ((string=? query "delete")
+	   (reply "deleted "
+		  (if (nginx-shared-dict-delete! dict "greeting") "yes" "no")))
+	  (else
+	   (reply "greeting "
+		  (nginx-shared-dict-ref dict "greeting" "none")
+		  (if (positive? (or (nginx-shared-dict-ttl dict "greeting") 0))
+		      " expiring"
+		      ""))))))
+
+)
@@ -0,0 +1,24 @@
+;; example application for Sagittarius NGINX
+(library (web file)
+    (export run)
+    (import (rnrs)
+	    (sagittarius nginx))
+
+(define (run request response) 
+  (define context (nginx-request-context request))
+  (define file (nginx-context-parameter-ref context "file"))
+  (define query (nginx-request-query-string request))
+  (put-bytevector (nginx-response-output-port response)
+		  (string->utf8 "head\n"))
+  (cond ((string=? query "part")
+	 (nginx-response-send-file response file 3 10)
+	 (values 200 'text/plain))
+	((string=? query "body")
+	 (values 200 'text/plain
+		 (list "string\n" (string->utf8 "bytevector\n") ""
+		       (make-nginx-file-reference file 3 10) "\ntail\n")))
+	(else
+	 (nginx-response-send-file response file)
+	 (values 200 'text/plain))))
+
+)
@@ -0,0 +1,13 @@
+;; example application for Sagittarius NGINX
+;; slow handler to fill the limit of the location
+(library (web limited)
+    (export run)
+    (import (rnrs)
+	    (sagittarius threads)
+	    (sagittarius nginx))
+
+(define (run request response)
+  (when (equal? (nginx-request-query-string request) "slow")
+    (thread-sleep! 1))
+  (values 200 'text/plain (list "limited\n")))
+)
@@ -0,0 +1,30 @@
+;; example application for Sagittarius NGINX
+(library (web preload)
+    (export run warmup)
+    (import (rnrs)
+	    (srfi :19 time)
+	    (sagittarius nginx))
+
+(define (current-msec)
+  (let ((t (current-time)))
+    (+ (* (time-second t) 1000) (div (time-nanosecond t) 1000000))))
+
+(define warmed-up #f)
+(define warmed-up-at #f)
+(define (warmup context)
+  (set! warmed-up-at (current-msec))
+  (set! warmed-up (nginx-context-path context)))
+
+;; with preload, the context is created long before the first request
+(define (run request response) 
+  (define out (transcoded-port (nginx-response-output-port response)
+			       (native-transcoder)))
+  (if warmed-up
+      (put-string out (string-append "warmed up " warmed-up " "
+				     (number->string
+				      (- (current-msec) warmed-up-at))
+				     " ms ago\n"))
+      (put-string out "cold\n"))
+  (values 200 'text/plain))
+
+)
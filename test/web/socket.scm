@@ -0,0 +1,77 @@
+;; example application for Sagittarius NGINX
+;; talks to /socket-backend over a non blocking socket
+(library (web socket)
+    (export run)
+    (import (rnrs)
+	    (sagittarius nginx))
+
+(define (request-line version)
+  (string->utf8
+   (string-append "GET /socket-backend HTTP/" version
+		  "\r\nHost: localhost\r\n\r\n")))
+
+(define (failed e)
+  (values 502 'text/plain (list "socket error\n")))
+
+;; HTTP/1.0, read until the backend closes the connection
+(define (run-once request address)
+  (nginx-socket-connect request address
+   (lambda (socket)
+     (if (nginx-socket? socket)
+	 (nginx-socket-send socket (request-line "1.0")
+	  (lambda (socket)
+	    (if (nginx-socket? socket)
+		(let loop ((received '()))
+		  (nginx-socket-receive socket 4096
+		   (lambda (bv)
+		     (cond ((bytevector? bv) (loop (cons bv received)))
+			   ((eof-object? bv)
+			    (nginx-socket-close socket)
+			    (values 200 'text/plain (reverse received)))
+			   (else (failed bv))))))
+		(failed socket))))
+	 (failed socket)))))
+
+;; HTTP/1.1, the connection is returned to the pool after the body
+(define (run-pooled request)
+  ;; the body ends with a newline, after the number of the requests
+  (define (complete? received)
+    (let ((s (utf8->string received)))
+      (let loop ((i 0))
+	(cond ((> (+ i 17) (string-length s)) #f)
+	      ((string=? (substring s i (+ i 17)) "pong from backend")
+	       (char=? (string-ref s (- (string-length s) 1)) #\newline))
+	      (else (loop (+ i 1)))))))
+  (nginx-socket-connect request "127.0.0.1:8080"
+   (lambda (socket)
+     (if (nginx-socket? socket)
+	 (nginx-socket-send socket (request-line "1.1")
+	  (lambda (socket)
+	    (if (nginx-socket? socket)
+		(let loop ((received #vu8()))
+		  (nginx-socket-receive socket 4096
+		   (lambda (bv)
+		     (if (bytevector? bv)
+			 (let ((all (bytevector-append received bv)))
+			   (cond ((complete? all)
+				  (nginx-socket-release socket)
+				  (values 200 'text/plain (list all)))
+				 (else (loop all))))
+			 (failed bv)))))
+		(failed socket))))
+	 (failed socket)))
+   :pool "backend" :max-idle 2 :max-requests 10))
+
+(define (bytevector-append a b)
+  (let ((r (make-bytevector (+ (bytevector-length a) (bytevector-length b)))))
+    (bytevector-copy! a 0 r 0 (bytevector-length a))
+    (bytevector-copy! b 0 r (bytevector-length a) (bytevector-length b))
+    r))
+
+(define (run request response)
+  (let ((query (nginx-request-query-string request)))
+    (cond ((string=? query "error") (run-once request "127.0.0.1:1"))
+	  ((string=? query "pool") (run-pooled request))
+	  (else (run-once request "127.0.0.1:8080")))))
+
+)
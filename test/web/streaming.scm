@@ -0,0 +1,19 @@
+;; example application for Sagittarius NGINX
+(library (web streaming)
+    (export run)
+    (import (rnrs)
+	    (sagittarius nginx))
+
+(define (run request response) 
+  (define out (nginx-response-output-port response))
+  (nginx-response-content-type-set! response "text/plain")
+  (put-bytevector out (string->utf8 "chunk 0\n"))
+  (flush-output-port out)
+  ;; bigger than the internal buffer, so this is sent without flushing
+  (put-bytevector out (make-bytevector 10000 (char->integer #\a)))
+  (put-bytevector out (string->utf8 "\nchunk 1\n"))
+  (flush-output-port out)
+  (put-bytevector out (string->utf8 "chunk 2\n"))
+  (values 200 'text/plain))
+
+)
@@ -0,0 +1,26 @@
+;; example application for Sagittarius NGINX
+;; fan-out to the backends and aggregate the responses
+(library (web subrequest)
+    (export run)
+    (import (rnrs)
+	    (sagittarius nginx))
+
+(define (run request response)
+  (define subrequests
+    (if (string=? (nginx-request-query-string request) "large")
+	;; fails, but the parent request continues
+	(list (nginx-subrequest request "/subrequest-large"))
+	(list (nginx-subrequest request "/socket-backend")
+	      (nginx-subrequest request "/subrequest-backend" "n=1")
+	      (nginx-subrequest request "/subrequest-backend" "n=2"))))
+  (nginx-subrequests-wait request subrequests
+   (lambda (subrequests)
+     (values 200 'text/plain
+	     (apply append
+		    (map (lambda (sr)
+			   (list (nginx-subrequest-uri sr) " "
+				 (number->string (nginx-subrequest-status sr))
+				 " " (nginx-subrequest-body sr) "\n"))
+			 subrequests))))))
+
+)
@@ -18,6 +18,12 @@
 	 (put-key&value out "original-uri" (nginx-request-original-uri request))
 	 (put-key&value out "query" (nginx-request-query-string request))
 	 (put-key&value out "request-line" (nginx-request-request-line request))
+	 (put-key&value out "request-id"
+			(or (nginx-request-header-ref request "x-request-id")
+			    "none"))
+	 (put-key&value out "multi"
+			(fold-left (lambda (acc v) (string-append acc "," v)) ""
+			 (nginx-request-header-values request "X-Multi")))
 	 )
 	(else
 	 (put-string out "Test application\n")
@@ -28,7 +34,13 @@
 	 (nginx-response-header-add! response "X-Context-Parameter"
 	   (nginx-context-parameter-ref context "key1"))
 	 (nginx-response-header-add! response "X-Context-Path"
-	   (nginx-context-path context))))
+	   (nginx-context-path context))
+	 (nginx-response-header-add! response "X-Removed" "removed")
+	 (nginx-response-headers-set! response
+	  '(("X-Frame-Options" "DENY")
+	    ("ETag" . "\"v1\"")
+	    ("x-removed" "replaced")))
+	 (nginx-response-header-remove! response "X-Frame-Options")))
   (values 200 'text/plain))
 
 )
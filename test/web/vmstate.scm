@@ -0,0 +1,17 @@
+;; example application for Sagittarius NGINX
+;; modifies the VM state, the next request mustn't see it
+(library (web vmstate)
+    (export run)
+    (import (rnrs)
+	    (sagittarius nginx)
+	    (srfi :39 parameters))
+
+(define state (make-parameter "clean"))
+
+(define (run request response)
+  (let ((before (state)))
+    (state "dirty")
+    (values 200 'text/plain
+	    (list "state " before "\n"))))
+
+)